@@ -0,0 +1,527 @@
+#include "../KD_tree/KD_tree.h"
+#include "../KD_tree/KD_tree_concurrent.h"
+#include "../KD_tree/VP_tree.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace BK_KD_tree;
+
+namespace KD_treeBenchmarks
+{
+	//Squared euclidean distance for Point and Tuple keys
+	template<typename T>
+	struct DistanceCalculator
+	{
+	public:
+		double get_cartesian_distance(const T &key1, const T &key2) const
+		{
+			return _get_cartesian_distance<T::dimension() - 1>(key1, key2);
+		}
+
+		template<size_t N>
+		double get_distance_to_plane(const T &key1, const T &key2) const
+		{
+			double distance = double(T::template get<N>(key1)) - double(T::template get<N>(key2));
+			return distance * distance;
+		}
+
+	private:
+		template<size_t N>
+		double _get_cartesian_distance(const T &key1, const T &key2) const
+		{
+			//the recursion stops at dimension 0
+			return get_distance_to_plane<N>(key1, key2) + (N > 0 ? _get_cartesian_distance<(N > 0 ? N - 1 : 0)>(key1, key2) : 0.0);
+		}
+	};
+
+	//Euclidean distance, a metric as required by VP_tree; the distance to a plane is the linear distance along its axis
+	template<typename T>
+	struct EuclideanDistance
+	{
+	public:
+		double get_cartesian_distance(const T &key1, const T &key2) const
+		{
+			return std::sqrt(DistanceCalculator<T>().get_cartesian_distance(key1, key2));
+		}
+
+		template<size_t N>
+		double get_distance_to_plane(const T &key1, const T &key2) const
+		{
+			return std::fabs(double(T::template get<N>(key1)) - double(T::template get<N>(key2)));
+		}
+	};
+
+	//---------------------------------------------------------------------------------------------
+
+	enum class Distribution { uniform, clustered, sorted };
+
+	const char* to_string(Distribution distribution)
+	{
+		switch (distribution)
+		{
+		case Distribution::uniform: return "uniform";
+		case Distribution::clustered: return "clustered";
+		default: return "sorted";
+		}
+	}
+
+	struct Options
+	{
+		size_t n = 100000;
+		size_t queries = 10000;
+		unsigned seed = 1;
+		bool json = false;
+	};
+
+	struct Result
+	{
+		std::string tree;
+		std::string distribution;
+		std::string operation;
+		size_t n;
+		size_t k;
+		size_t count;
+		double ops_per_sec;
+		double p50_ns;
+		double p99_ns;
+		size_t bytes;
+	};
+
+	//---------------------------------------------------------------------------------------------
+
+	//Times every operation individually; the clock overhead (tens of nanoseconds) is included in the latencies
+	class Timer
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		explicit Timer(size_t count) { m_samples.reserve(count); m_start = clock::now(); }
+
+		template<typename Op>
+		void time(Op &&op)
+		{
+			auto begin = clock::now();
+			op();
+			m_samples.push_back(double(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - begin).count()));
+		}
+
+		Result result(const std::string &tree, Distribution distribution, const std::string &operation, size_t n, size_t k, size_t bytes)
+		{
+			double elapsed = std::chrono::duration<double>(clock::now() - m_start).count();
+			std::sort(m_samples.begin(), m_samples.end());
+			return Result{ tree, to_string(distribution), operation, n, k, m_samples.size(), elapsed > 0 ? double(m_samples.size()) / elapsed : 0.0,
+				percentile(0.5), percentile(0.99), bytes };
+		}
+
+	private:
+		double percentile(double fraction) const
+		{
+			if (m_samples.empty())
+				return 0.0;
+			return m_samples[std::min(m_samples.size() - 1, static_cast<size_t>(fraction * double(m_samples.size())))];
+		}
+
+		std::vector<double> m_samples;
+		clock::time_point m_start;
+	};
+
+	//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim>
+	std::vector<std::array<int, Dim>> make_coords(size_t n, Distribution distribution, std::mt19937 &random_engine)
+	{
+		std::vector<std::array<int, Dim>> coords(n);
+		std::uniform_int_distribution<int> uniform(0, 1000000);
+		std::vector<std::array<int, Dim>> centers(16);
+		for (auto &center : centers)
+			for (auto &coord : center)
+				coord = uniform(random_engine);
+
+		std::normal_distribution<double> spread(0.0, 2000.0);
+		for (auto &point : coords)
+		{
+			const auto &center = centers[random_engine() % centers.size()];
+			for (size_t i = 0; i < Dim; ++i)
+				point[i] = distribution == Distribution::clustered ? center[i] + static_cast<int>(spread(random_engine)) : uniform(random_engine);
+		}
+
+		return coords;
+	}
+
+	template<typename Key, size_t Dim, size_t... I>
+	Key make_key(const std::array<int, Dim> &coords, std::index_sequence<I...>)
+	{
+		return Key(coords[I]...);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename DimWrapper>
+	void run_suite(const std::string &name, Distribution distribution, const Options &options, std::vector<Result> &results)
+	{
+		typedef KD_tree<Dim, int, Comparer_wrapper<std::less>, DimWrapper, false> tree_type;
+		typedef typename tree_type::key_type key_type;
+
+		std::mt19937 random_engine(options.seed);
+		size_t n = options.n;
+		//the queries are drawn from the same clusters as the keys
+		auto coords = make_coords<Dim>(n + options.queries, distribution, random_engine);
+		//lexicographically sorted input, as when loading data ordered by its first coordinate
+		if (distribution == Distribution::sorted)
+			std::sort(coords.begin(), coords.begin() + n);
+
+		std::vector<key_type> keys, probes;
+		for (size_t i = 0; i < coords.size(); ++i)
+			(i < n ? keys : probes).push_back(make_key<key_type>(coords[i], std::make_index_sequence<Dim>()));
+
+		tree_type tree;
+		{
+			Timer timer(keys.size());
+			for (size_t i = 0; i < keys.size(); ++i)
+				timer.time([&] { tree.insert(int(i), keys[i]); });
+			results.push_back(timer.result(name, distribution, "insert", n, 0, tree.diagnostics().node_bytes));
+		}
+		size_t bytes = tree.diagnostics().node_bytes;
+
+		{
+			//bulk build the same keys, with the nodes allocated along a Hilbert curve
+			std::vector<std::pair<key_type, int>> values;
+			for (size_t i = 0; i < keys.size(); ++i)
+				values.emplace_back(keys[i], int(i));
+			Timer timer(1);
+			timer.time([&] { tree_type built(values.begin(), values.end()); });
+			results.push_back(timer.result(name, distribution, "build", n, 0, bytes));
+		}
+
+		{
+			Timer timer(options.queries);
+			volatile int sink = 0;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = sink + tree.at(keys[random_engine() % keys.size()]); });
+			results.push_back(timer.result(name, distribution, "at", n, 0, bytes));
+		}
+
+		{
+			Timer timer(options.queries);
+			volatile bool sink = false;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = tree.contains(probes[i]); });
+			results.push_back(timer.result(name, distribution, "contains", n, 0, bytes));
+		}
+		{
+			//all of the probes in one batch, with interleaved searches
+			Timer timer(1);
+			volatile size_t sink = 0;
+			timer.time([&] { sink = tree.contains_batch(Interleaved(), probes.begin(), probes.end()).size(); });
+			results.push_back(timer.result(name, distribution, "contains_batch", n, 0, bytes));
+		}
+
+		const size_t ks[] = { 1, 10, 100 };
+		for (size_t k : ks)
+		{
+			Timer timer(options.queries);
+			volatile size_t sink = 0;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = tree.KNN_search(k, DistanceCalculator<key_type>(), probes[i]).size(); });
+			results.push_back(timer.result(name, distribution, "KNN_search", n, k, bytes));
+		}
+		for (size_t k : ks)
+		{
+			Timer timer(options.queries);
+			volatile size_t sink = 0;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = tree.KNN_search(Best_first(), k, DistanceCalculator<key_type>(), probes[i]).size(); });
+			results.push_back(timer.result(name, distribution, "best_first", n, k, bytes));
+		}
+		{
+			//all of the queries in one batch, which is searched in the order of a Hilbert curve
+			Timer timer(1);
+			volatile size_t sink = 0;
+			timer.time([&] { sink = tree.KNN_search_batch(10, DistanceCalculator<key_type>(), probes.begin(), probes.end()).size(); });
+			results.push_back(timer.result(name, distribution, "KNN_batch", n, 10, bytes));
+		}
+		{
+			Timer timer(1);
+			volatile size_t sink = 0;
+			timer.time([&] { sink = tree.KNN_search_batch(Interleaved(), 10, DistanceCalculator<key_type>(), probes.begin(), probes.end()).size(); });
+			results.push_back(timer.result(name, distribution, "KNN_interleaved", n, 10, bytes));
+		}
+
+		{
+			//move a sample of the keys by a small step, as when tracking moving objects: by an erase and an insert,
+			//by update_key, and by update_key_batch as one tick of updates
+			std::vector<size_t> sample(keys.size());
+			std::iota(sample.begin(), sample.end(), size_t(0));
+			std::shuffle(sample.begin(), sample.end(), random_engine);
+			sample.resize(std::min(options.queries, keys.size()));
+			auto step = [&](size_t i)
+			{
+				for (auto &coord : coords[i])
+					coord += int(random_engine() % 201) - 100;
+				return make_key<key_type>(coords[i], std::make_index_sequence<Dim>());
+			};
+
+			{
+				Timer timer(sample.size());
+				for (size_t i : sample)
+				{
+					key_type to = step(i);
+					timer.time([&] { int value = tree.at(keys[i]); tree.erase(keys[i]); tree.insert(value, to); });
+					keys[i] = to;
+				}
+				results.push_back(timer.result(name, distribution, "erase_insert", n, 0, bytes));
+			}
+			{
+				Timer timer(sample.size());
+				for (size_t i : sample)
+				{
+					key_type to = step(i);
+					timer.time([&] { tree.update_key(keys[i], to); });
+					keys[i] = to;
+				}
+				results.push_back(timer.result(name, distribution, "update_key", n, 0, bytes));
+			}
+			{
+				std::vector<std::pair<key_type, key_type>> moves;
+				for (size_t i : sample)
+				{
+					moves.emplace_back(keys[i], step(i));
+					keys[i] = moves.back().second;
+				}
+				Timer timer(1);
+				timer.time([&] { tree.update_key_batch(moves.begin(), moves.end()); });
+				results.push_back(timer.result(name, distribution, "update_batch", n, 0, bytes));
+			}
+		}
+
+		{
+			//erase half of the keys in random order
+			std::shuffle(keys.begin(), keys.end(), random_engine);
+			Timer timer(keys.size() / 2);
+			for (size_t i = 0; i < keys.size() / 2; ++i)
+				timer.time([&] { tree.erase(keys[i]); });
+			results.push_back(timer.result(name, distribution, "erase", n, 0, tree.diagnostics().node_bytes));
+		}
+
+		{
+			//rebuild what is left of the tree on every hardware thread
+			Timer timer(1);
+			timer.time([&] { tree.rebalance(0); });
+			results.push_back(timer.result(name, distribution, "rebalance", tree.size(), 0, tree.diagnostics().node_bytes));
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	//Runs the operations shared by KD_tree and VP_tree on one engine, so that the two can be compared row by row
+	template<typename Tree>
+	void run_engine(const std::string &name, Distribution distribution, const Options &options, std::vector<typename Tree::key_type> keys,
+		const std::vector<typename Tree::key_type> &probes, double radius, std::vector<Result> &results)
+	{
+		typedef typename Tree::key_type key_type;
+		std::mt19937 random_engine(options.seed);
+		size_t n = keys.size();
+
+		Tree tree;
+		{
+			Timer timer(keys.size());
+			for (size_t i = 0; i < keys.size(); ++i)
+				timer.time([&] { tree.insert(int(i), keys[i]); });
+			results.push_back(timer.result(name, distribution, "insert", n, 0, 0));
+		}
+		{
+			std::vector<std::pair<key_type, int>> values;
+			for (size_t i = 0; i < keys.size(); ++i)
+				values.emplace_back(keys[i], int(i));
+			Timer timer(1);
+			timer.time([&] { Tree built(values.begin(), values.end()); });
+			results.push_back(timer.result(name, distribution, "build", n, 0, 0));
+		}
+
+		const size_t ks[] = { 1, 10, 100 };
+		for (size_t k : ks)
+		{
+			Timer timer(options.queries);
+			volatile size_t sink = 0;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = tree.KNN_search(k, EuclideanDistance<key_type>(), probes[i]).size(); });
+			results.push_back(timer.result(name, distribution, "KNN_search", n, k, 0));
+		}
+		{
+			//the radius holds about 10 values around a typical probe
+			Timer timer(options.queries);
+			volatile size_t sink = 0;
+			for (size_t i = 0; i < options.queries; ++i)
+				timer.time([&] { sink = tree.radius_search(radius, EuclideanDistance<key_type>(), probes[i]).size(); });
+			results.push_back(timer.result(name, distribution, "radius_search", n, 10, 0));
+		}
+		{
+			std::shuffle(keys.begin(), keys.end(), random_engine);
+			Timer timer(keys.size() / 2);
+			for (size_t i = 0; i < keys.size() / 2; ++i)
+				timer.time([&] { tree.erase(keys[i]); });
+			results.push_back(timer.result(name, distribution, "erase", n, 0, 0));
+		}
+	}
+
+	//Compares KD_tree with VP_tree under the euclidean metric, which both trees support
+	template<size_t Dim>
+	void run_metric_suite(const std::string &name, Distribution distribution, const Options &options, std::vector<Result> &results)
+	{
+		typedef KD_tree<Dim, int, Comparer_wrapper<std::less>, Type_wrapper<int>, false> tree_type;
+		typedef VP_tree<Dim, int, Comparer_wrapper<std::less>, Type_wrapper<int>, false, EuclideanDistance<typename tree_type::key_type>> vp_tree_type;
+		typedef typename tree_type::key_type key_type;
+
+		std::mt19937 random_engine(options.seed);
+		auto coords = make_coords<Dim>(options.n + options.queries, distribution, random_engine);
+		std::vector<key_type> keys, probes;
+		for (size_t i = 0; i < coords.size(); ++i)
+			(i < options.n ? keys : probes).push_back(make_key<key_type>(coords[i], std::make_index_sequence<Dim>()));
+
+		//the median distance from a sample of the probes to their 10th nearest key
+		std::vector<std::pair<key_type, int>> values;
+		for (size_t i = 0; i < keys.size(); ++i)
+			values.emplace_back(keys[i], int(i));
+		tree_type sample_tree(values.begin(), values.end());
+		std::vector<double> radii;
+		for (size_t i = 0; i < std::min<size_t>(probes.size(), 101); ++i)
+		{
+			auto result = sample_tree.KNN_search(10, EuclideanDistance<key_type>(), probes[i]);
+			radii.push_back(std::max_element(result.begin(), result.end())->first);
+		}
+		std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+		double radius = radii.empty() ? 0.0 : radii[radii.size() / 2];
+
+		run_engine<tree_type>(name + "_kd", distribution, options, keys, probes, radius, results);
+		run_engine<vp_tree_type>(name + "_vp", distribution, options, keys, probes, radius, results);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	//Inserts the keys from a number of threads, each with its own slice, and returns the aggregate throughput
+	template<typename Insert>
+	Result time_writers(const std::string &name, Distribution distribution, const std::string &operation, size_t n, size_t threads, Insert insert)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		std::vector<std::thread> writers;
+		for (size_t t = 0; t < threads; ++t)
+			writers.emplace_back([&insert, n, threads, t] { for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) insert(i); });
+		for (auto &writer : writers)
+			writer.join();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		return Result{ name, to_string(distribution), operation, n, threads, n, elapsed > 0 ? double(n) / elapsed : 0.0, 0.0, 0.0, 0 };
+	}
+
+	//Compares inserts from several threads into a Concurrent_KD_tree with inserts into a KD_tree guarded by one mutex. Both trees start
+	//from a balanced tree over 1% of the keys, and the k column holds the number of threads.
+	template<size_t Dim>
+	void run_concurrent_suite(const std::string &name, Distribution distribution, const Options &options, std::vector<Result> &results)
+	{
+		typedef KD_tree<Dim, int, Comparer_wrapper<std::less>, Type_wrapper<int>, false> tree_type;
+		typedef Concurrent_KD_tree<Dim, int, Comparer_wrapper<std::less>, Type_wrapper<int>, false> concurrent_type;
+		typedef typename tree_type::key_type key_type;
+
+		std::mt19937 random_engine(options.seed);
+		size_t seed_count = options.n / 100;
+		auto coords = make_coords<Dim>(options.n + seed_count, distribution, random_engine);
+		std::vector<std::pair<key_type, int>> seed;
+		std::vector<key_type> keys;
+		for (size_t i = 0; i < coords.size(); ++i)
+		{
+			key_type key = make_key<key_type>(coords[i], std::make_index_sequence<Dim>());
+			if (i < seed_count)
+				seed.emplace_back(key, int(i));
+			else
+				keys.push_back(key);
+		}
+
+		const size_t thread_counts[] = { 1, 2, 4, 8 };
+		for (size_t threads : thread_counts)
+		{
+			concurrent_type concurrent(seed.begin(), seed.end());
+			results.push_back(time_writers(name, distribution, "insert_cas", keys.size(), threads, [&](size_t i) { concurrent.try_insert(int(i), keys[i]); }));
+
+			tree_type tree(seed.begin(), seed.end());
+			std::mutex lock;
+			results.push_back(time_writers(name, distribution, "insert_mutex", keys.size(), threads, [&](size_t i)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				tree.insert(int(i), keys[i]);
+			}));
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	void print(const std::vector<Result> &results, bool json)
+	{
+		if (!json)
+			std::printf("%-10s %-10s %-15s %8s %4s %8s %14s %10s %10s %12s\n", "tree", "dist", "operation", "n", "k", "count", "ops/s", "p50 ns", "p99 ns", "node bytes");
+
+		for (const auto &r : results)
+		{
+			if (json)
+				std::printf("{\"tree\":\"%s\",\"distribution\":\"%s\",\"operation\":\"%s\",\"n\":%zu,\"k\":%zu,\"count\":%zu,\"ops_per_sec\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"node_bytes\":%zu}\n",
+					r.tree.c_str(), r.distribution.c_str(), r.operation.c_str(), r.n, r.k, r.count, r.ops_per_sec, r.p50_ns, r.p99_ns, r.bytes);
+			else
+				std::printf("%-10s %-10s %-15s %8zu %4zu %8zu %14.1f %10.0f %10.0f %12zu\n",
+					r.tree.c_str(), r.distribution.c_str(), r.operation.c_str(), r.n, r.k, r.count, r.ops_per_sec, r.p50_ns, r.p99_ns, r.bytes);
+		}
+	}
+}
+
+//---------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	using namespace KD_treeBenchmarks;
+
+	Options options;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--json") == 0)
+			options.json = true;
+		else if (std::strcmp(argv[i], "--n") == 0 && i + 1 < argc)
+			options.n = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+			options.queries = std::strtoul(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			options.seed = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--n count] [--queries count] [--seed value] [--json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+	const Distribution distributions[] = { Distribution::uniform, Distribution::clustered, Distribution::sorted };
+	for (Distribution distribution : distributions)
+	{
+		run_suite<2, Type_wrapper<int>>("point2", distribution, options, results);
+		run_suite<3, Type_wrapper<int>>("point3", distribution, options, results);
+		run_suite<8, Type_wrapper<int>>("point8", distribution, options, results);
+		run_suite<3, Type_wrapper<int, double, long>>("tuple3", distribution, options, results);
+		if (distribution != Distribution::sorted)
+		{
+			run_metric_suite<3>("euclid3", distribution, options, results);
+			run_metric_suite<8>("euclid8", distribution, options, results);
+			run_concurrent_suite<3>("writers3", distribution, options, results);
+		}
+	}
+
+	print(results, options.json);
+	return 0;
+}
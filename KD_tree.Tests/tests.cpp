@@ -1,11 +1,34 @@
 #include "stdafx.h"
 #include "CppUnitTest.h"
 #include "../KD_tree/KD_tree.h"
+#include "../KD_tree/KD_tree_concurrent.h"
+#include "../KD_tree/KD_tree_mapped.h"
+#include "../KD_tree/KD_forest.h"
+#include "../KD_tree/KD_forest_randomized.h"
+#include "../KD_tree/KD_tree_persistent.h"
+#include "../KD_tree/KD_tree_quantized.h"
+#include "../KD_tree/KD_tree_sharded.h"
+#include "../KD_tree/VP_tree.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <string>
 #include <iostream>
 #include <functional>
+#include <iterator>
 #include <random>
 #include <cmath>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -13,12 +36,12 @@ namespace KD_treeTests
 {	
 	using namespace BK_KD_tree;
 
-	template<typename T>
+	template<typename T, typename Counter = size_t>
 	struct DistanceCalculator
 	{
 	public:
 
-		DistanceCalculator(size_t &op_count) : _op_count(op_count)
+		DistanceCalculator(Counter &op_count) : _op_count(op_count)
 		{
 		}
 
@@ -31,29 +54,78 @@ namespace KD_treeTests
 		template<size_t N>
 		double get_distance_to_plane(const T &key1, const T &key2) const
 		{
-			return T::get<N>(key1) > T::get<N>(key2) ? T::get<N>(key1) - T::get<N>(key2) : T::get<N>(key2) - T::get<N>(key1);
+			return T::template get<N>(key1) > T::template get<N>(key2) ? T::template get<N>(key1) - T::template get<N>(key2) : T::template get<N>(key2) - T::template get<N>(key1);
 		}
 
 	private:
-		size_t &_op_count;
+		Counter &_op_count;
 
 		template<size_t N>
 		double _get_cartesian_distance(const T &key1, const T &key2) const
 		{
-			auto coord1 = T::get<N>(key1), coord2 = T::get<N>(key2);
+			auto coord1 = T::template get<N>(key1), coord2 = T::template get<N>(key2);
 			double distance = coord1 > coord2 ? coord1 - coord2 : coord2 - coord1;
-			return (distance * distance) + _get_cartesian_distance<N - 1>(key1, key2);
+			//the recursion stops at dimension 0
+			return (distance * distance) + (N > 0 ? _get_cartesian_distance<(N > 0 ? N - 1 : 0)>(key1, key2) : 0.0);
 		}
+	};
+
+	//The euclidean distance, which unlike its square is a metric; the distance to a plane of DistanceCalculator is already linear
+	template<typename T, typename Counter = size_t>
+	struct EuclideanDistance : DistanceCalculator<T, Counter>
+	{
+		EuclideanDistance(Counter &op_count) : DistanceCalculator<T, Counter>(op_count) {}
 
-		template<>
-		double _get_cartesian_distance<0>(const T &key1, const T &key2) const
+		double get_cartesian_distance(const T &key1, const T &key2) const
 		{
-			auto coord1 = T::get<0>(key1), coord2 = T::get<0>(key2);
-			double distance = coord1 > coord2 ? coord1 - coord2 : coord2 - coord1;
-			return (distance * distance);
+			return std::sqrt(DistanceCalculator<T, Counter>::get_cartesian_distance(key1, key2));
 		}
 	};
 
+	//A monotonic arena that counts its allocations, like a std::pmr::monotonic_buffer_resource that is released after every request
+	struct Arena
+	{
+		explicit Arena(size_t capacity) : buffer(capacity), used(0), allocations(0) {}
+		std::vector<char> buffer;
+		size_t used;
+		size_t allocations;
+	};
+
+	template<typename T>
+	struct Arena_allocator
+	{
+		typedef T value_type;
+
+		explicit Arena_allocator(Arena &arena) : arena(&arena) {}
+		template<typename U>
+		Arena_allocator(const Arena_allocator<U> &other) : arena(other.arena) {}
+
+		T* allocate(size_t n)
+		{
+			size_t offset = (arena->used + alignof(T) - 1) / alignof(T) * alignof(T);
+			if (offset + n * sizeof(T) > arena->buffer.size())
+				throw std::bad_alloc();
+			arena->used = offset + n * sizeof(T);
+			++arena->allocations;
+			return reinterpret_cast<T*>(arena->buffer.data() + offset);
+		}
+		void deallocate(T*, size_t) {}
+
+		template<typename U>
+		bool operator==(const Arena_allocator<U> &other) const { return arena == other.arena; }
+		template<typename U>
+		bool operator!=(const Arena_allocator<U> &other) const { return arena != other.arena; }
+
+		Arena *arena;
+	};
+
+	//Builds a Point from an array of coordinates
+	template<typename Point_type, typename T, size_t Dim, size_t... I>
+	Point_type make_point(const std::array<T, Dim> &coords, std::index_sequence<I...>)
+	{
+		return Point_type(coords[I]...);
+	}
+
 	TEST_CLASS(Tests)
 	{
 	private:
@@ -99,6 +171,265 @@ namespace KD_treeTests
 			Assert::IsTrue(op_count < 100);
 		}
 
+		TEST_METHOD(KNN_search_BestFirstShouldMatchDepthFirst)
+		{
+			for (auto i = 0; i < 20000; ++i)
+				tree.insert(std::string("hay") + std::to_string(i), random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+
+			size_t op_count = 0;
+			for (auto i = 0; i < 100; ++i)
+			{
+				key_type key(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+				auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+				auto actual = tree.KNN_search(Best_first(), 10, DistanceCalculator<key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+				std::sort(actual.begin(), actual.end());
+				Assert::IsTrue(actual.size() == 10);
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(expected[j].first == actual[j].first);
+			}
+
+			//a node budget bounds the work of the search
+			Search_stats stats;
+			auto res = tree.KNN_search(Best_first(50), 10, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000), stats);
+			Assert::IsTrue(res.size() == 10);
+			Assert::IsTrue(stats.nodes_visited == 50);
+		}
+
+		TEST_METHOD(nearest_iterator_ShouldYieldTheValuesInOrderOfDistance)
+		{
+			size_t op_count = 0;
+			auto end = decltype(tree.nearest_iterator(key_type(0, 0, 0), DistanceCalculator<key_type>(op_count)))();
+			Assert::IsTrue(tree.nearest_iterator(key_type(0, 0, 0), DistanceCalculator<key_type>(op_count)) == end);
+
+			for (auto i = 0; i < 5000; ++i)
+				tree.insert(std::string("hay") + std::to_string(i), random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+
+			for (auto i = 0; i < 20; ++i)
+			{
+				key_type key(random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+				auto expected = tree.KNN_search(50, DistanceCalculator<key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+
+				//the first k values are the k nearest, and every value is yielded once in a non-decreasing order of distance
+				size_t count = 0;
+				double last = 0.0;
+				std::set<const std::string*> seen;
+				for (auto it = tree.nearest_iterator(key, DistanceCalculator<key_type>(op_count)); it != end; ++it, ++count)
+				{
+					if (count < expected.size())
+						Assert::IsTrue(it->first == expected[count].first);
+					Assert::IsTrue(last <= it->first);
+					Assert::IsTrue(seen.insert(it->second).second);
+					last = it->first;
+				}
+				Assert::IsTrue(count == 5000);
+			}
+
+			//the first neighbours only cost a fraction of the distance computations of a full scan
+			for (auto i = 0; i < 8; ++i)
+				tree.insert(std::string("needle") + std::to_string(i), 5000 + i % 2, 5000 + i / 2 % 2, 5000 + i / 4);
+			op_count = 0;
+			auto it = tree.nearest_iterator(key_type(5000, 5000, 5000), DistanceCalculator<key_type>(op_count));
+			for (auto i = 0; i < 7; ++i)
+				++it;
+			Assert::IsTrue(it->first == 3.0 && it->second->compare(0, 6, "needle") == 0);
+			Assert::IsTrue(op_count < 500);
+		}
+
+		TEST_METHOD(KNN_search_if_ShouldFindTheNearestValuesThatSatisfyThePredicate)
+		{
+			KD_forest<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> forest(64);
+			for (auto i = 0; i < 20000; ++i)
+			{
+				key_type key(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+				std::string mapped = (i % 100 == 0 ? "available" : "busy") + std::to_string(i);
+				tree.insert(mapped, key);
+				forest.insert(mapped, key);
+			}
+			auto available = [](const decltype(tree)::value_type &value) { return value.second.compare(0, 9, "available") == 0; };
+
+			size_t op_count = 0;
+			auto res = tree.KNN_search_if(10, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000), available);
+			auto all = tree.KNN_search(20000, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000));
+			std::sort(all.begin(), all.end());
+			all.erase(std::remove_if(all.begin(), all.end(), [](const decltype(all)::value_type &r) { return r.second->compare(0, 9, "available") != 0; }), all.end());
+			std::sort(res.begin(), res.end());
+			Assert::IsTrue(res.size() == 10);
+			for (size_t i = 0; i < res.size(); ++i)
+				Assert::IsTrue(res[i].first == all[i].first);
+
+			auto forest_res = forest.KNN_search_if(10, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000), available);
+			std::sort(forest_res.begin(), forest_res.end());
+			for (size_t i = 0; i < res.size(); ++i)
+				Assert::IsTrue(forest_res[i].first == res[i].first);
+		}
+
+		TEST_METHOD(self_join_ShouldReportEveryClosePairOnce)
+		{
+			for (auto i = 0; i < 2000; ++i)
+				tree.insert(std::to_string(i), random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+
+			typedef std::pair<std::string, std::string> pair_type;
+			auto make_pair = [](const decltype(tree)::value_type &a, const decltype(tree)::value_type &b)
+			{
+				return a.second < b.second ? pair_type(a.second, b.second) : pair_type(b.second, a.second);
+			};
+
+			size_t op_count = 0;
+			DistanceCalculator<key_type> distance(op_count);
+			auto values = tree.range_search(key_type(0, 0, 0), key_type(1000, 1000, 1000));
+			std::vector<pair_type> expected;
+			for (size_t i = 0; i < values.size(); ++i)
+				for (size_t j = i + 1; j < values.size(); ++j)
+					if (distance.get_cartesian_distance(values[i]->first, values[j]->first) <= 2500.0)
+						expected.push_back(make_pair(*values[i], *values[j]));
+			std::sort(expected.begin(), expected.end());
+
+			std::vector<pair_type> actual;
+			tree.self_join(2500.0, distance, [&](const decltype(tree)::value_type &a, const decltype(tree)::value_type &b, double) { actual.push_back(make_pair(a, b)); });
+			std::sort(actual.begin(), actual.end());
+			Assert::IsTrue(!expected.empty() && actual == expected);
+
+			std::atomic<size_t> atomic_count(0);
+			std::mutex mutex;
+			actual.clear();
+			tree.self_join(2500.0, DistanceCalculator<key_type, std::atomic<size_t>>(atomic_count), [&](const decltype(tree)::value_type &a, const decltype(tree)::value_type &b, double)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				actual.push_back(make_pair(a, b));
+			}, 4);
+			std::sort(actual.begin(), actual.end());
+			Assert::IsTrue(actual == expected);
+		}
+
+		TEST_METHOD(all_KNN_search_ShouldMatchAKNNSearchPerQuery)
+		{
+			decltype(tree) queries;
+			for (auto i = 0; i < 2000; ++i)
+			{
+				tree.insert(std::to_string(i), random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+				if (i % 4 == 0)
+					queries.insert(std::to_string(i), random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+			}
+
+			size_t op_count = 0, loop_count = 0;
+			DistanceCalculator<key_type> distance(op_count), loop_distance(loop_count);
+			auto distances = [](decltype(tree)::KNN_container_type::const_iterator begin, decltype(tree)::KNN_container_type::const_iterator end)
+			{
+				std::vector<double> res;
+				for (auto it = begin; it != end; ++it)
+					res.push_back(it->first);
+				return res;
+			};
+			auto sorted = [](std::vector<double> res) { std::sort(res.begin(), res.end()); return res; };
+
+			//the nearest other values of every value, against a search for k + 1 values that drops the value itself
+			auto graph = tree.all_KNN_search(5, distance);
+			Assert::IsTrue(graph.queries.size() == tree.size() && graph.neighbors.size() == tree.size() * 5);
+			for (size_t i = 0; i < graph.queries.size(); ++i)
+			{
+				auto row = graph.neighbors.cbegin() + i * 5;
+				auto expected = tree.KNN_search(6, loop_distance, graph.queries[i]->first);
+				auto expected_distances = sorted(distances(expected.cbegin(), expected.cend()));
+				expected_distances.erase(expected_distances.begin());
+				Assert::IsTrue(distances(row, row + 5) == expected_distances);
+			}
+			Assert::IsTrue(op_count <= loop_count);
+
+			//rows of a separate query tree are nearest first as well
+			auto join = tree.all_KNN_search(3, distance, queries);
+			Assert::IsTrue(join.queries.size() == queries.size());
+			for (size_t i = 0; i < join.queries.size(); ++i)
+			{
+				auto row = join.neighbors.cbegin() + i * 3;
+				auto expected = tree.KNN_search(3, loop_distance, join.queries[i]->first);
+				Assert::IsTrue(distances(row, row + 3) == sorted(distances(expected.cbegin(), expected.cend())));
+			}
+
+			//a tree that queries itself finds every value at distance 0
+			auto with_self = tree.all_KNN_search(1, distance, tree);
+			for (const auto &neighbor : with_self.neighbors)
+				Assert::IsTrue(neighbor.first == 0.0);
+
+			//a reference tree smaller than k pads every row
+			decltype(tree) small;
+			small.insert("a", 0, 0, 0);
+			auto padded = small.all_KNN_search(2, distance, queries);
+			Assert::IsTrue(padded.neighbors[0].second != nullptr && *padded.neighbors[0].second == "a");
+			Assert::IsTrue(padded.neighbors[1].second == nullptr && padded.neighbors[1].first == std::numeric_limits<double>::infinity());
+		}
+
+		TEST_METHOD(KNN_search_ShouldAllocateFromTheGivenAllocator)
+		{
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 10000; ++i)
+			{
+				keys.emplace_back(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+				tree.insert(std::to_string(i), keys.back());
+			}
+
+			size_t op_count = 0;
+			Arena arena(1 << 20);
+			Arena_allocator<char> alloc(arena);
+			for (size_t i = 0; i < 100; ++i)
+			{
+				//the arena is released in one shot after every query
+				arena.used = 0;
+				size_t allocations = arena.allocations;
+				key_type probe(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+
+				auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), probe);
+				auto actual = tree.KNN_search(std::allocator_arg, alloc, 10, DistanceCalculator<key_type>(op_count), probe);
+				auto best_first = tree.KNN_search(std::allocator_arg, alloc, Best_first(), 10, DistanceCalculator<key_type>(op_count), probe);
+				Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+				std::sort(expected.begin(), expected.end());
+				std::sort(best_first.begin(), best_first.end());
+				Assert::IsTrue(std::equal(expected.begin(), expected.end(), best_first.begin(), best_first.end()));
+
+				key_type upper(key_type::get<0>(probe) + 500, key_type::get<1>(probe) + 500, key_type::get<2>(probe) + 500);
+				auto range = tree.range_search(std::allocator_arg, alloc, probe, upper);
+				Assert::IsTrue(range.size() == tree.range_search(probe, upper).size());
+				Assert::IsTrue(arena.allocations > allocations);
+			}
+
+			for (size_t i = 0; i < keys.size(); i += 2)
+			{
+				arena.used = 0;
+				tree.erase(std::allocator_arg, alloc, keys[i]);
+				Assert::IsFalse(tree.contains(keys[i]));
+			}
+			Assert::IsTrue(tree.size() == keys.size() / 2);
+		}
+
+		TEST_METHOD(Search_stats_ShouldCountTheWorkOfAQuery)
+		{
+			for (auto i = 0; i < 100000; ++i)
+			{
+				if (i == 50000)
+					tree[key_type(301, 501, 601)] = "needle";
+				tree.insert(std::string("hay") + std::to_string(i), random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+			}
+
+			size_t op_count = 0;
+			Search_stats stats;
+			auto res = tree.KNN_search(1, DistanceCalculator<key_type>(op_count), key_type(300, 500, 600), stats);
+			Assert::IsTrue(res.size() == 1 && *(res[0].second) == "needle");
+			Assert::IsTrue(stats.distance_evaluations == op_count);
+			Assert::IsTrue(stats.nodes_visited == op_count);
+			Assert::IsTrue(stats.pruned_subtrees > 0);
+			Assert::IsTrue(stats.max_depth > 0 && stats.max_depth <= stats.nodes_visited);
+
+			Search_stats_histogram histogram;
+			histogram.record(stats);
+			stats.reset();
+			Assert::IsTrue(stats.nodes_visited == 0);
+			tree.range_search(key_type(1000, 1000, 1000), key_type(2000, 2000, 2000), stats);
+			histogram.record(stats);
+			Assert::IsTrue(histogram.nodes_visited.count() == 2);
+			Assert::IsTrue(histogram.nodes_visited.percentile(1.0) >= histogram.nodes_visited.max());
+		}
+
 		TEST_METHOD(erase_ShouldRemoveTheValueFromTheTree)
 		{
 			for (auto i = 0; i < 100000; ++i)
@@ -186,5 +517,1005 @@ namespace KD_treeTests
 			tree.clear();
 			Assert::IsTrue(tree.size() == 0);
 		}
+
+		TEST_METHOD(Cold_ShouldStoreTheMappedValuesApartFromTheNodes)
+		{
+			struct Fat
+			{
+				std::string name;
+				std::array<char, 200> payload;
+			};
+			KD_tree<3, Cold<Fat>, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> cold;
+			for (auto i = 0; i < 5000; ++i)
+			{
+				key_type key(random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+				Fat fat;
+				fat.name = std::to_string(i);
+				tree.insert(fat.name, key);
+				cold.insert(fat, key);
+			}
+			Assert::IsTrue(cold.size() == tree.size());
+			Assert::IsTrue(cold.diagnostics().node_bytes / cold.size() < sizeof(Fat));
+
+			//the searches find the same values as in a tree that stores them in its nodes
+			size_t op_count = 0;
+			for (auto i = 0; i < 50; ++i)
+			{
+				key_type key(random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+				auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+				auto actual = cold.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+				Assert::IsTrue(actual.size() == expected.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(actual[j].first == expected[j].first && actual[j].second->name == *expected[j].second);
+			}
+			auto in_box = cold.range_search(key_type(100, 100, 100), key_type(600, 600, 600));
+			Assert::IsTrue(in_box.size() == tree.range_search(key_type(100, 100, 100), key_type(600, 600, 600)).size());
+			for (auto it = in_box.begin(); it != in_box.end(); ++it)
+				Assert::IsTrue(tree.at((*it)->first) == (*it)->second.get().name);
+
+			//a copy owns copies of the values, and a moved key keeps the address of its value
+			key_type key = in_box.front()->first, moved(2000, 2000, 2000);
+			auto copy = cold;
+			copy.at(key).name = "changed";
+			Assert::IsTrue(cold.at(key).name == tree.at(key));
+			const Fat *address = &cold.at(key);
+			Assert::IsTrue(cold.update_key(key, moved));
+			Assert::IsTrue(&cold.at(moved) == address);
+			cold[key_type(-1, -1, -1)].name = "new";
+			Assert::IsTrue(cold.at(key_type(-1, -1, -1)).name == "new");
+			Assert::IsTrue(cold.erase(moved) == 1 && !cold.contains(moved));
+
+			//a moved from value can be copied and assigned from
+			Fat fat;
+			fat.name = "fat";
+			detail::cold_value<Fat> source(fat), target(fat);
+			detail::cold_value<Fat> taken(std::move(source));
+			detail::cold_value<Fat> empty(source);
+			target = source;
+			target = taken;
+			Assert::IsTrue(target.get().name == "fat");
+			empty = target;
+			Assert::IsTrue(empty.get().name == "fat");
+		}
+
+		TEST_METHOD(diagnostics_ShouldDescribeTheShapeOfTheTree)
+		{
+			auto empty = tree.diagnostics();
+			Assert::IsTrue(empty.node_count == 0 && empty.max_depth == 0);
+
+			//sorted inserts degenerate the tree into a list
+			for (auto i = 0; i < 1000; ++i)
+				tree.insert("hay", i, i, i);
+			auto list = tree.diagnostics();
+			Assert::IsTrue(list.node_count == 1000 && list.max_depth == 1000);
+			Assert::IsTrue(list.splits[0] + list.splits[1] + list.splits[2] == 999);
+			Assert::IsTrue(list.depth_histogram.size() == 1000 && list.depth_histogram[999] == 1);
+			Assert::IsTrue(list.balance_factor == 100.0);
+			Assert::IsTrue(list.node_bytes >= list.key_bytes + list.mapped_bytes);
+
+			tree.clear();
+			for (auto i = 0; i < 1000; ++i)
+				tree.insert("hay", random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+			auto random = tree.diagnostics();
+			Assert::IsTrue(random.node_count == tree.size());
+			Assert::IsTrue(random.balance_factor < list.balance_factor);
+			Assert::IsTrue(random.estimated_query_cost >= random.balanced_query_cost);
+		}
+
+		TEST_METHOD(Linear_scan_ShouldMatchTheTreeTraversal)
+		{
+			typedef decltype(tree)::value_type value_type;
+			Assert::IsTrue(tree.scan_limit() == tree.default_scan_limit() && tree.range_scan_limit() == tree.scan_limit() >> 3);
+
+			size_t op_count = 0;
+			auto check = [this, &op_count](const decltype(tree) &source)
+			{
+				decltype(tree) traversed(source);
+				traversed.set_scan_limit(0);
+				for (auto i = 0; i < 20; ++i)
+				{
+					key_type key(random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+					auto expected = traversed.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+					auto actual = source.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+					std::sort(expected.begin(), expected.end());
+					std::sort(actual.begin(), actual.end());
+					Assert::IsTrue(actual.size() == expected.size());
+					for (size_t j = 0; j < expected.size(); ++j)
+						Assert::IsTrue(actual[j].first == expected[j].first);
+
+					key_type upper(key_type::get<0>(key) + 200, key_type::get<1>(key) + 200, key_type::get<2>(key) + 200);
+					std::multiset<std::string> expected_range, actual_range;
+					for (auto value : traversed.range_search(key, upper))
+						expected_range.insert(value->second);
+					for (auto value : source.range_search(key, upper))
+						actual_range.insert(value->second);
+					Assert::IsTrue(actual_range == expected_range);
+				}
+			};
+
+			//the size is counted through inserts, overwrites, erases and moves
+			tree.set_scan_limit(100000);
+			for (auto i = 0; i < 3000; ++i)
+				tree.insert(std::string("hay") + std::to_string(i), random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+			Assert::IsTrue(tree.diagnostics().scan_bytes == 0);
+			check(tree);
+			auto scanned = tree.diagnostics();
+			Assert::IsTrue(scanned.scan_limit == 100000 && scanned.range_scan_limit == 12500 && scanned.scan_bytes >= tree.size() * sizeof(key_type));
+
+			//a scan reports every key as a visited node
+			Search_stats knn_stats, range_stats;
+			tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key_type(500, 500, 500), knn_stats);
+			tree.range_search(key_type(0, 0, 0), key_type(500, 500, 500), range_stats);
+			Assert::IsTrue(knn_stats.nodes_visited == tree.size() && knn_stats.distance_evaluations == tree.size());
+			Assert::IsTrue(range_stats.nodes_visited == tree.size() && range_stats.distance_evaluations == 0);
+
+			//inserts extend the copy of the keys, and other changes discard it
+			for (auto i = 0; i < 100; ++i)
+				tree.insert("new", random_engine() % 1001, random_engine() % 1001, random_engine() % 1001);
+			tree.insert("overwrite", key_type(0, 0, 0));
+			tree.insert("overwritten", key_type(0, 0, 0));
+			Assert::IsTrue(tree.diagnostics().scan_bytes > 0);
+			check(tree);
+			auto range = tree.range_search(key_type(0, 0, 0), key_type(500, 1000, 1000));
+			std::vector<key_type> erased;
+			for (size_t i = 0; i < 300; ++i)
+				erased.push_back(range[i]->first);
+			tree.erase(erased.back());
+			Assert::IsTrue(tree.diagnostics().scan_bytes == 0);
+			tree.erase_batch(erased.begin(), erased.end());
+			std::vector<value_type> batch;
+			for (auto i = 0; i < 500; ++i)
+				batch.push_back(value_type(key_type(random_engine() % 1001, random_engine() % 1001, random_engine() % 1001), "batch"));
+			batch.push_back(batch.front());
+			tree.insert_batch(batch.begin(), batch.end());
+			check(tree);
+			tree.update_key(key_type(0, 0, 0), key_type(1000, 1000, 1000));
+			std::vector<std::pair<key_type, key_type>> moves = { { batch[1].first, batch[2].first }, { batch[3].first, key_type(-1, -1, -1) } };
+			tree.update_key_batch(moves.begin(), moves.end());
+			check(tree);
+			Assert::IsTrue(tree.size() == tree.diagnostics().node_count);
+
+			//a tree above the limit is traversed
+			tree.set_scan_limit(1000);
+			check(tree);
+			tree.clear();
+			Assert::IsTrue(tree.size() == 0 && tree.KNN_search(1, DistanceCalculator<key_type>(op_count), key_type(0, 0, 0)).empty());
+		}
+
+		TEST_METHOD(rebalance_ShouldRelinkTheNodesIntoABalancedTree)
+		{
+			std::vector<const decltype(tree)::value_type*> addresses;
+			for (auto i = 0; i < 1000; ++i)
+				addresses.push_back(&tree.insert(std::to_string(i), i, i, i));
+			tree.rebalance();
+			auto balanced = tree.diagnostics();
+			Assert::IsTrue(balanced.node_count == 1000 && balanced.max_depth == 10 && balanced.balance_factor == 1.0);
+			for (auto i = 0; i < 1000; ++i)
+			{
+				//the values stay where they were allocated
+				Assert::IsTrue(&tree.at(key_type(i, i, i)) == &addresses[i]->second && tree.at(key_type(i, i, i)) == std::to_string(i));
+			}
+
+			//a tree large enough to be rebuilt by several threads takes the same shape as a tree rebuilt by one
+			decltype(tree) large, reference;
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 70000; ++i)
+			{
+				keys.emplace_back(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+				large.insert(std::to_string(i), keys.back());
+			}
+			reference = large;
+			large.rebalance(4);
+			reference.rebalance(1);
+			Assert::IsTrue(large.size() == reference.size());
+			Assert::IsTrue(large.diagnostics().depth_histogram == reference.diagnostics().depth_histogram);
+			//4 threads split the top 4 levels, so the tasks start at dimension 1 and not at 0
+			Assert::IsTrue(large.diagnostics().splits == reference.diagnostics().splits);
+			for (auto it = keys.begin(); it != keys.end(); ++it)
+				Assert::IsTrue(large.at(*it) == reference.at(*it));
+		}
+
+		TEST_METHOD(insert_batch_ShouldMatchSequentialInsertsAndErases)
+		{
+			typedef decltype(tree)::value_type value_type;
+			decltype(tree) sequential;
+			std::vector<value_type> values;
+			for (auto i = 0; i < 20000; ++i)
+			{
+				values.emplace_back(key_type(random_engine() % 101, random_engine() % 101, random_engine() % 101), std::string("hay") + std::to_string(i));
+				if (i % 2 == 0)
+				{
+					tree.insert(values.back().second, values.back().first);
+					sequential.insert(values.back().second, values.back().first);
+				}
+			}
+
+			auto inserted = tree.insert_batch(values.begin(), values.end());
+			for (size_t i = 0; i < values.size(); ++i)
+			{
+				bool is_new = !sequential.contains(values[i].first);
+				sequential.insert(values[i].second, values[i].first);
+				Assert::IsTrue(inserted[i] == is_new);
+			}
+			Assert::IsTrue(tree.size() == sequential.size());
+			for (auto it = values.begin(); it != values.end(); ++it)
+				Assert::IsTrue(tree.at(it->first) == sequential.at(it->first));
+
+			std::vector<key_type> keys;
+			for (size_t i = 0; i < values.size(); i += 3)
+				keys.push_back(values[i].first);
+			keys.emplace_back(1000, 1000, 1000);
+
+			auto erased = tree.erase_batch(keys.begin(), keys.end());
+			for (size_t i = 0; i < keys.size(); ++i)
+				Assert::IsTrue(erased[i] == (sequential.erase(keys[i]) == 1));
+			Assert::IsTrue(tree.size() == sequential.size());
+			for (auto it = values.begin(); it != values.end(); ++it)
+				Assert::IsTrue(tree.contains(it->first) == sequential.contains(it->first));
+		}
+
+		TEST_METHOD(update_key_ShouldMoveValuesLikeAnEraseAndAnInsert)
+		{
+			typedef std::tuple<int, int, double> coords_type;
+			auto coords = [](const key_type &key) { return coords_type(key_type::get<0>(key), key_type::get<1>(key), key_type::get<2>(key)); };
+			auto to_key = [](const coords_type &c) { return key_type(std::get<0>(c), std::get<1>(c), std::get<2>(c)); };
+			//moves mostly by a small step, sometimes far or onto another key, and sometimes from a missing key
+			auto make_moves = [&](const std::map<coords_type, std::string> &model, size_t count)
+			{
+				std::vector<key_type> keys;
+				for (auto it = model.begin(); it != model.end(); ++it)
+					keys.push_back(to_key(it->first));
+				std::vector<std::pair<key_type, key_type>> moves;
+				for (size_t i = 0; i < count; ++i)
+				{
+					key_type from = keys[random_engine() % keys.size()], to = from;
+					switch (random_engine() % 10)
+					{
+					case 0: to = keys[random_engine() % keys.size()]; break;
+					case 1: from = key_type(1000, 1000, 1000); break;
+					case 2: case 3: to = key_type(random_engine() % 201, random_engine() % 201, random_engine() % 201); break;
+					default: to = key_type(key_type::get<0>(from) + int(random_engine() % 5) - 2, key_type::get<1>(from) + int(random_engine() % 5) - 2, key_type::get<2>(from)); break;
+					}
+					moves.emplace_back(from, to);
+				}
+				return moves;
+			};
+			auto check = [&](const std::map<coords_type, std::string> &model)
+			{
+				Assert::IsTrue(tree.size() == model.size());
+				for (auto it = model.begin(); it != model.end(); ++it)
+					Assert::IsTrue(tree.at(to_key(it->first)) == it->second);
+			};
+
+			std::map<coords_type, std::string> model;
+			for (auto i = 0; i < 3000; ++i)
+			{
+				key_type key(random_engine() % 201, random_engine() % 201, random_engine() % 201);
+				tree.insert(std::to_string(i), key);
+				model[coords(key)] = std::to_string(i);
+			}
+
+			auto moves = make_moves(model, 1000);
+			for (auto it = moves.begin(); it != moves.end(); ++it)
+			{
+				auto found = model.find(coords(it->first));
+				Assert::IsTrue(tree.update_key(it->first, it->second) == (found != model.end()));
+				if (found != model.end())
+				{
+					std::string value = found->second;
+					model.erase(found);
+					model[coords(it->second)] = value;
+				}
+			}
+			check(model);
+
+			//a tick of updates behaves as if all old keys were erased at once and the values then inserted in order
+			for (auto tick = 0; tick < 10; ++tick)
+			{
+				moves = make_moves(model, 300);
+				moves.push_back(moves.front());
+				auto moved = tree.update_key_batch(moves.begin(), moves.end());
+				Assert::IsTrue(moved.size() == moves.size());
+
+				std::set<coords_type> taken;
+				std::vector<std::pair<coords_type, std::string>> values;
+				for (size_t i = 0; i < moves.size(); ++i)
+				{
+					auto found = model.find(coords(moves[i].first));
+					bool first = taken.insert(coords(moves[i].first)).second;
+					Assert::IsTrue(moved[i] == (first && found != model.end()));
+					if (moved[i])
+						values.emplace_back(coords(moves[i].second), found->second);
+				}
+				for (size_t i = 0; i < moves.size(); ++i)
+				{
+					if (moved[i])
+						model.erase(coords(moves[i].first));
+				}
+				for (auto it = values.begin(); it != values.end(); ++it)
+					model[it->first] = it->second;
+				check(model);
+			}
+		}
+
+		TEST_METHOD(range_search_ShouldReturnExactlyTheKeysInsideTheBox)
+		{
+			for (auto i = 0; i < 100000; ++i)
+			{
+				tree.insert(std::string("hay") + std::to_string(i), random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+			}
+
+			key_type lower(1000, 2000, 3000), upper(3000, 4000, 5000);
+			auto res = tree.range_search(lower, upper);
+			for (auto value : res)
+			{
+				Assert::IsTrue(key_type::get<0>(value->first) >= 1000 && key_type::get<0>(value->first) <= 3000);
+				Assert::IsTrue(key_type::get<1>(value->first) >= 2000 && key_type::get<1>(value->first) <= 4000);
+				Assert::IsTrue(key_type::get<2>(value->first) >= 3000 && key_type::get<2>(value->first) <= 5000);
+			}
+
+			//roughly 0.2^3 of the points fall inside the box
+			size_t expected = 0;
+			for (auto value : tree.range_search(key_type(0, 0, 0), key_type(10000, 10000, 10000)))
+			{
+				if (key_type::get<0>(value->first) >= 1000 && key_type::get<0>(value->first) <= 3000 &&
+					key_type::get<1>(value->first) >= 2000 && key_type::get<1>(value->first) <= 4000 &&
+					key_type::get<2>(value->first) >= 3000 && key_type::get<2>(value->first) <= 5000)
+					++expected;
+			}
+			Assert::IsTrue(res.size() == expected && expected > 0);
+		}
+
+		TEST_METHOD(String_dimensions_ShouldOrderLikeStdString)
+		{
+			typedef KD_tree<3, int, Comparer_wrapper<std::less>, Type_wrapper<int, int, std::string>, false> plain_type;
+			typedef KD_tree<3, int, Comparer_wrapper<std::less>, Type_wrapper<int, int, Prefixed_string>, false> prefixed_type;
+			typedef KD_tree<3, int, Comparer_wrapper<std::less>, Type_wrapper<int, int, Interned_string>, false> interned_type;
+
+			//short strings, strings that share their first 8 bytes, and strings that differ only in trailing zeros
+			std::vector<std::string> words = { "", "a", std::string("a\0", 2), std::string("a\0\0", 3), "b", "\xff", "abcdefgh", "abcdefgh1", "abcdefgh2",
+				"abcdefgh10", std::string("abcdefg\0", 8), std::string("abcdefgh\0", 9), "vehicle/truck", "vehicle/car", "vehicle/bus" };
+			for (auto i = 0; i < 50; ++i)
+				words.push_back(std::string("category/") + std::to_string(random_engine() % 100));
+			for (auto &lhs : words)
+			{
+				for (auto &rhs : words)
+				{
+					Assert::IsTrue((Prefixed_string(lhs) < Prefixed_string(rhs)) == (lhs < rhs));
+					Assert::IsTrue((Prefixed_string(lhs) == Prefixed_string(rhs)) == (lhs == rhs));
+					Assert::IsTrue((Interned_string(lhs) < Interned_string(rhs)) == (lhs < rhs));
+					Assert::IsTrue((Interned_string(lhs) == Interned_string(rhs)) == (lhs == rhs));
+				}
+			}
+			Assert::IsTrue(&Interned_string(words[12]).str() == &Interned_string(std::string("vehicle/truck")).str());
+			Assert::IsTrue(Interned_string().str().empty() && Interned_string() == Interned_string(""));
+
+			plain_type plain;
+			prefixed_type prefixed;
+			interned_type interned;
+			for (auto i = 0; i < 20000; ++i)
+			{
+				int x = random_engine() % 1001, y = random_engine() % 1001;
+				const std::string &word = words[random_engine() % words.size()];
+				plain.insert(i, x, y, word);
+				prefixed.insert(i, x, y, word);
+				interned.insert(i, x, y, word);
+			}
+			Assert::IsTrue(prefixed.size() == plain.size() && interned.size() == plain.size());
+
+			for (auto i = 0; i < 1000; ++i)
+			{
+				int x = random_engine() % 1001, y = random_engine() % 1001;
+				const std::string &word = words[random_engine() % words.size()];
+				bool found = plain.contains(plain_type::key_type(x, y, word));
+				Assert::IsTrue(prefixed.contains(prefixed_type::key_type(x, y, word)) == found);
+				Assert::IsTrue(interned.contains(interned_type::key_type(x, y, word)) == found);
+				if (found)
+				{
+					Assert::IsTrue(prefixed.at(prefixed_type::key_type(x, y, word)) == plain.at(plain_type::key_type(x, y, word)));
+					Assert::IsTrue(interned.at(interned_type::key_type(x, y, word)) == plain.at(plain_type::key_type(x, y, word)));
+				}
+			}
+
+			for (auto i = 0; i < 20; ++i)
+			{
+				int x = random_engine() % 800, y = random_engine() % 800;
+				const std::string &low = words[random_engine() % words.size()], &high = words[random_engine() % words.size()];
+				const std::string &lower = std::min(low, high), &upper = std::max(low, high);
+				auto expected = plain.range_search(plain_type::key_type(x, y, lower), plain_type::key_type(x + 200, y + 200, upper));
+				Assert::IsTrue(prefixed.range_search(prefixed_type::key_type(x, y, lower), prefixed_type::key_type(x + 200, y + 200, upper)).size() == expected.size());
+				Assert::IsTrue(interned.range_search(interned_type::key_type(x, y, lower), interned_type::key_type(x + 200, y + 200, upper)).size() == expected.size());
+			}
+		}
+
+		TEST_METHOD(Mapped_KD_tree_ShouldAnswerQueriesLikeTheSourceTree)
+		{
+			typedef KD_tree<3, int, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> source_type;
+			typedef Mapped_KD_tree<3, int, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> mapped_type;
+			const char *path = "mapped_tree_test.bin";
+
+			source_type source;
+			for (auto i = 0; i < 10000; ++i)
+				source.insert(i, random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+			source[key_type(301, 501, 601)] = -1;
+			mapped_type::write(source, path);
+
+			{
+				mapped_type mapped(path, true);
+				Assert::IsTrue(mapped.size() == source.size());
+				Assert::IsTrue(mapped.contains(key_type(301, 501, 601)));
+				Assert::IsTrue(mapped.at(key_type(301, 501, 601)) == -1);
+				Assert::ExpectException<not_found>([&mapped] { mapped.at(key_type(-1, -1, -1)); });
+
+				size_t op_count = 0;
+				auto res = mapped.KNN_search(1, DistanceCalculator<key_type>(op_count), key_type(300, 500, 600));
+				Assert::IsTrue(res.size() == 1 && *(res[0].second) == -1);
+				Assert::IsTrue(mapped.range_search(key_type(0, 0, 0), key_type(5000, 5000, 5000)).size() ==
+					source.range_search(key_type(0, 0, 0), key_type(5000, 5000, 5000)).size());
+			}
+
+			std::remove(path);
+		}
+
+		TEST_METHOD(Mapped_KD_tree_ShouldRejectAMismatchedFile)
+		{
+			typedef KD_tree<3, int, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> source_type;
+			typedef Mapped_KD_tree<3, int, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> mapped_type;
+			typedef Mapped_KD_tree<3, double, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> other_type;
+			const char *path = "mapped_tree_mismatch_test.bin";
+
+			source_type source;
+			source.insert(1, 1, 2, 3.0);
+			mapped_type::write(source, path);
+
+			Assert::ExpectException<invalid_tree_file>([path] { other_type mapped(path); });
+
+			//a truncated file and a child offset that points past the node block
+			source.insert(2, 0, 2, 3.0);
+			source.insert(3, 2, 2, 3.0);
+			mapped_type::write(source, path);
+			std::string bytes;
+			{
+				std::ifstream in(path, std::ios::binary);
+				bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			detail::mapped_tree_header h;
+			std::memcpy(&h, bytes.data(), sizeof(h));
+			std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), static_cast<std::streamsize>(h.node_offset) - 1);
+			Assert::ExpectException<invalid_tree_file>([path] { mapped_type mapped(path); });
+
+			std::int64_t offset = std::int64_t(1) << 40;
+			std::memcpy(&bytes[static_cast<size_t>(h.node_offset + h.node_size) - sizeof(offset)], &offset, sizeof(offset));
+			std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+			Assert::ExpectException<invalid_tree_file>([path] { mapped_type mapped(path); });
+			std::remove(path);
+		}
+
+		TEST_METHOD(KD_forest_ShouldMatchTheTreeAfterInsertsAndErases)
+		{
+			KD_forest<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> forest(64);
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 20000; ++i)
+			{
+				keys.emplace_back(random_engine() % 10001, random_engine() % 10001, random_engine() % 10001);
+				tree.insert(std::string("hay") + std::to_string(i), keys.back());
+				forest.insert(std::string("hay") + std::to_string(i), keys.back());
+			}
+			for (auto i = 0; i < 20000; i += 3)
+			{
+				Assert::IsTrue(tree.erase(keys[i]) == forest.erase(keys[i]));
+			}
+			forest.insert("needle", 301, 501, 601);
+			tree.insert("needle", 301, 501, 601);
+
+			Assert::IsTrue(forest.size() == tree.size());
+			Assert::IsTrue(forest.levels() > 1);
+			Assert::IsFalse(forest.contains(keys[0]));
+			Assert::IsTrue(forest.at(keys[1]) == tree.at(keys[1]));
+
+			size_t op_count = 0;
+			auto res = forest.KNN_search(1, DistanceCalculator<key_type>(op_count), key_type(300, 500, 600));
+			Assert::IsTrue(res.size() == 1 && *(res[0].second) == "needle");
+
+			auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000));
+			auto actual = forest.KNN_search(10, DistanceCalculator<key_type>(op_count), key_type(5000, 5000, 5000));
+			std::sort(expected.begin(), expected.end());
+			std::sort(actual.begin(), actual.end());
+			for (size_t i = 0; i < expected.size(); ++i)
+				Assert::IsTrue(expected[i].first == actual[i].first && *expected[i].second == *actual[i].second);
+
+			Assert::IsTrue(forest.range_search(key_type(1000, 1000, 1000), key_type(4000, 4000, 4000)).size() ==
+				tree.range_search(key_type(1000, 1000, 1000), key_type(4000, 4000, 4000)).size());
+		}
+
+		TEST_METHOD(Sharded_KD_tree_ShouldMatchTheTreeUnderConcurrentWriters)
+		{
+			typedef Sharded_KD_tree<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> sharded_type;
+			//distinct keys, so that the writers never race on the same key
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 40000; ++i)
+				keys.emplace_back(i % 101, (i / 101) % 101, i / 10201);
+			std::shuffle(keys.begin(), keys.end(), random_engine);
+
+			std::vector<std::pair<key_type, std::string>> sample;
+			for (auto i = 0; i < 2000; ++i)
+			{
+				sample.emplace_back(keys[i], std::to_string(i));
+				tree.insert(std::to_string(i), keys[i]);
+			}
+			sharded_type sharded(8, sample.begin(), sample.end());
+			Assert::IsTrue(sharded.shards() == 8);
+			Assert::IsTrue(sharded.size() == 2000);
+
+			//every writer inserts its own slice of the keys and erases every third, while a reader searches
+			const size_t writers = 4, slice = 9000;
+			std::vector<std::thread> threads;
+			std::atomic<bool> done(false);
+			for (size_t w = 0; w < writers; ++w)
+			{
+				threads.emplace_back([&sharded, &keys, w]
+				{
+					for (size_t i = 2000 + w * slice; i < 2000 + (w + 1) * slice; ++i)
+						sharded.insert(std::to_string(i), keys[i]);
+					for (size_t i = 2000 + w * slice; i < 2000 + (w + 1) * slice; i += 3)
+						sharded.erase(keys[i]);
+				});
+			}
+			//the reader touches every result, which a writer may have erased in the meantime
+			size_t result_bytes = 0;
+			threads.emplace_back([&sharded, &done, &result_bytes]
+			{
+				size_t op_count = 0;
+				while (!done)
+				{
+					for (const auto &neighbor : sharded.KNN_search(5, DistanceCalculator<key_type>(op_count), key_type(50, 50, 2)))
+						result_bytes += neighbor.second.size();
+					for (const auto &value : sharded.range_search(key_type(45, 45, 1), key_type(55, 55, 3)))
+						result_bytes += value.second.size();
+				}
+			});
+			for (size_t w = 0; w < writers; ++w)
+				threads[w].join();
+			done = true;
+			threads.back().join();
+
+			for (size_t i = 2000; i < 2000 + writers * slice; ++i)
+				tree.insert(std::to_string(i), keys[i]);
+			for (size_t w = 0; w < writers; ++w)
+			{
+				for (size_t i = 2000 + w * slice; i < 2000 + (w + 1) * slice; i += 3)
+					tree.erase(keys[i]);
+			}
+
+			Assert::IsTrue(sharded.size() == tree.size());
+			auto sizes = sharded.shard_sizes();
+			Assert::IsTrue(std::accumulate(sizes.begin(), sizes.end(), size_t(0)) == tree.size());
+			Assert::IsTrue(sharded.at(keys[2001]) == tree.at(keys[2001]));
+			Assert::IsFalse(sharded.contains(keys[2000]));
+
+			size_t op_count = 0;
+			for (auto i = 0; i < 50; ++i)
+			{
+				key_type key(random_engine() % 101, random_engine() % 101, random_engine() % 5);
+				auto expected = tree.KNN_search(7, DistanceCalculator<key_type>(op_count), key);
+				auto actual = sharded.KNN_search(7, DistanceCalculator<key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+				std::sort(actual.begin(), actual.end());
+				Assert::IsTrue(expected.size() == actual.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(expected[j].first == actual[j].first);
+			}
+			Assert::IsTrue(sharded.range_search(key_type(10, 20, 0), key_type(60, 70, 2)).size() == tree.range_search(key_type(10, 20, 0), key_type(60, 70, 2)).size());
+
+			//the batches are split by shard and run on several threads
+			std::vector<std::pair<key_type, std::string>> batch;
+			for (size_t i = 38000; i < 40000; ++i)
+				batch.emplace_back(keys[i - 1000], std::to_string(i));
+			auto inserted = sharded.insert_batch(batch.begin(), batch.end(), 3);
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				Assert::IsTrue(inserted[i] == !tree.contains(batch[i].first));
+				tree.insert(batch[i].second, batch[i].first);
+			}
+			auto erased = sharded.erase_batch(keys.begin(), keys.begin() + 3000, 0);
+			for (size_t i = 0; i < 3000; ++i)
+				Assert::IsTrue(erased[i] == (tree.erase(keys[i]) == 1));
+			Assert::IsTrue(sharded.size() == tree.size());
+		}
+
+		TEST_METHOD(Concurrent_KD_tree_ShouldLinkConcurrentInsertsWithoutLocks)
+		{
+			typedef Concurrent_KD_tree<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> concurrent_type;
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 30000; ++i)
+				keys.emplace_back(i % 101, (i / 101) % 101, i / 10201);
+			std::shuffle(keys.begin(), keys.end(), random_engine);
+
+			std::vector<std::pair<key_type, std::string>> sample;
+			for (auto i = 0; i < 2000; ++i)
+				sample.emplace_back(keys[i], std::to_string(i));
+			concurrent_type concurrent(sample.begin(), sample.end());
+			Assert::IsTrue(concurrent.size() == 2000);
+
+			//every writer inserts its own slice of the keys and then races the others on the same hot keys, while a reader searches
+			const size_t writers = 4, slice = 6000, hot = 100, hot_begin = 2000 + writers * slice;
+			std::vector<std::vector<bool>> won(writers);
+			std::vector<std::thread> threads;
+			std::atomic<bool> done(false);
+			for (size_t w = 0; w < writers; ++w)
+			{
+				threads.emplace_back([&concurrent, &keys, &won, w]
+				{
+					for (size_t i = 2000 + w * slice; i < 2000 + (w + 1) * slice; ++i)
+						concurrent.insert(std::to_string(i), keys[i]);
+					for (size_t i = 0; i < hot; ++i)
+					{
+						//new keys are linked by exactly one writer, and existing keys take the value of the last one
+						won[w].push_back(concurrent.try_insert("w" + std::to_string(w), keys[hot_begin + i]));
+						concurrent.insert("w" + std::to_string(w), keys[i]);
+					}
+				});
+			}
+			threads.emplace_back([&concurrent, &done]
+			{
+				size_t op_count = 0;
+				while (!done)
+				{
+					auto result = concurrent.KNN_search(5, DistanceCalculator<key_type>(op_count), key_type(50, 50, 1));
+					for (auto it = result.begin(); it != result.end(); ++it)
+						Assert::IsFalse(it->second->empty());
+				}
+			});
+			for (size_t w = 0; w < writers; ++w)
+				threads[w].join();
+			done = true;
+			threads.back().join();
+
+			Assert::IsTrue(concurrent.size() == hot_begin + hot);
+			for (size_t i = 0; i < hot; ++i)
+			{
+				size_t winners = 0;
+				for (size_t w = 0; w < writers; ++w)
+					winners += won[w][i];
+				Assert::IsTrue(winners == 1);
+				Assert::IsTrue(concurrent.at(keys[i]).size() == 2 && concurrent.at(keys[i])[0] == 'w');
+			}
+
+			for (size_t i = 0; i < hot_begin + hot; ++i)
+				tree.insert(std::to_string(i), keys[i]);
+			size_t op_count = 0;
+			for (auto i = 0; i < 50; ++i)
+			{
+				key_type key(random_engine() % 101, random_engine() % 101, random_engine() % 3);
+				auto expected = tree.KNN_search(7, DistanceCalculator<key_type>(op_count), key);
+				auto actual = concurrent.KNN_search(7, DistanceCalculator<key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+				std::sort(actual.begin(), actual.end());
+				Assert::IsTrue(expected.size() == actual.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(expected[j].first == actual[j].first);
+			}
+			Assert::IsTrue(concurrent.range_search(key_type(10, 20, 0), key_type(60, 70, 2)).size() == tree.range_search(key_type(10, 20, 0), key_type(60, 70, 2)).size());
+			Assert::IsTrue(concurrent.at(keys[2001]) == tree.at(keys[2001]));
+			Assert::IsFalse(concurrent.contains(keys[29999]));
+		}
+
+		TEST_METHOD(Persistent_KD_tree_ShouldShareNodesBetweenCopies)
+		{
+			Persistent_KD_tree<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false> persistent;
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 20000; ++i)
+			{
+				//a small range of coordinates makes the erases replace nodes by keys that are equal in the splitting dimension
+				keys.emplace_back(random_engine() % 101, random_engine() % 101, random_engine() % 101);
+				Assert::IsTrue(persistent.insert(std::to_string(i), keys.back()) == !tree.contains(keys.back()));
+				tree.insert(std::to_string(i), keys.back());
+			}
+
+			auto before = tree;
+			{
+				auto snapshot = persistent;
+				Assert::IsTrue(&snapshot.at(keys[0]) == &persistent.at(keys[0]));
+
+				for (auto i = 0; i < 300; i += 3)
+					Assert::IsTrue(persistent.erase(keys[i]) == tree.erase(keys[i]));
+				Assert::IsTrue(persistent.erase(key_type(1000, 1000, 1000)) == 0);
+				persistent.insert("changed", keys[1]);
+				tree.insert("changed", keys[1]);
+
+				//the snapshot still holds every value it was copied with, and shares most of them
+				size_t shared = 0;
+				Assert::IsTrue(snapshot.size() == before.size());
+				for (auto it = keys.begin(); it != keys.end(); ++it)
+				{
+					Assert::IsTrue(snapshot.at(*it) == before.at(*it));
+					if (persistent.contains(*it) && &persistent.at(*it) == &snapshot.at(*it))
+						++shared;
+				}
+				Assert::IsTrue(shared > persistent.size() / 2);
+			}
+
+			//without a snapshot the nodes belong to a single tree and are changed in place
+			for (auto i = 300; i < 20000; i += 3)
+				Assert::IsTrue(persistent.erase(keys[i]) == tree.erase(keys[i]));
+
+			Assert::IsTrue(persistent.size() == tree.size());
+			for (auto it = keys.begin(); it != keys.end(); ++it)
+			{
+				Assert::IsTrue(persistent.contains(*it) == tree.contains(*it));
+				if (tree.contains(*it))
+					Assert::IsTrue(persistent.at(*it) == tree.at(*it));
+			}
+
+			size_t op_count = 0;
+			auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key_type(50, 50, 50));
+			auto actual = persistent.KNN_search(10, DistanceCalculator<key_type>(op_count), key_type(50, 50, 50));
+			std::sort(expected.begin(), expected.end());
+			std::sort(actual.begin(), actual.end());
+			for (size_t i = 0; i < expected.size(); ++i)
+				Assert::IsTrue(expected[i].first == actual[i].first);
+			Assert::IsTrue(persistent.range_search(key_type(10, 10, 10), key_type(40, 40, 40)).size() ==
+				tree.range_search(key_type(10, 10, 10), key_type(40, 40, 40)).size());
+		}
+
+		TEST_METHOD(Quantized_KD_tree_ShouldMatchTheTree)
+		{
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 5000; ++i)
+			{
+				//a few clusters of close keys and duplicate coordinates exercise the grids of the buckets
+				keys.emplace_back(random_engine() % 1001, random_engine() % 11, (random_engine() % 2001) / 4.0);
+				tree.insert(std::to_string(i), keys.back());
+			}
+
+			Quantized_KD_tree<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false, std::uint8_t> quantized(tree);
+			Assert::IsTrue(quantized.size() == tree.size());
+			Assert::IsTrue(quantized.hot_bytes() < quantized.cold_bytes());
+			for (auto it = keys.begin(); it != keys.end(); ++it)
+				Assert::IsTrue(quantized.at(*it) == tree.at(*it));
+			Assert::IsFalse(quantized.contains(key_type(2000, 0, 0.0)));
+
+			size_t op_count = 0;
+			Search_stats stats;
+			for (auto i = 0; i < 100; ++i)
+			{
+				key_type key(random_engine() % 1001, random_engine() % 11, (random_engine() % 2001) / 4.0);
+				auto expected = tree.KNN_search(10, DistanceCalculator<key_type>(op_count), key);
+				auto actual = quantized.KNN_search(10, DistanceCalculator<key_type>(op_count), key, stats);
+				std::sort(expected.begin(), expected.end());
+				std::sort(actual.begin(), actual.end());
+				Assert::IsTrue(actual.size() == expected.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(expected[j].first == actual[j].first);
+
+				key_type upper(key_type::get<0>(key) + 100, key_type::get<1>(key) + 3, key_type::get<2>(key) + 50.0);
+				auto expected_range = tree.range_search(key, upper), actual_range = quantized.range_search(key, upper);
+				std::sort(expected_range.begin(), expected_range.end(), [](const std::pair<key_type, std::string> *lhs, const std::pair<key_type, std::string> *rhs) { return lhs->second < rhs->second; });
+				std::sort(actual_range.begin(), actual_range.end(), [](const std::pair<key_type, std::string> *lhs, const std::pair<key_type, std::string> *rhs) { return lhs->second < rhs->second; });
+				Assert::IsTrue(actual_range.size() == expected_range.size());
+				for (size_t j = 0; j < expected_range.size(); ++j)
+					Assert::IsTrue(actual_range[j]->second == expected_range[j]->second);
+			}
+			//most candidates are ruled out by their quantised keys without reading the full precision ones
+			Assert::IsTrue(stats.pruned_subtrees > stats.distance_evaluations);
+		}
+
+		TEST_METHOD(Randomized_KD_forest_ShouldTradeChecksForRecall)
+		{
+			typedef KD_tree<16, std::string, Comparer_wrapper<std::less>, Type_wrapper<int>, false> wide_tree_type;
+			typedef wide_tree_type::key_type wide_key_type;
+			wide_tree_type wide_tree;
+
+			//clusters of integer coordinates, like quantised descriptors
+			std::array<std::array<int, 16>, 20> centres;
+			for (auto &centre : centres)
+				for (auto &coord : centre)
+					coord = random_engine() % 1000;
+			auto make_key = [&]()
+			{
+				std::array<int, 16> coords = centres[random_engine() % centres.size()];
+				for (auto &coord : coords)
+					coord += random_engine() % 601 - 300;
+				return make_point<wide_key_type>(coords, std::make_index_sequence<16>());
+			};
+			std::vector<std::pair<wide_key_type, std::string>> values;
+			for (auto i = 0; i < 4000; ++i)
+			{
+				values.emplace_back(make_key(), std::to_string(i));
+				wide_tree.insert(values.back().second, values.back().first);
+			}
+			Randomized_KD_forest<16, std::string, Comparer_wrapper<std::less>, Type_wrapper<int>, false> forest(4, values.begin(), values.end());
+			Assert::IsTrue(forest.size() == 4000 && forest.trees() == 4);
+
+			size_t op_count = 0, found = 0, queries = 50;
+			for (size_t i = 0; i < queries; ++i)
+			{
+				wide_key_type key = make_key();
+				auto expected = wide_tree.KNN_search(10, DistanceCalculator<wide_key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+
+				//without a budget the search is exact
+				auto exact = forest.KNN_search(10, DistanceCalculator<wide_key_type>(op_count), key, 0);
+				std::sort(exact.begin(), exact.end());
+				Assert::IsTrue(exact.size() == expected.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(exact[j].first == expected[j].first);
+
+				//a budget bounds the distances computed
+				op_count = 0;
+				auto approximate = forest.KNN_search(10, DistanceCalculator<wide_key_type>(op_count), key, 200);
+				Assert::IsTrue(op_count <= 200 && approximate.size() == 10);
+				for (auto it = approximate.begin(); it != approximate.end(); ++it)
+					found += it->first <= expected.back().first;
+			}
+			//most of the nearest neighbours are found after checking a twentieth of the values
+			Assert::IsTrue(found > queries * 10 * 7 / 10);
+		}
+
+		TEST_METHOD(VP_tree_ShouldAnswerQueriesLikeTheTree)
+		{
+			size_t build_count = 0, op_count = 0, tree_op_count = 0;
+			VP_tree<3, std::string, Comparer_wrapper<std::less, std::less, std::less>, Type_wrapper<int, int, double>, false, EuclideanDistance<key_type>> vp_tree{ EuclideanDistance<key_type>(build_count) };
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 3000; ++i)
+			{
+				//a narrow range of the first coordinate repeats some keys, whose mapped values are overwritten
+				keys.emplace_back(random_engine() % 30, random_engine() % 1000, (random_engine() % 4001) / 4.0);
+				tree.insert(std::to_string(i), keys.back());
+				vp_tree.insert(std::to_string(i), keys.back());
+			}
+			for (auto i = 0; i < 1000; ++i)
+			{
+				auto &key = keys[random_engine() % keys.size()];
+				Assert::IsTrue(vp_tree.erase(key) == tree.erase(key));
+			}
+			Assert::IsTrue(vp_tree.size() == tree.size());
+			for (auto it = keys.begin(); it != keys.end(); ++it)
+				Assert::IsTrue(vp_tree.contains(*it) == tree.contains(*it) && (!tree.contains(*it) || vp_tree.at(*it) == tree.at(*it)));
+
+			for (auto i = 0; i < 100; ++i)
+			{
+				key_type key(random_engine() % 30, random_engine() % 1000, (random_engine() % 4001) / 4.0);
+				auto expected = tree.KNN_search(10, EuclideanDistance<key_type>(tree_op_count), key);
+				auto actual = vp_tree.KNN_search(10, EuclideanDistance<key_type>(op_count), key);
+				std::sort(expected.begin(), expected.end());
+				std::sort(actual.begin(), actual.end());
+				Assert::IsTrue(actual.size() == expected.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(expected[j].first == actual[j].first);
+
+				auto expected_radius = tree.radius_search(100.0, EuclideanDistance<key_type>(tree_op_count), key);
+				auto actual_radius = vp_tree.radius_search(100.0, EuclideanDistance<key_type>(op_count), key);
+				//values at equal distances are ordered by their mapped values rather than by their addresses
+				auto by_distance = [](const std::pair<double, const std::string*> &lhs, const std::pair<double, const std::string*> &rhs)
+				{
+					return lhs.first < rhs.first || (lhs.first == rhs.first && *lhs.second < *rhs.second);
+				};
+				std::sort(expected_radius.begin(), expected_radius.end(), by_distance);
+				std::sort(actual_radius.begin(), actual_radius.end(), by_distance);
+				Assert::IsTrue(actual_radius.size() == expected_radius.size());
+				for (size_t j = 0; j < expected_radius.size(); ++j)
+					Assert::IsTrue(expected_radius[j].first == actual_radius[j].first && *expected_radius[j].second == *actual_radius[j].second);
+			}
+			//both trees prune most of the values
+			Assert::IsTrue(op_count < 100 * 2 * tree.size() / 4 && tree_op_count < 100 * 2 * tree.size() / 4);
+
+			//a value can be inserted whole, and k = 0 finds every value
+			decltype(vp_tree)::value_type value(key_type(-1, -1, -1), "whole");
+			size_t size = vp_tree.size();
+			vp_tree.insert(value);
+			Assert::IsTrue(vp_tree.insert(std::move(value)).second == "whole" && vp_tree.size() == size + 1);
+			Assert::IsTrue(vp_tree.KNN_search(0, EuclideanDistance<key_type>(op_count), key_type(0, 0, 0)).size() == vp_tree.size());
+			Assert::IsTrue(tree.KNN_search(0, EuclideanDistance<key_type>(tree_op_count), key_type(0, 0, 0)).size() == tree.size());
+		}
+
+		TEST_METHOD(Curve_order_ShouldStepBetweenAdjacentCells)
+		{
+			Assert::IsTrue(morton_code<2>({ { 1, 0 } }) == 2 && morton_code<2>({ { 0, 1 } }) == 1 && morton_code<2>({ { 3, 3 } }) == 15);
+
+			//a corner of the grid is a subsquare of the curve, so its cells get consecutive codes
+			std::vector<std::pair<std::uint64_t, std::array<std::uint32_t, 3>>> cells;
+			for (std::uint32_t x = 0; x < 8; ++x)
+				for (std::uint32_t y = 0; y < 8; ++y)
+					for (std::uint32_t z = 0; z < 8; ++z)
+						cells.emplace_back(hilbert_code<3>({ { x, y, z } }), std::array<std::uint32_t, 3>{ { x, y, z } });
+			std::sort(cells.begin(), cells.end());
+			for (size_t i = 1; i < cells.size(); ++i)
+			{
+				Assert::IsTrue(cells[i].first == cells[i - 1].first + 1);
+				std::uint32_t steps = 0;
+				for (size_t d = 0; d < 3; ++d)
+					steps += cells[i].second[d] > cells[i - 1].second[d] ? cells[i].second[d] - cells[i - 1].second[d] : cells[i - 1].second[d] - cells[i].second[d];
+				Assert::IsTrue(steps == 1);
+			}
+
+			//the range constructor bulk builds the tree with the same result as inserting the values in order
+			std::vector<std::pair<key_type, std::string>> values;
+			for (auto i = 0; i < 5000; ++i)
+				values.emplace_back(key_type(random_engine() % 101, random_engine() % 101, random_engine() % 101), std::to_string(i));
+			for (auto it = values.begin(); it != values.end(); ++it)
+				tree.insert(it->second, it->first);
+			decltype(tree) built(values.begin(), values.end());
+			Assert::IsTrue(built.size() == tree.size());
+			Assert::IsTrue(built.diagnostics().balance_factor < 1.5);
+			for (auto it = values.begin(); it != values.end(); ++it)
+				Assert::IsTrue(built.at(it->first) == tree.at(it->first));
+
+			std::vector<key_type> queries;
+			for (auto i = 0; i < 200; ++i)
+				queries.emplace_back(random_engine() % 101, random_engine() % 101, random_engine() % 101);
+			size_t op_count = 0;
+			auto rows = built.KNN_search_batch(5, DistanceCalculator<key_type>(op_count), queries.begin(), queries.end());
+			Assert::IsTrue(rows.size() == queries.size());
+			for (size_t i = 0; i < queries.size(); ++i)
+			{
+				auto expected = tree.KNN_search(5, DistanceCalculator<key_type>(op_count), queries[i]);
+				std::sort(expected.begin(), expected.end());
+				std::sort(rows[i].begin(), rows[i].end());
+				Assert::IsTrue(rows[i].size() == expected.size());
+				for (size_t j = 0; j < expected.size(); ++j)
+					Assert::IsTrue(rows[i][j].first == expected[j].first);
+			}
+
+			//keys of more than 64 dimensions do not fit a curve code, so the batch methods keep their order
+			typedef KD_tree<65, int, Comparer_wrapper<std::less>, Type_wrapper<int>, false> wide_tree_type;
+			typedef wide_tree_type::key_type wide_key_type;
+			std::vector<std::pair<wide_key_type, int>> wide_values;
+			std::array<int, 65> coords;
+			for (auto i = 0; i < 100; ++i)
+			{
+				for (auto &coord : coords)
+					coord = random_engine() % 101;
+				wide_values.emplace_back(make_point<wide_key_type>(coords, std::make_index_sequence<65>()), i);
+			}
+			wide_tree_type wide_tree(wide_values.begin(), wide_values.end() - 10);
+			wide_tree.insert_batch(wide_values.end() - 10, wide_values.end());
+			coords.fill(1000);
+			std::vector<std::pair<wide_key_type, wide_key_type>> moves{ { wide_values[0].first, make_point<wide_key_type>(coords, std::make_index_sequence<65>()) } };
+			Assert::IsTrue(wide_tree.update_key_batch(moves.begin(), moves.end())[0]);
+			Assert::IsTrue(wide_tree.size() == 100 && wide_tree.at(moves[0].second) == 0 && wide_tree.at(wide_values[1].first) == 1);
+		}
+
+		TEST_METHOD(Interleaved_ShouldMatchTheRecursiveSearchesExactly)
+		{
+			size_t op_count = 0;
+			std::vector<key_type> queries;
+			for (auto i = 0; i < 100; ++i)
+				queries.emplace_back(random_engine() % 101, random_engine() % 101, random_engine() % 101);
+			//an empty tree leaves every row empty
+			auto empty_rows = tree.KNN_search_batch(Interleaved(), 3, DistanceCalculator<key_type>(op_count), queries.begin(), queries.end());
+			Assert::IsTrue(empty_rows.size() == queries.size());
+			for (auto it = empty_rows.begin(); it != empty_rows.end(); ++it)
+				Assert::IsTrue(it->empty());
+
+			std::vector<key_type> keys;
+			for (auto i = 0; i < 3000; ++i)
+			{
+				keys.emplace_back(random_engine() % 101, random_engine() % 101, random_engine() % 101);
+				tree.insert(std::to_string(i), keys.back());
+			}
+
+			//the interleaved searches visit the same nodes in the same order as KNN_search, so every row is identical to its result,
+			//with more queries than lanes and with fewer
+			Interleaved strategies[] = { Interleaved(), Interleaved(3), Interleaved(1000) };
+			for (auto strategy = std::begin(strategies); strategy != std::end(strategies); ++strategy)
+			{
+				auto rows = tree.KNN_search_batch(*strategy, 7, DistanceCalculator<key_type>(op_count), queries.begin(), queries.end());
+				Assert::IsTrue(rows.size() == queries.size());
+				for (size_t i = 0; i < queries.size(); ++i)
+					Assert::IsTrue(rows[i] == tree.KNN_search(7, DistanceCalculator<key_type>(op_count), queries[i]));
+			}
+
+			std::vector<key_type> probes(keys.begin(), keys.begin() + 50);
+			probes.insert(probes.end(), queries.begin(), queries.end());
+			auto found = tree.contains_batch(probes.begin(), probes.end());
+			auto interleaved = tree.contains_batch(Interleaved(3), probes.begin(), probes.end());
+			Assert::IsTrue(found.size() == probes.size() && interleaved.size() == probes.size());
+			for (size_t i = 0; i < probes.size(); ++i)
+			{
+				Assert::IsTrue(found[i] == tree.contains(probes[i]));
+				Assert::IsTrue(interleaved[i] == found[i]);
+			}
+		}
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,504 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A log-structured forest for high insert rates (the logarithmic method). New values go to a small unsorted buffer.
+	//When the buffer is full it is merged with the smallest levels into a balanced, bulk-built static tree: level i holds
+	//up to buffer_capacity * 2^i values, so every value is rebuilt O(log n) times and inserts cost amortised O(log^2 n).
+	//Erased values are marked with tombstones and dropped by the next merge that touches their level.
+	//Queries run over the buffer and every level with one shared bounded priority queue, which merges their results.
+	//References to stored values are invalidated by any insert or erase. Merges run inside insert, so queries must not run
+	//concurrently with insert, erase or clear; concurrent queries on an unchanging forest are safe.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class KD_forest
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
+
+		explicit KD_forest(size_t buffer_capacity = 1024, const key_compare &compare = key_compare());
+
+		//Inserts a value or overwrites the mapped value of an existing key. Returns true if a new key was inserted.
+		bool insert(const value_type &value);
+		bool insert(value_type &&value);
+		template<typename... Coords>
+		bool insert(const mapped_type &mapped, Coords&&... coordinates);
+		template<typename... Coords>
+		bool insert(mapped_type &&mapped, Coords&&... coordinates);
+		size_t erase(const key_type &key);
+
+		mapped_type& at(const key_type &key);
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const;
+
+		bool empty() const { return m_size == 0; }
+		size_t size() const { return m_size; }
+		static constexpr size_t dimension() { return Dim; }
+		//The number of static levels, including empty ones
+		size_t levels() const { return m_levels.size(); }
+		void clear();
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+
+	private:
+		typedef KD_tree_static_node<tree_traits> node_type;
+		typedef const node_type* const_node_pointer;
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+
+		//A static tree stored in preorder; nodes[0] is the root
+		struct level
+		{
+			std::vector<node_type>	nodes;
+			std::vector<bool>		erased;
+			size_t					live = 0;
+
+			const_node_pointer root() const { return nodes.empty() ? nullptr : nodes.data(); }
+			size_t index_of(const_node_pointer node) const { return static_cast<size_t>(node - nodes.data()); }
+		};
+
+		//Orders keys lexicographically by dimension
+		struct key_less
+		{
+			key_compare comp;
+
+			bool operator()(const key_type &lhs, const key_type &rhs) const { return less<0>(lhs, rhs); }
+
+			template<size_t N>
+			bool less(const key_type &lhs, const key_type &rhs) const
+			{
+				if (comp.template compare<N>(lhs, rhs))
+					return true;
+				else if (comp.template compare<N>(rhs, lhs))
+					return false;
+				else if (N + 1 < Dim)
+					return less<next_dim<N>()>(lhs, rhs);
+				else
+					return false;
+			}
+		};
+
+		//Accepts the nodes of a level that have not been erased
+		struct live_filter
+		{
+			const level *lvl;
+			bool operator()(const_node_pointer node) const { return !lvl->erased[lvl->index_of(node)]; }
+		};
+
+		std::vector<value_type>	m_buffer;
+		//The position of every buffered key in m_buffer, so that inserts find duplicates in O(log buffer_capacity)
+		std::map<key_type, size_t, key_less>	m_buffer_index;
+		std::vector<level>		m_levels;
+		size_t					m_buffer_capacity;
+		size_t					m_size;
+		size_t					m_erased;
+		key_compare				m_comp;
+
+		template<size_t N>
+		static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+		//Returns the buffered value with the given key or nullptr
+		value_type* find_buffered(const key_type &key);
+		//Returns the live node with the given key and the level that holds it, or nullptr
+		std::pair<const_node_pointer, const level*> find_stored(const key_type &key) const;
+		template<typename Value>
+		bool insert_op(Value &&value);
+		//Merges the buffer with the smallest levels into the first empty level
+		void flush();
+		//Moves the live values of a level to out and empties the level
+		void drain(level &lvl, std::vector<value_type> &out);
+		//Merges every level into one when the tombstones outnumber the live values
+		void compact();
+		//Builds a balanced level from values
+		void build(level &lvl, std::vector<value_type> &values);
+		//Builds the subtree over [begin, end) in preorder and returns the index of its root or -1
+		template<size_t N, typename Iterator>
+		std::int64_t build_op(Iterator begin, Iterator end, std::vector<node_type> &nodes);
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KD_forest(size_t buffer_capacity, const key_compare &compare)
+		: m_buffer_index(key_less{ compare }), m_buffer_capacity(buffer_capacity > 0 ? buffer_capacity : 1), m_size(0), m_erased(0), m_comp(compare)
+	{
+		m_buffer.reserve(m_buffer_capacity);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::value_type*
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::find_buffered(const key_type &key)
+	{
+		auto it = m_buffer_index.find(key);
+		return it == m_buffer_index.end() ? nullptr : &m_buffer[it->second];
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	std::pair<typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::const_node_pointer, const typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::level*>
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::find_stored(const key_type &key) const
+	{
+		for (auto it = m_levels.begin(), end_it = m_levels.end(); it != end_it; ++it)
+		{
+			const_node_pointer node = search_type::template find_op<0>(it->root(), m_comp, key);
+			//a key is live in at most one level, but erased copies may remain in others
+			if (node != nullptr && !it->erased[it->index_of(node)])
+				return std::make_pair(node, &*it);
+		}
+
+		return std::make_pair(const_node_pointer(nullptr), static_cast<const level*>(nullptr));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Value>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert_op(Value &&value)
+	{
+		const key_type &key = tree_traits::val_to_key(value);
+
+		//an existing key is overwritten in place, since its position does not depend on the mapped value
+		if (value_type *buffered = find_buffered(key))
+		{
+			tree_traits::val_to_mapped(*buffered) = tree_traits::val_to_mapped(value);
+			return false;
+		}
+		auto stored = find_stored(key);
+		if (stored.first != nullptr)
+		{
+			tree_traits::val_to_mapped(const_cast<node_type*>(stored.first)->value()) = tree_traits::val_to_mapped(value);
+			return false;
+		}
+
+		m_buffer.push_back(std::forward<Value>(value));
+		m_buffer_index.emplace(tree_traits::val_to_key(m_buffer.back()), m_buffer.size() - 1);
+		++m_size;
+		if (m_buffer.size() == m_buffer_capacity)
+			flush();
+		return true;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(const value_type &value)
+	{
+		return insert_op(value);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(value_type &&value)
+	{
+		return insert_op(std::move(value));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename... Coords>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(const mapped_type &mapped, Coords&&... coordinates)
+	{
+		return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped });
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename... Coords>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(mapped_type &&mapped, Coords&&... coordinates)
+	{
+		return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) });
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	size_t
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase(const key_type &key)
+	{
+		auto buffered = m_buffer_index.find(key);
+		if (buffered != m_buffer_index.end())
+		{
+			//the buffer is unordered, so the last value can fill the gap
+			size_t index = buffered->second;
+			m_buffer_index.erase(buffered);
+			if (index + 1 != m_buffer.size())
+			{
+				m_buffer[index] = std::move(m_buffer.back());
+				m_buffer_index[tree_traits::val_to_key(m_buffer[index])] = index;
+			}
+			m_buffer.pop_back();
+			--m_size;
+			return 1;
+		}
+
+		auto stored = find_stored(key);
+		if (stored.first == nullptr)
+			return 0;
+
+		level &lvl = const_cast<level&>(*stored.second);
+		lvl.erased[lvl.index_of(stored.first)] = true;
+		--lvl.live;
+		--m_size;
+		++m_erased;
+		if (m_erased > m_size)
+			compact();
+		return 1;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key)
+	{
+		return const_cast<mapped_type&>(static_cast<const KD_forest&>(*this).at(key));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	const typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
+	{
+		if (const value_type *buffered = const_cast<KD_forest*>(this)->find_buffered(key))
+			return tree_traits::val_to_mapped(*buffered);
+
+		auto stored = find_stored(key);
+		if (stored.first == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(stored.first->value());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::contains(const key_type &key) const
+	{
+		return const_cast<KD_forest*>(this)->find_buffered(key) != nullptr || find_stored(key).first != nullptr;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::clear()
+	{
+		m_buffer.clear();
+		m_buffer_index.clear();
+		m_levels.clear();
+		m_size = 0;
+		m_erased = 0;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::drain(level &lvl, std::vector<value_type> &out)
+	{
+		for (size_t i = 0; i < lvl.nodes.size(); ++i)
+		{
+			if (!lvl.erased[i])
+				out.push_back(std::move(lvl.nodes[i].value()));
+		}
+
+		m_erased -= lvl.nodes.size() - lvl.live;
+		lvl.nodes.clear();
+		lvl.erased.clear();
+		lvl.live = 0;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::flush()
+	{
+		std::vector<value_type> values;
+		values.swap(m_buffer);
+		m_buffer_index.clear();
+
+		//find the first level that can hold the buffer and all smaller levels
+		size_t target = 0;
+		while (target < m_levels.size() && m_levels[target].live > 0)
+			drain(m_levels[target++], values);
+		if (target == m_levels.size())
+			m_levels.emplace_back();
+		else
+			drain(m_levels[target], values);
+
+		build(m_levels[target], values);
+		m_buffer.reserve(m_buffer_capacity);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::compact()
+	{
+		std::vector<value_type> values;
+		values.reserve(m_size);
+		for (auto it = m_levels.begin(), end_it = m_levels.end(); it != end_it; ++it)
+			drain(*it, values);
+
+		//place the survivors in the smallest level that can hold them
+		size_t target = 0;
+		while ((m_buffer_capacity << target) < values.size())
+			++target;
+		m_levels.resize(target + 1);
+		build(m_levels[target], values);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::build(level &lvl, std::vector<value_type> &values)
+	{
+		lvl.nodes.clear();
+		lvl.nodes.reserve(values.size());
+		build_op<0>(values.begin(), values.end(), lvl.nodes);
+		lvl.erased.assign(lvl.nodes.size(), false);
+		lvl.live = lvl.nodes.size();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N, typename Iterator>
+	std::int64_t
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::build_op(Iterator begin, Iterator end, std::vector<node_type> &nodes)
+	{
+		if (begin == end)
+			return -1;
+
+		const key_compare &comp = m_comp;
+		auto less = [&comp](const value_type &lhs, const value_type &rhs)
+		{
+			return comp.template compare<N>(tree_traits::val_to_key(lhs), tree_traits::val_to_key(rhs));
+		};
+
+		//select the median in dimension N
+		Iterator median = begin + (end - begin) / 2;
+		std::nth_element(begin, median, end, less);
+		const key_type pivot = tree_traits::val_to_key(*median);
+
+		//move the keys that are smaller than the median to the left and make a key equal to the median the first of the rest,
+		//so that keys equal to the median in dimension N end up in the right subtree as insert_loc_op expects
+		Iterator split = std::partition(begin, end, [&comp, &pivot](const value_type &value)
+		{
+			return comp.template compare<N>(tree_traits::val_to_key(value), pivot);
+		});
+		Iterator root = std::find_if(split, end, [&comp, &pivot](const value_type &value)
+		{
+			return !comp.template compare<N>(pivot, tree_traits::val_to_key(value));
+		});
+		if (root != split)
+		{
+			using std::swap;
+			swap(*root, *split);
+		}
+
+		std::int64_t index = static_cast<std::int64_t>(nodes.size());
+		nodes.emplace_back(std::move(*split));
+		std::int64_t left = build_op<next_dim<N>()>(begin, split, nodes);
+		std::int64_t right = build_op<next_dim<N>()>(std::next(split), end, nodes);
+
+		const std::int64_t node_size = static_cast<std::int64_t>(sizeof(node_type));
+		nodes[static_cast<size_t>(index)].left_offset() = left < 0 ? 0 : (left - index) * node_size;
+		nodes[static_cast<size_t>(index)].right_offset() = right < 0 ? 0 : (right - index) * node_size;
+		return index;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		for (auto it = m_buffer.begin(), end_it = m_buffer.end(); it != end_it; ++it)
+		{
+			stats.enter_node();
+			if (pred(*it))
+			{
+				auto radius = distance.get_cartesian_distance(tree_traits::val_to_key(*it), key);
+				stats.distance_evaluated();
+				if (q.full() && radius < q.top().first)
+					stats.queue_replaced();
+				q.push(KNN_type{ radius, &tree_traits::val_to_mapped(*it) });
+			}
+			stats.leave_node();
+		}
+
+		//the largest levels hold most of the values and fill the queue with good candidates first
+		for (auto it = m_levels.rbegin(), end_it = m_levels.rend(); it != end_it; ++it)
+			search_type::template KNN_search_op<0>(it->root(), m_comp, distance, key, q, detail::value_filter<Predicate, live_filter>{ pred, live_filter{ &*it } }, stats);
+
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		for (auto it = m_buffer.begin(), end_it = m_buffer.end(); it != end_it; ++it)
+		{
+			stats.enter_node();
+			if (search_type::in_range(m_comp, tree_traits::val_to_key(*it), lower, upper))
+				result.push_back(&*it);
+			stats.leave_node();
+		}
+
+		for (auto it = m_levels.begin(), end_it = m_levels.end(); it != end_it; ++it)
+			search_type::template range_search_op<0>(it->root(), m_comp, lower, upper, result, live_filter{ &*it }, stats);
+
+		return result;
+	}
+}
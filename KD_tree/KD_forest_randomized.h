@@ -0,0 +1,363 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A static forest of randomised KD-Trees for approximate KNN searches of keys with many dimensions (C. Silpa-Anan and R. Hartley,
+	//"Optimised KD-trees for fast image descriptor matching", 2008; M. Muja and D. G. Lowe, "Fast approximate nearest neighbors with
+	//automatic algorithm configuration", 2009). The round robin splits of a KD_tree only cut each of many dimensions a few times, so its
+	//searches can prune almost nothing. Every tree of the forest instead splits a range of values at the median of a dimension chosen at
+	//random among the split_candidates dimensions in which the range varies most. The trees differ, so a neighbour that one tree puts on the
+	//far side of a plane is often on the near side in another. A search descends every tree, and then expands the pending subtree with the
+	//smallest lower bound of its distance in any of the trees (best bin first) until it has computed the distances of checks values.
+	//More trees and more checks raise both the recall and the latency; 0 checks make the search exact.
+	//Coordinates must be arithmetic, since the variances are measured as double, and the distance to a splitting plane must be a lower
+	//bound of the distance to any key on its other side, as for the other trees.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Randomized_KD_forest
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+
+		//The number of dimensions of the highest variance among which a split is chosen
+		static constexpr size_t split_candidates = 5;
+		//The largest number of values of a range whose variances are measured
+		static constexpr size_t variance_sample = 128;
+
+		//Builds a number of randomised trees over a range of values. Equal seeds build equal forests.
+		template<typename InputIterator>
+		Randomized_KD_forest(size_t trees, InputIterator first, InputIterator last, const key_compare &compare = key_compare(), std::uint_fast32_t seed = 0);
+
+		bool empty() const { return m_values.empty(); }
+		size_t size() const { return m_values.size(); }
+		size_t trees() const { return m_trees.size(); }
+		static constexpr size_t dimension() { return Dim; }
+
+		//Finds k near values after computing the distances of at most checks values, or of as many as an exact search needs if checks is 0.
+		//A search computes more than checks distances only while it has found fewer than k values.
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, size_t checks) const { No_stats stats; return KNN_search(k, distance, key, checks, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, size_t checks, Stats &stats) const;
+
+	private:
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+		typedef std::array<double, Dim> coordinates_type;
+
+		//A tree holds the values in an order where every range of values is split by the value at its middle, so the children of the range
+		//[begin, end) with the middle m are [begin, m) and [m + 1, end). A slot holds the index of a value and the dimension that it splits.
+		struct slot
+		{
+			size_t	value;
+			size_t	dim;
+		};
+
+		//Runtime dimension indices are dispatched to the compile time indices of key_compare and Distance_op
+		struct less_visitor
+		{
+			const key_compare &comp;
+			bool result;
+
+			template<size_t N>
+			void visit(const key_type *lhs, const key_type *rhs) { result = comp.template compare<N>(*lhs, *rhs); }
+		};
+		template<typename Distance_op>
+		struct plane_visitor
+		{
+			Distance_op &distance;
+			double result;
+
+			template<size_t N>
+			void visit(const key_type *split, const key_type *key) { result = distance.template get_distance_to_plane<N>(*split, *key); }
+		};
+
+		//An open addressing set of the indices of the values that a search has measured. It grows with the values it holds, so a search costs
+		//time in the number of values it measures rather than in the size of the forest.
+		class index_set
+		{
+		public:
+			explicit index_set(size_t expected) : m_slots(capacity(expected), empty_slot()), m_size(0) {}
+			//Returns false if the set already holds the index
+			bool insert(size_t index);
+
+		private:
+			std::vector<size_t>	m_slots;
+			size_t				m_size;
+
+			static size_t empty_slot() { return size_t(-1); }
+			//A power of two that keeps the set at most half full
+			static size_t capacity(size_t count) { size_t result = 16; while (result < 2 * count) result *= 2; return result; }
+			//Multiplying by an odd constant spreads consecutive indices over the slots
+			size_t slot_of(size_t index) const { return (index * size_t(0x9E3779B97F4A7C15ull)) & (m_slots.size() - 1); }
+		};
+
+		template<typename Distance_op, typename Stats>
+		class best_bin_first;
+
+		std::vector<value_type>			m_values;
+		std::vector<std::vector<slot>>	m_trees;
+		key_compare						m_comp;
+
+		template<size_t... I>
+		static coordinates_type coordinates(const key_type &key, std::index_sequence<I...>) { return coordinates_type{ { double(key_type::template get<I>(key))... } }; }
+		bool less(size_t dim, const key_type &lhs, const key_type &rhs) const
+		{
+			less_visitor visitor{ m_comp, false };
+			search_type::dispatch_dim(dim, visitor, &lhs, &rhs);
+			return visitor.result;
+		}
+
+		//Splits the range [begin, end) of the values listed in order and its subranges into a tree
+		template<typename Engine>
+		void build_op(std::vector<slot> &tree, std::vector<size_t> &order, size_t begin, size_t end, Engine &engine);
+		//Chooses a dimension at random among the split candidates of a range of values
+		template<typename Engine>
+		size_t split_dim(const std::vector<size_t> &order, size_t begin, size_t end, Engine &engine) const;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//The state of one search of the forest. The frontier holds the subtrees of every tree that have not been expanded yet, keyed by a lower
+	//bound of the distance from the test point to any point inside them, and a value reached through several trees is only measured once.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	class Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::best_bin_first
+	{
+	public:
+		best_bin_first(const Randomized_KD_forest &forest, Distance_op &distance, const key_type &key, queue_type &q, size_t max_checks, Stats &stats)
+			: forest(forest), distance(distance), key(key), q(q), stats(stats), max_checks(max_checks), checks(0), checked(max_checks) {}
+
+		void run();
+
+	private:
+		struct pending
+		{
+			double	bound;
+			size_t	tree;
+			size_t	begin, end;
+		};
+		//Orders the frontier so that its top holds the smallest bound
+		struct pending_compare
+		{
+			bool operator()(const pending &lhs, const pending &rhs) const { return rhs.bound < lhs.bound; }
+		};
+
+		bool exhausted() const { return max_checks > 0 && checks >= max_checks && q.full(); }
+		//Tests whether a subtree with the given bound can hold a point closer than the current k-th nearest point
+		bool may_improve(double bound) const { return !q.full() || bound < q.top().first; }
+		//Descends from a subtree to a leaf along the side of the test point and queues the other sides
+		void descend(size_t tree, size_t begin, size_t end, double bound);
+
+		const Randomized_KD_forest &forest;
+		Distance_op &distance;
+		const key_type &key;
+		queue_type &q;
+		Stats &stats;
+		size_t max_checks;
+		size_t checks;
+		index_set checked;
+		BK_heap::Priority_queue<pending, std::vector<pending>, pending_compare> frontier;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::Randomized_KD_forest(size_t trees, InputIterator first, InputIterator last, const key_compare &compare, std::uint_fast32_t seed)
+		: m_values(first, last), m_comp(compare)
+	{
+		std::mt19937 engine(seed);
+		std::vector<size_t> order(m_values.size());
+		for (size_t t = 0; t < trees; ++t)
+		{
+			std::iota(order.begin(), order.end(), size_t(0));
+			m_trees.emplace_back(m_values.size());
+			build_op(m_trees.back(), order, 0, order.size(), engine);
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Engine>
+	void
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::build_op(std::vector<slot> &tree, std::vector<size_t> &order, size_t begin, size_t end, Engine &engine)
+	{
+		if (begin == end)
+			return;
+
+		//the values of the lower half are not greater than the median and those of the upper half not smaller
+		size_t dim = split_dim(order, begin, end, engine), middle = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [this, dim](size_t lhs, size_t rhs)
+		{
+			return less(dim, tree_traits::val_to_key(m_values[lhs]), tree_traits::val_to_key(m_values[rhs]));
+		});
+		tree[middle] = slot{ order[middle], dim };
+		build_op(tree, order, begin, middle, engine);
+		build_op(tree, order, middle + 1, end, engine);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Engine>
+	size_t
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::split_dim(const std::vector<size_t> &order, size_t begin, size_t end, Engine &engine) const
+	{
+		//the variances are measured over evenly spaced values of a large range
+		size_t step = (end - begin + variance_sample - 1) / variance_sample, count = 0;
+		coordinates_type sum{}, square_sum{};
+		for (size_t i = begin; i < end; i += step, ++count)
+		{
+			coordinates_type coords = coordinates(tree_traits::val_to_key(m_values[order[i]]), std::make_index_sequence<Dim>());
+			for (size_t d = 0; d < Dim; ++d)
+			{
+				sum[d] += coords[d];
+				square_sum[d] += coords[d] * coords[d];
+			}
+		}
+
+		std::array<std::pair<double, size_t>, Dim> variances;
+		for (size_t d = 0; d < Dim; ++d)
+			variances[d] = std::make_pair(square_sum[d] / double(count) - sum[d] * sum[d] / (double(count) * double(count)), d);
+		size_t candidates = Dim < split_candidates ? Dim : split_candidates;
+		std::partial_sort(variances.begin(), variances.begin() + candidates, variances.end(), [](const std::pair<double, size_t> &lhs, const std::pair<double, size_t> &rhs) { return lhs.first > rhs.first; });
+		return variances[std::uniform_int_distribution<size_t>(0, candidates - 1)(engine)].second;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::index_set::insert(size_t index)
+	{
+		if (2 * (m_size + 1) > m_slots.size())
+		{
+			std::vector<size_t> slots(2 * m_slots.size(), empty_slot());
+			std::swap(m_slots, slots);
+			for (auto it = slots.begin(), end_it = slots.end(); it != end_it; ++it)
+			{
+				if (*it == empty_slot())
+					continue;
+				size_t i = slot_of(*it);
+				while (m_slots[i] != empty_slot())
+					i = (i + 1) & (m_slots.size() - 1);
+				m_slots[i] = *it;
+			}
+		}
+
+		//linear probing, since the set never holds more than half of its slots
+		size_t i = slot_of(index);
+		for (; m_slots[i] != empty_slot(); i = (i + 1) & (m_slots.size() - 1))
+		{
+			if (m_slots[i] == index)
+				return false;
+		}
+		m_slots[i] = index;
+		++m_size;
+		return true;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	typename Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search(size_t k, Distance_op distance, const key_type &key, size_t checks, Stats &stats) const
+	{
+		queue_type q(k);
+		if (k > 0)
+			best_bin_first<Distance_op, Stats>(*this, distance, key, q, checks, stats).run();
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	void
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::best_bin_first<Distance_op, Stats>::run()
+	{
+		for (size_t t = 0; t < forest.trees(); ++t)
+			descend(t, 0, forest.size(), 0.0);
+
+		while (!frontier.empty() && !exhausted())
+		{
+			pending next = frontier.top();
+			//the frontier is ordered by bound, so no pending subtree can improve the result once the closest one cannot
+			if (!may_improve(next.bound))
+				break;
+			frontier.pop();
+			descend(next.tree, next.begin, next.end, next.bound);
+		}
+
+		for (size_t i = 0; i < frontier.size(); ++i)
+			stats.subtree_pruned();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	void
+	Randomized_KD_forest<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::best_bin_first<Distance_op, Stats>::descend(size_t tree, size_t begin, size_t end, double bound)
+	{
+		size_t depth = 0;
+		for (; begin < end && !exhausted(); ++depth)
+		{
+			size_t middle = begin + (end - begin) / 2;
+			const slot &current = forest.m_trees[tree][middle];
+			const key_type &split = tree_traits::val_to_key(forest.m_values[current.value]);
+			stats.enter_node();
+			if (checked.insert(current.value))
+			{
+				double radius = distance.get_cartesian_distance(split, key);
+				++checks;
+				stats.distance_evaluated();
+				if (q.full() && radius < q.top().first)
+					stats.queue_replaced();
+				q.push(KNN_type{ radius, &tree_traits::val_to_mapped(forest.m_values[current.value]) });
+			}
+
+			bool go_left = forest.less(current.dim, key, split);
+			size_t far_begin = go_left ? middle + 1 : begin, far_end = go_left ? end : middle;
+			if (far_begin < far_end)
+			{
+				//every point on the other side of the splitting hyperplane is at least as far as the plane and the bound of this subtree
+				plane_visitor<Distance_op> visitor{ distance, 0.0 };
+				search_type::dispatch_dim(current.dim, visitor, &split, &key);
+				stats.plane_tested();
+				double far_bound = bound < visitor.result ? visitor.result : bound;
+				if (may_improve(far_bound))
+					frontier.push(pending{ far_bound, tree, far_begin, far_end });
+				else
+					stats.subtree_pruned();
+			}
+
+			if (go_left)
+				end = middle;
+			else
+				begin = middle + 1;
+		}
+		while (depth-- > 0)
+			stats.leave_node();
+	}
+}
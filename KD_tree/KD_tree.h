@@ -10,11 +10,20 @@
 #include "KD_tree_point.h"
 #include "KD_tree_node.h"
 #include "KD_tree_base.h"
+#include "KD_tree_cold.h"
+#include "KD_tree_search.h"
+#include "KD_tree_batch.h"
+#include "KD_tree_nearest.h"
+#include "KD_tree_join.h"
+#include "KD_tree_string.h"
 #include "Priority_queue.h"
 #include "tuple.h"
 #include <type_traits>
 #include <functional>
 #include <typeinfo>
+#include <limits>
+#include <memory>
+#include <numeric>
 
 namespace BK_KD_tree
 {
@@ -58,7 +67,7 @@ namespace BK_KD_tree
 		struct grab_first_type { typedef T type; };
 
 		template<template<typename...> typename T, template<typename...> typename... Args>
-		struct grab_first_template { template<typename... Args> using type = T<Args...>; };
+		struct grab_first_template { template<typename... Ts> using type = T<Ts...>; };
 
 	//---------------------------------------------------------------------------------------------
 		//Compares two parameter packs for equality. Syntax: compare_pack<Pack1...>::to<Pack2>::value or compare_pack<Pack1...>::to<Pack2>()
@@ -127,24 +136,42 @@ namespace BK_KD_tree
 			}
 		};
 
+		//A vector of T that allocates with a rebound copy of Allocator
+		template<typename T, typename Allocator>
+		using allocated_vector = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+		//Tests whether the arguments of a call start with std::allocator_arg
+		template<typename... Args>
+		struct starts_with_allocator_arg : std::false_type {};
+
+		template<typename First, typename... Args>
+		struct starts_with_allocator_arg<First, Args...> : std::is_same<std::decay_t<First>, std::allocator_arg_t> {};
+
 		//A custom bounded priority queue class. T must be std::pair<double, value_type*>
 		template<typename T, typename Container>
 		class bounded_priority_queue : private BK_heap::Priority_queue<T, Container, queue_val_comp<T>>
 		{
+			typedef BK_heap::Priority_queue<T, Container, queue_val_comp<T>> Priority_queue;
 		public:
 			typedef T value_type;
+			typedef Container container_type;
 			
 			//limit = 0 for unlimited size
 			explicit bounded_priority_queue(size_t size_limit = 0) : Priority_queue(), lim(size_limit) {}
+			//Stores the queue in an empty container that carries an allocator
+			bounded_priority_queue(size_t size_limit, Container &&storage) : Priority_queue(std::move(storage)), lim(size_limit) {}
 			using Priority_queue::top;
 			using Priority_queue::pop;
 			
-			bool full() { return Priority_queue::size() == lim; }
+			bool full() const { return lim > 0 && Priority_queue::size() == lim; }
 
 			void push(const value_type &val)
 			{
 				if (lim > 0 && this->size() == lim)
-					Priority_queue::replace(val);
+				{
+					if (this->c(val, top()))
+						Priority_queue::replace(val);
+				}
 				else
 					Priority_queue::push(val);
 			}
@@ -182,14 +209,15 @@ namespace BK_KD_tree
 		static_assert(PredTypes::dimension > 0 && (PredTypes::dimension == 1 || PredTypes::dimension == Dim), "Invalid template arguments");
 
 		typedef size_t								size_type;
-		typedef Mapped								mapped_type;
+		//Cold<T> stores a mapped value of type T apart from its node
+		typedef typename detail::mapped_storage<Mapped>::mapped_type	mapped_type;
 		//Resolve the key type to either Point or Tuple
 		typedef typename std::conditional<
 								sizeof...(DimTypes) == 1 || detail::are_same<DimTypes...>::value,
 								Point<Dim, typename detail::grab_first_type<DimTypes...>::type>,
 								BK_Tuple::Tuple<DimTypes...>
 									>::type			key_type;
-		typedef std::pair<key_type, mapped_type>	value_type;
+		typedef std::pair<key_type, typename detail::mapped_storage<Mapped>::stored_type>	value_type;
 
 		//Resolve the multidimensional key comparison predicate
 		typedef typename detail::get_key_type<key_type, PredTypes, DimTypes...>::type key_compare;
@@ -197,9 +225,9 @@ namespace BK_KD_tree
 		//Extract key_type from value_type
 		static const key_type& val_to_key(const value_type &val) { return val.first; }
 		//Extract mapped_type from const value_type
-		static const mapped_type& val_to_mapped(const value_type &val) { return val.second; }
+		static const mapped_type& val_to_mapped(const value_type &val) { return detail::mapped_storage<Mapped>::get(val.second); }
 		//Extract mapped_type from value_type
-		static mapped_type& val_to_mapped(value_type &val) { return val.second; }
+		static mapped_type& val_to_mapped(value_type &val) { return detail::mapped_storage<Mapped>::get(val.second); }
 
 		//Multi-key allowed/disallowed flag
 		static constexpr bool Multi = Mfl;
@@ -213,10 +241,25 @@ namespace BK_KD_tree
 	class DistanceCalculatorBase
 	{
 	public:
-		double get_cartesian_distance(const T &key1, const U &key2) const = 0;
-		double get_distance_to_plane(const T &key1, const T &key2) const = 0;
+		virtual ~DistanceCalculatorBase() = default;
+		virtual double get_cartesian_distance(const T &key1, const U &key2) const = 0;
+		virtual double get_distance_to_plane(const T &key1, const T &key2) const = 0;
 	};
 
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Concurrent_KD_tree;
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Mapped_KD_tree;
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	class Quantized_KD_tree;
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Sharded_KD_tree;
+
 //---------------------------------------------------------------------------------------------
 
 	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
@@ -224,6 +267,7 @@ namespace BK_KD_tree
 	{
 	private:
 		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+		typedef KD_tree_base<tree_traits> base_type;
 	public:
 		typedef typename tree_traits::mapped_type				mapped_type;
 		typedef typename tree_traits::key_type					key_type;
@@ -232,12 +276,22 @@ namespace BK_KD_tree
 		typedef typename tree_traits::key_compare				key_compare;
 		typedef typename std::pair<double, const mapped_type*>	KNN_type;
 		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
 		static constexpr bool Multi = tree_traits::Multi;
 
+		//The result of all_KNN_search: row i holds the k nearest neighbours of queries[i] in neighbors[i * k, (i + 1) * k), nearest first.
+		//Rows are padded with (infinity, nullptr) when fewer than k neighbours exist.
+		struct all_KNN_type
+		{
+			size_t k;
+			range_container_type queries;
+			KNN_container_type neighbors;
+		};
+
 		KD_tree() = default;
 		KD_tree(const KD_tree &tree) = default;
 		KD_tree(KD_tree &&tree) = default;
-		KD_tree(const key_compare &compare) : KD_tree_base(compare) {}
+		KD_tree(const key_compare &compare) : base_type(compare) {}
 		template<typename InputIterator, typename... Preds>
 		KD_tree(InputIterator begin, InputIterator end, Preds&&... predicates);
 
@@ -249,39 +303,116 @@ namespace BK_KD_tree
 		value_type& insert(const mapped_type &mapped, Coords&&... coordinates);
 		template<typename... Coords>
 		value_type& insert(mapped_type &&mapped, Coords&&... coordinates);
-		template<typename... Coords>
+		template<typename... Coords, typename T = typename std::enable_if<!detail::starts_with_allocator_arg<Coords...>::value, void>::type>
 		size_t erase(Coords&&... coordinates);
+		//Erases a key, allocating the temporary array of the rebuilt subtree from alloc
+		template<typename Allocator>
+		size_t erase(std::allocator_arg_t, const Allocator &alloc, const key_type &key) { return base_type::erase(std::allocator_arg, alloc, key); }
 
 		mapped_type& operator[](const key_type &key);
 		const mapped_type& operator[](const key_type &key) const;
 		mapped_type& at(const key_type &key);
 		const mapped_type& at(const key_type &key) const;
 		bool contains(const key_type &key) const;
+		//Tests every key of a range of queries; element i of the result belongs to query i
+		template<typename InputIterator>
+		std::vector<bool> contains_batch(InputIterator first, InputIterator last) const;
+		template<typename InputIterator>
+		std::vector<bool> contains_batch(const Interleaved &strategy, InputIterator first, InputIterator last) const;
 
 		template<typename Distance_op>
-		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const;
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		//Select the best first strategy for one search
+		template<typename Distance_op>
+		KNN_container_type KNN_search(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key) const { return KNN_search_if(strategy, k, distance, key, detail::accept_all()); }
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(strategy, k, distance, key, detail::accept_all(), stats); }
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(strategy, k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		//Returns an iterator over the values in order of their distance from key, nearest first, which yields (distance, mapped pointer)
+		//pairs like KNN_search and does only the work needed for each further value. A default constructed iterator marks the end.
+		template<typename Distance_op>
+		Nearest_iterator<tree_traits, const KD_tree_node<tree_traits>*, Distance_op> nearest_iterator(const key_type &key, Distance_op distance) const
+		{ return Nearest_iterator<tree_traits, const KD_tree_node<tree_traits>*, Distance_op>(this->m_root, this->m_comp, distance, key); }
+		//Finds the k nearest values to every key of a range of queries; row i of the result belongs to query i.
+		//The queries are searched in the order of a Hilbert curve through them, so that consecutive searches visit the same nodes.
+		template<typename Distance_op, typename InputIterator>
+		std::vector<KNN_container_type> KNN_search_batch(size_t k, Distance_op distance, InputIterator first, InputIterator last) const;
+		//Select the interleaved strategy for a batch, which hides the cache misses of trees too large for the cache
+		template<typename Distance_op, typename InputIterator>
+		std::vector<KNN_container_type> KNN_search_batch(const Interleaved &strategy, size_t k, Distance_op distance, InputIterator first, InputIterator last) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+		//Finds every value whose distance from key is at most radius, as (distance, mapped pointer) pairs in no particular order
+		template<typename Distance_op>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key) const { No_stats stats; return radius_search(radius, distance, key, stats); }
+		template<typename Distance_op, typename Stats>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const;
+		//The result and every temporary of these searches are allocated from alloc, e.g. a std::pmr::polymorphic_allocator over a per-request
+		//arena; any allocator is rebound to the element type of the result
+		template<typename Allocator, typename Distance_op>
+		detail::allocated_vector<KNN_type, Allocator> KNN_search(std::allocator_arg_t, const Allocator &alloc, size_t k, Distance_op distance, const key_type &key) const
+		{ return KNN_search_if(std::allocator_arg, alloc, k, distance, key, detail::accept_all()); }
+		template<typename Allocator, typename Distance_op, typename Predicate>
+		detail::allocated_vector<KNN_type, Allocator> KNN_search_if(std::allocator_arg_t, const Allocator &alloc, size_t k, Distance_op distance, const key_type &key, Predicate pred) const;
+		template<typename Allocator, typename Distance_op>
+		detail::allocated_vector<KNN_type, Allocator> KNN_search(std::allocator_arg_t, const Allocator &alloc, const Best_first &strategy, size_t k, Distance_op distance, const key_type &key) const;
+		template<typename Allocator>
+		detail::allocated_vector<const value_type*, Allocator> range_search(std::allocator_arg_t, const Allocator &alloc, const key_type &lower, const key_type &upper) const;
+
+		//Calls sink(a, b, distance) once for every unordered pair of values whose keys are at most epsilon apart
+		template<typename Distance_op, typename Sink>
+		void self_join(double epsilon, Distance_op distance, Sink sink) const;
+		//Splits the join among threads (0 for one per hardware thread); sink is called concurrently
+		template<typename Distance_op, typename Sink>
+		void self_join(double epsilon, Distance_op distance, Sink sink, size_t threads) const;
+		//Finds the k nearest values of this tree to every value of queries; a tree that queries itself is searched with a dual tree traversal
+		template<typename Distance_op>
+		all_KNN_type all_KNN_search(size_t k, Distance_op distance, const KD_tree &queries) const;
+		//Finds the k nearest other values of this tree to each of its values with a dual tree traversal
+		template<typename Distance_op>
+		all_KNN_type all_KNN_search(size_t k, Distance_op distance) const;
 
 	private:
+		friend class Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>;
+		friend class Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>;
+		template<size_t, typename, typename, typename, bool, typename>
+		friend class Quantized_KD_tree;
+		friend class Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>;
+
 		typedef KD_tree_node<tree_traits> node_type;
 		typedef node_type* node_pointer;
 		typedef const node_type* const_node_pointer;
 		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
-
-		template<size_t index, typename Distance_op>
-		void KNN_search_op(const_node_pointer current, Distance_op &distance, const key_type &key, queue_type &q) const;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+		typedef detail::KD_tree_batch_search<tree_traits, const_node_pointer> batch_search_type;
+		typedef detail::KD_tree_join<tree_traits, const_node_pointer> join_type;
+		typedef detail::KD_tree_all_KNN<tree_traits, const_node_pointer> all_KNN_join_type;
+		typedef typename all_KNN_join_type::flat_type flat_type;
+
+		//Returns the indices of a batch of queries in the order of a Hilbert curve through them
+		static std::vector<size_t> batch_order(const std::vector<key_type> &queries);
 	};
 
 //---------------------------------------------------------------------------------------------
 
 	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
 	template<typename InputIterator, typename ...Preds>
-	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KD_tree(InputIterator begin, InputIterator end, Preds&&... predicates) : KD_tree_base(predicates...)
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KD_tree(InputIterator begin, InputIterator end, Preds&&... predicates) : base_type(predicates...)
 	{
-		while (begin != end)
-		{
-			KD_tree_base::insert(*begin);
-			++begin;
-		}
+		//an empty tree is bulk built from the whole range
+		base_type::insert_batch(begin, end);
 	}
 
 //---------------------------------------------------------------------------------------------
@@ -291,7 +422,7 @@ namespace BK_KD_tree
 	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::value_type& 
 	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(const mapped_type &mapped, Coords&&... coordinates)
 	{
-		return KD_tree_base::insert(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped });
+		return base_type::insert(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped });
 	}
 
 //---------------------------------------------------------------------------------------------
@@ -301,7 +432,7 @@ namespace BK_KD_tree
 	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::value_type&
 	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(mapped_type &&mapped, Coords&&... coordinates)
 	{
-		return KD_tree_base::insert(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) });
+		return base_type::insert(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) });
 	}
 
 //---------------------------------------------------------------------------------------------
@@ -312,11 +443,11 @@ namespace BK_KD_tree
 	{
 		try //check if a value with the given key exists
 		{
-			return tree_traits::val_to_mapped(KD_tree_base::find(key));
+			return tree_traits::val_to_mapped(base_type::find(key));
 		}
 		catch (...) //if not, insert a new value
 		{
-			return tree_traits::val_to_mapped(KD_tree_base::insert(value_type{key, mapped_type()}));
+			return tree_traits::val_to_mapped(base_type::insert(value_type{key, mapped_type()}));
 		}
 	}
 
@@ -336,7 +467,7 @@ namespace BK_KD_tree
 	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type& 
 	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key)
 	{
-		return tree_traits::val_to_mapped(KD_tree_base::find(key));
+		return tree_traits::val_to_mapped(base_type::find(key));
 	}
 
 //---------------------------------------------------------------------------------------------
@@ -345,7 +476,7 @@ namespace BK_KD_tree
 	const typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
 	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
 	{
-		return tree_traits::val_to_mapped(KD_tree_base::find(key));
+		return tree_traits::val_to_mapped(base_type::find(key));
 	}
 
 //---------------------------------------------------------------------------------------------
@@ -356,7 +487,7 @@ namespace BK_KD_tree
 	{
 		try
 		{
-			KD_tree_base::find(key);
+			base_type::find(key);
 			return true;
 		}
 		catch (...)
@@ -368,58 +499,256 @@ namespace BK_KD_tree
 //---------------------------------------------------------------------------------------------
 
 	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
-	template<typename... Coords>
+	template<typename... Coords, typename T>
 	inline size_t KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase(Coords&&... coordinates)
 	{
-		return KD_tree_base::erase(key_type{std::forward<Coords>(coordinates)...});
+		return base_type::erase(key_type{std::forward<Coords>(coordinates)...});
 	}
 
 //---------------------------------------------------------------------------------------------
 
 	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
-	template<typename Distance_op>
-	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type 
-	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search(size_t k, Distance_op distance, const key_type &key) const
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		auto scan = this->scan_op(this->scan_limit());
+		if (scan != nullptr)
+			search_type::KNN_scan_op(scan->keys.data(), scan->nodes.data(), scan->keys.size(), distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		else
+			search_type::template KNN_search_op<0>(const_node_pointer(this->m_root), this->m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
 	{
 		queue_type q(k);
-		KNN_search_op<0>(this->m_root, distance, key, q);
+		search_type::KNN_best_first_op(const_node_pointer(this->m_root), this->m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats, strategy);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		auto scan = this->scan_op(this->range_scan_limit());
+		if (scan != nullptr)
+			search_type::range_scan_op(scan->keys.data(), scan->nodes.data(), scan->keys.size(), this->m_comp, lower, upper, result, detail::accept_all(), stats);
+		else
+			search_type::template range_search_op<0>(const_node_pointer(this->m_root), this->m_comp, lower, upper, result, detail::accept_all(), stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const
+	{
+		KNN_container_type result;
+		search_type::template radius_search_op<0>(const_node_pointer(this->m_root), this->m_comp, distance, key, radius, result, detail::accept_all(), stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Allocator, typename Distance_op, typename Predicate>
+	detail::allocated_vector<typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_type, Allocator>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(std::allocator_arg_t, const Allocator &alloc, size_t k, Distance_op distance, const key_type &key, Predicate pred) const
+	{
+		typedef detail::allocated_vector<KNN_type, Allocator> container_type;
+		detail::bounded_priority_queue<KNN_type, container_type> q(k, container_type(typename container_type::allocator_type(alloc)));
+		No_stats stats;
+		auto scan = this->scan_op(this->scan_limit());
+		if (scan != nullptr)
+			search_type::KNN_scan_op(scan->keys.data(), scan->nodes.data(), scan->keys.size(), distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		else
+			search_type::template KNN_search_op<0>(const_node_pointer(this->m_root), this->m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Allocator, typename Distance_op>
+	detail::allocated_vector<typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_type, Allocator>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search(std::allocator_arg_t, const Allocator &alloc, const Best_first &strategy, size_t k, Distance_op distance, const key_type &key) const
+	{
+		//the frontier of the search is allocated like the queue
+		typedef detail::allocated_vector<KNN_type, Allocator> container_type;
+		detail::bounded_priority_queue<KNN_type, container_type> q(k, container_type(typename container_type::allocator_type(alloc)));
+		No_stats stats;
+		search_type::KNN_best_first_op(const_node_pointer(this->m_root), this->m_comp, distance, key, q, detail::accept_all(), stats, strategy);
 		return std::move(q.data());
 	}
 
 //---------------------------------------------------------------------------------------------
 
 	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
-	template<size_t index, typename Distance_op>
-	void 
-	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_op(const_node_pointer current, Distance_op &distance, const key_type &key, queue_type &q) const
+	template<typename Allocator>
+	detail::allocated_vector<const typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::value_type*, Allocator>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(std::allocator_arg_t, const Allocator &alloc, const key_type &lower, const key_type &upper) const
 	{
-		//if a null node has been reached
-		if (current == nullptr)
-			return;
-
-		//compute the distance from the current point to the test point (key)
-		auto radius = distance.get_cartesian_distance(tree_traits::val_to_key(current->value()), key);
-		//push the result to the bounded priority queue
-		q.push(KNN_type{ radius, &tree_traits::val_to_mapped(current->value()) });
-
-		//recursively traverse the tree in the direction of the test point
-		if (this->m_comp.compare<index>(key, tree_traits::val_to_key(current->value())))
-			KNN_search_op<next_dim<index>()>(current->left_child(), distance, key, q);
+		typedef detail::allocated_vector<const value_type*, Allocator> container_type;
+		container_type result{ typename container_type::allocator_type(alloc) };
+		No_stats stats;
+		auto scan = this->scan_op(this->range_scan_limit());
+		if (scan != nullptr)
+			search_type::range_scan_op(scan->keys.data(), scan->nodes.data(), scan->keys.size(), this->m_comp, lower, upper, result, detail::accept_all(), stats);
 		else
-			KNN_search_op<next_dim<index>()>(current->right_child(), distance, key, q);
+			search_type::template range_search_op<0>(const_node_pointer(this->m_root), this->m_comp, lower, upper, result, detail::accept_all(), stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Sink>
+	void
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::self_join(double epsilon, Distance_op distance, Sink sink) const
+	{
+		join_type(const_node_pointer(this->m_root), this->m_comp).run(epsilon, distance, sink);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Sink>
+	void
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::self_join(double epsilon, Distance_op distance, Sink sink, size_t threads) const
+	{
+		join_type(const_node_pointer(this->m_root), this->m_comp).run(epsilon, distance, sink, threads);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename InputIterator>
+	std::vector<typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_batch(size_t k, Distance_op distance, InputIterator first, InputIterator last) const
+	{
+		std::vector<key_type> queries(first, last);
+		std::vector<size_t> order = batch_order(queries);
+
+		std::vector<KNN_container_type> result(queries.size());
+		for (auto it = order.begin(), end_it = order.end(); it != end_it; ++it)
+			result[*it] = KNN_search(k, distance, queries[*it]);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename InputIterator>
+	std::vector<typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_batch(const Interleaved &strategy, size_t k, Distance_op distance, InputIterator first, InputIterator last) const
+	{
+		std::vector<key_type> queries(first, last);
+		std::vector<size_t> order = batch_order(queries);
+
+		std::vector<KNN_container_type> result(queries.size());
+		batch_search_type(const_node_pointer(this->m_root), this->m_comp, strategy).template KNN_search<queue_type>(k, distance, queries, order, result);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
 
-		//once a leaf has been reached, compute the distance to the test point
-		auto dist_to_plane = distance.get_distance_to_plane<index>(tree_traits::val_to_key(current->value()), key);
-		//if the distance is smaller than the current largest distance in the queue, or if the queue is not full
-		if (dist_to_plane < q.top().first || !q.full())
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	std::vector<bool>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::contains_batch(InputIterator first, InputIterator last) const
+	{
+		std::vector<key_type> queries(first, last);
+		std::vector<size_t> order = batch_order(queries);
+
+		std::vector<bool> result(queries.size());
+		for (auto it = order.begin(), end_it = order.end(); it != end_it; ++it)
+			result[*it] = search_type::template find_op<0>(const_node_pointer(this->m_root), this->m_comp, queries[*it]) != nullptr;
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	std::vector<bool>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::contains_batch(const Interleaved &strategy, InputIterator first, InputIterator last) const
+	{
+		std::vector<key_type> queries(first, last);
+		std::vector<size_t> order = batch_order(queries);
+
+		std::vector<const_node_pointer> found(queries.size(), nullptr);
+		batch_search_type(const_node_pointer(this->m_root), this->m_comp, strategy).find(queries, order, found);
+		std::vector<bool> result(found.size());
+		for (size_t i = 0; i < found.size(); ++i)
+			result[i] = found[i] != nullptr;
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	std::vector<size_t>
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::batch_order(const std::vector<key_type> &queries)
+	{
+		std::vector<size_t> order(queries.size());
+		std::iota(order.begin(), order.end(), size_t(0));
+		detail::curve_sort<key_type>(order.data(), order.data() + order.size(), [&queries](size_t i) -> const key_type& { return queries[i]; });
+		return order;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::all_KNN_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::all_KNN_search(size_t k, Distance_op distance, const KD_tree &queries) const
+	{
+		all_KNN_type result{ k, range_container_type(), KNN_container_type() };
+		flat_type view(const_node_pointer(queries.m_root), this->m_comp);
+		if (&queries == this)
+		{
+			all_KNN_join_type(view, k, true).run(distance, result.queries, result.neighbors);
+			return result;
+		}
+
+		//the queries are searched in the preorder of their tree, so that consecutive searches descend through the same nodes
+		result.queries.reserve(view.size());
+		result.neighbors.assign(view.size() * k, KNN_type(std::numeric_limits<double>::infinity(), nullptr));
+		for (size_t i = 0; i < view.size(); ++i)
 		{
-			//check the other side of the splitting hyperplane for points that are closer
-			//first need to find which side you are currently on
-			if (this->m_comp.compare<index>(key, tree_traits::val_to_key(current->value())))
-				KNN_search_op<next_dim<index>()>(current->right_child(), distance, key, q);
-			else
-				KNN_search_op<next_dim<index>()>(current->left_child(), distance, key, q);
+			result.queries.push_back(view[i].value);
+			KNN_container_type row = KNN_search(k, distance, view.key(i));
+			//KNN_search leaves its result in heap order
+			std::sort(row.begin(), row.end(), [](const KNN_type &lhs, const KNN_type &rhs) { return lhs.first < rhs.first; });
+			std::copy(row.begin(), row.end(), result.neighbors.begin() + i * k);
 		}
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op>
+	typename KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::all_KNN_type
+	KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::all_KNN_search(size_t k, Distance_op distance) const
+	{
+		all_KNN_type result{ k, range_container_type(), KNN_container_type() };
+		flat_type view(const_node_pointer(this->m_root), this->m_comp);
+		all_KNN_join_type(view, k, false).run(distance, result.queries, result.neighbors);
+		return result;
 	}
 
 	//template class KD_tree<3, std::string, Type_wrapper<std::greater<int>, std::greater<char>, std::less<double>>, Type_wrapper<int, char, double>, false>;
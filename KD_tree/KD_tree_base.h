@@ -1,10 +1,18 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <numeric>
 #include <utility>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 #include <type_traits>
+#include "KD_tree_curve.h"
 #include "KD_tree_node.h"
 #include "KD_tree_iterator.h"
+#include "KD_tree_stats.h"
 
 namespace BK_KD_tree
 {
@@ -37,10 +45,11 @@ namespace BK_KD_tree
 		typedef typename Traits::key_compare	key_compare;
 		static constexpr bool Multi = Traits::Multi;
 		static constexpr size_t Dim = Traits::Dimension;
+		typedef Tree_diagnostics<Dim>			diagnostics_type;
 
-		KD_tree_base() : m_root(nullptr), m_comp() {}
-		explicit KD_tree_base(const key_compare &compare) : m_root(nullptr), m_comp(compare) {}
-		KD_tree_base(const KD_tree_base &tree) : m_root(copy_tree_op(tree.m_root)), m_comp(tree.m_comp) {}
+		KD_tree_base() : m_root(nullptr), m_comp(), m_size(0), m_scan_limit(default_scan_limit()) {}
+		explicit KD_tree_base(const key_compare &compare) : m_root(nullptr), m_comp(compare), m_size(0), m_scan_limit(default_scan_limit()) {}
+		KD_tree_base(const KD_tree_base &tree) : m_root(copy_tree_op(tree.m_root)), m_comp(tree.m_comp), m_size(tree.m_size), m_scan_limit(tree.m_scan_limit) {}
 		KD_tree_base(KD_tree_base &&tree);
 
 		KD_tree_base& operator=(const KD_tree_base &tree);
@@ -51,19 +60,69 @@ namespace BK_KD_tree
 		value_type& insert(const value_type &value);
 		value_type& insert(value_type &&value);
 		size_t erase(const key_type &key);
+		//Erases a key, allocating the temporary array of the rebuilt subtree from alloc
+		template<typename Allocator>
+		size_t erase(std::allocator_arg_t, const Allocator &alloc, const key_type &key) { return unlinked_op(find_erase<0>(m_root, key, alloc)); }
+		//Inserts a range of values. Bit i of the result is set if value i inserted a new key and cleared if it overwrote one.
+		template<typename InputIterator>
+		std::vector<bool> insert_batch(InputIterator begin, InputIterator end);
+		//Erases a range of keys. Bit i of the result is set if key i was found and erased.
+		template<typename InputIterator>
+		std::vector<bool> erase_batch(InputIterator keys_begin, InputIterator keys_end);
+		//Moves the value with old_key to new_key and returns false if old_key is not found. The node keeps its place if new_key lies on the
+		//same side as old_key of every splitting plane above it and its own subtrees stay on their sides of new_key; otherwise it is detached
+		//and reinserted. A value that already has new_key is overwritten, like insert does.
+		bool update_key(const key_type &old_key, const key_type &new_key);
+		//Moves a range of (old key, new key) pairs as if every old key was erased first and every value was then inserted at its new key
+		//in input order. Bit i of the result is set if old key i was found; an old key that occurs more than once is only moved by its first pair.
+		template<typename InputIterator>
+		std::vector<bool> update_key_batch(InputIterator first, InputIterator last);
 
 		bool empty() const { return m_root == nullptr; }
-		size_t size() const { return size_op(m_root); }
+		size_t size() const { return m_size; }
 		static constexpr size_t dimension() { return Dim; }
-		void clear() { destroy_tree_op(m_root); }
+		void clear() { destroy_tree_op(m_root); m_size = 0; m_scan.reset(); }
+		//KNN_search scans a contiguous copy of the keys instead of traversing a tree of at most scan_limit() values, since a KNN search
+		//of a tree with too few values for its dimension prunes so little that it visits most nodes anyway. A range search prunes far
+		//better, so range_search only scans trees of at most range_scan_limit() values. The copy is made by the first search after a
+		//change and grows with inserts. A limit of 0 never scans.
+		size_t scan_limit() const { return m_scan_limit; }
+		size_t range_scan_limit() const { return Dim < sizeof(size_t) * 8 ? m_scan_limit >> Dim : 0; }
+		void set_scan_limit(size_t limit) { m_scan_limit = limit; }
+		//2^(3 Dim / 2), which is about where a KNN search of uniformly distributed values starts to beat a scan, but at most 4096, since
+		//the tree beats a scan of clustered values at any size and the copy of the keys grows with the tree
+		static constexpr size_t default_scan_limit() { return Dim < 8 ? size_t(1) << (3 * Dim / 2) : size_t(4096); }
+		//Measures the shape and memory footprint of the tree in a single iterative pass
+		diagnostics_type diagnostics() const;
+		//Relinks the nodes of the tree into a balanced tree without allocating nodes or copying values.
+		//The subtrees below the top of the tree are rebuilt by a number of threads (0 for one per hardware thread).
+		void rebalance(size_t threads = 1);
 
 	protected:
 		typedef KD_tree_node<Traits> node_type;
 		typedef node_type* node_pointer;
 		typedef const node_type* const_node_pointer;
 
+		//A contiguous copy of the keys of the tree and pointers to their nodes, which a linear scan streams through
+		struct scan_mirror
+		{
+			std::vector<key_type> keys;
+			std::vector<const_node_pointer> nodes;
+		};
+
 		node_pointer	m_root;
 		key_compare		m_comp;
+		size_t			m_size;
+		size_t			m_scan_limit;
+		//nullptr until a search needs it, and discarded by every change but an insert
+		mutable std::shared_ptr<scan_mirror> m_scan;
+
+		//Returns the mirror that a search should scan instead of the tree, or nullptr if the tree holds more than limit values
+		std::shared_ptr<const scan_mirror> scan_op(size_t limit) const;
+		//Counts a node that has been linked into the tree
+		void linked_op(const_node_pointer node);
+		//Counts nodes that have been unlinked and deleted, and returns their number
+		size_t unlinked_op(size_t count);
 
 		//Advances the dimension index
 		template<size_t N>
@@ -73,32 +132,98 @@ namespace BK_KD_tree
 		bool compare_keys(const key_type &lhs, const key_type &rhs) const { return _compare_keys<0>(lhs, rhs); }
 		template<size_t N>
 		bool _compare_keys(const key_type &lhs, const key_type &rhs) const;
-		template<>
-		bool _compare_keys<Dim>(const key_type &lhs, const key_type &rhs) const { return true; }
 
 		value_type& find(const key_type &key) { return find_op<0>(m_root, key)->value(); }
 		const value_type& find(const key_type &key) const { return find_op<0>(m_root, key)->value(); }
 
 		//Swaps two nodes
 		void swap_nodes(node_pointer &a, node_pointer &b);
-		//Recursively finds the size of the tree
-		size_t size_op(const node_pointer root) const;
 		//Returns a reference to the node with the given key or throws an exception
 		template<size_t N>
 		node_pointer& find_op(node_pointer &current, const key_type &key);
 		template<size_t N>
 		const_node_pointer find_op(const_node_pointer current, const key_type &key) const;
 		//Locates the given point and calls erase with the proper dimension index
-		template<size_t N>
-		size_t find_erase(node_pointer &curent, const key_type &key);
+		template<size_t N, typename Allocator>
+		size_t find_erase(node_pointer &curent, const key_type &key, const Allocator &alloc);
 		//Finds the insert location for a new node
 		template<size_t N>
 		node_pointer& insert_loc_op(node_pointer &current, const key_type &new_key);
 		//Erases a node by reconstructing the subtree
+		template<size_t N, typename Allocator>
+		size_t erase_op(node_pointer &current, const Allocator &alloc);
+		//Unlinks a node without rebuilding its subtree and returns it. The node is replaced by the node with the smallest key in dimension N
+		//of its right subtree, which is unlinked the same way; a node without a right subtree first moves its left subtree to the right.
+		template<size_t N>
+		node_pointer detach_op(node_pointer &current);
+		//Unlinks the node with the given key from a subtree that holds it
+		template<size_t N>
+		node_pointer detach_key_op(node_pointer &current, const key_type &key);
+		//Returns a node with the smallest key in dimension D of a nonempty subtree
+		template<size_t D, size_t N>
+		const_node_pointer min_op(const_node_pointer current) const;
+
+		//The outcome of moving a key
+		enum class update_outcome { not_found, moved, deferred };
+		//Finds old_key and moves its value to new_key, in place if the node may keep its position. Otherwise the node is detached and
+		//reinserted, or left alone with a deferred outcome if relink is false.
+		template<size_t N>
+		update_outcome update_key_op(node_pointer &current, const key_type &old_key, const key_type &new_key, bool in_place, bool relink);
+		//Links a detached node into the tree, or moves its value into the node that has its key and deletes it
+		void relink_op(node_pointer node);
+		//Tests whether every key of a subtree lies before split in dimension D, or if before is false, whether none does
+		template<size_t D, size_t N>
+		bool side_op(const_node_pointer current, const key_type &split, bool before) const;
+		//Converts a subtree to an array of detached nodes in preorder; the traversal allocates like the array
+		template<typename Container>
+		void to_arr_preorder(node_pointer &current, Container &arr);
+		//Moves the median in dimension N of a nonempty array of nodes to the returned position, with the smaller keys before it
+		template<size_t N>
+		node_pointer* split_op(node_pointer *begin, node_pointer *end) const;
+		//Links an array of detached nodes into a balanced subtree by splitting at the median and returns its root
 		template<size_t N>
-		size_t erase_op(node_pointer &current);
-		//Converts a subtree to an array of nodes in preorder
-		void to_arr_preorder(node_pointer &current, std::vector<node_pointer> &arr);
+		node_pointer build_op(node_pointer *begin, node_pointer *end);
+
+		//A range of detached nodes that a rebalance links into the subtree at root, splitting first in dimension dim
+		struct build_task
+		{
+			node_pointer *root;
+			node_pointer *begin;
+			node_pointer *end;
+			size_t dim;
+		};
+		//A rebalance of fewer nodes than this does not start any threads
+		static constexpr size_t rebalance_parallel_min = 65536;
+		//Links the top depth levels of a balanced subtree and records the ranges below them as tasks
+		template<size_t N>
+		void build_top_op(node_pointer &root, node_pointer *begin, node_pointer *end, size_t depth, std::vector<build_task> &tasks);
+		//Runs build_op for the dimension of a task, which is only known at run time
+		template<size_t... I>
+		void build_task_op(const build_task &task, std::index_sequence<I...>);
+		//Counts the nodes of a subtree, stopping as soon as the count exceeds limit
+		size_t count_op(const_node_pointer current, size_t limit) const;
+
+		//A batch element with a distinct key: the position of the last and of the first element with that key
+		struct batch_entry
+		{
+			size_t last;
+			size_t first;
+		};
+		//A batch that reaches a subtree with at least this many entries may rebuild the subtree instead of descending
+		static constexpr size_t batch_rebuild_min = 32;
+
+		//Orders keys lexicographically by dimension
+		template<size_t N = 0>
+		bool key_less(const key_type &lhs, const key_type &rhs) const;
+		//Groups the elements of a batch by key
+		template<typename T, typename KeyOf>
+		std::vector<batch_entry> make_batch(const std::vector<T> &items, KeyOf key_of) const;
+		//Partitions a batch of distinct keys down the tree and inserts them
+		template<size_t N>
+		void insert_batch_op(node_pointer &current, batch_entry *begin, batch_entry *end, std::vector<value_type> &values, std::vector<bool> &result);
+		//Partitions a batch of distinct keys down the tree and erases them
+		template<size_t N>
+		void erase_batch_op(node_pointer &current, batch_entry *begin, batch_entry *end, const std::vector<key_type> &keys, std::vector<bool> &result);
 		//Recursively copies a tree
 		node_pointer copy_tree_op(const const_node_pointer source_root);
 		//Recursively deallocates a tree
@@ -108,11 +233,13 @@ namespace BK_KD_tree
 	//---------------------------------------------------------------------------------------------
 
 	template<typename Traits>
-	KD_tree_base<Traits>::KD_tree_base(KD_tree_base &&tree) : m_root(nullptr), m_comp()
+	KD_tree_base<Traits>::KD_tree_base(KD_tree_base &&tree) : m_root(nullptr), m_comp(), m_size(0), m_scan_limit(tree.m_scan_limit)
 	{
 		using std::swap;
 		std::swap(m_root, tree.m_root);
 		swap(m_comp, tree.m_comp);
+		std::swap(m_size, tree.m_size);
+		std::swap(m_scan, tree.m_scan);
 	}
 
 	//---------------------------------------------------------------------------------------------
@@ -126,6 +253,8 @@ namespace BK_KD_tree
 			clear();
 			m_root = copy_tree_op(tree.m_root);
 			m_comp = tree.m_comp;
+			m_size = tree.m_size;
+			m_scan_limit = tree.m_scan_limit;
 		}
 
 		return *this;
@@ -141,7 +270,10 @@ namespace BK_KD_tree
 		{
 			using std::swap;
 			std::swap(m_root, tree.m_root);
-			m_comp = std::move(m_comp);
+			m_comp = std::move(tree.m_comp);
+			std::swap(m_size, tree.m_size);
+			std::swap(m_scan, tree.m_scan);
+			m_scan_limit = tree.m_scan_limit;
 		}
 
 		return *this;
@@ -176,11 +308,11 @@ namespace BK_KD_tree
 		static_assert(N < Dim, "Invalid arguments to compare_keys template parameter");
 
 		//if all dimensions of lhs compare equal to all dimensions of rhs
-		if (!m_comp.compare<N>(lhs, rhs) && !m_comp.compare<N>(rhs, lhs))
+		if (!m_comp.template compare<N>(lhs, rhs) && !m_comp.template compare<N>(rhs, lhs))
 		{
 			//if N is not the last dimension
 			if (N + 1 < Dim)
-				return _compare_keys<N + 1>(lhs, rhs);
+				return _compare_keys<next_dim<N>()>(lhs, rhs);
 			else //the end of the key has been reached and all dimensions compare equal
 				return true;
 		}
@@ -197,7 +329,7 @@ namespace BK_KD_tree
 	{
 		if (current == nullptr || compare_keys(Traits::val_to_key(current->value()), new_key)) //if the current node is null or its key compares equal to new_key
 			return current;
-		else if (m_comp.compare<N>(new_key, Traits::val_to_key(current->value())))
+		else if (m_comp.template compare<N>(new_key, Traits::val_to_key(current->value())))
 			return insert_loc_op<next_dim<N>()>(current->left_child(), new_key);
 		else
 			return insert_loc_op<next_dim<N>()>(current->right_child(), new_key);
@@ -212,7 +344,10 @@ namespace BK_KD_tree
 		node_pointer &insert_loc = insert_loc_op<0>(m_root, Traits::val_to_key(value));
 
 		if (insert_loc == nullptr) //If no equivalent key exists in the tree, insert a new leaf
+		{
 			insert_loc = new node_type(value_type(value));
+			linked_op(insert_loc);
+		}
 		else //If a key with the given coordinates already exists, replace the mapped value
 			insert_loc->value() = value;
 
@@ -228,7 +363,10 @@ namespace BK_KD_tree
 		node_pointer &insert_loc = insert_loc_op<0>(m_root, Traits::val_to_key(value));
 
 		if (insert_loc == nullptr) //If no equivalent key exists in the tree, insert a new leaf
+		{
 			insert_loc = new node_type(value_type(std::move(value)));
+			linked_op(insert_loc);
+		}
 		else //If a key with the given coordinates already exists, replace the mapped value
 			insert_loc->value() = std::move(value);
 
@@ -252,20 +390,19 @@ namespace BK_KD_tree
 	//---------------------------------------------------------------------------------------------
 
 	template<typename Traits>
-	template<size_t N>
+	template<size_t N, typename Allocator>
 	size_t 
-	KD_tree_base<Traits>::erase_op(node_pointer &current)
+	KD_tree_base<Traits>::erase_op(node_pointer &current, const Allocator &alloc)
 	{
 		//a temporary vector to store the nodes
-		std::vector<node_pointer> temp;
+		typedef std::vector<node_pointer, typename std::allocator_traits<Allocator>::template rebind_alloc<node_pointer>> array_type;
+		array_type temp{ typename array_type::allocator_type(alloc) };
 		//a variable to store the root of the reconstructed subtree
 		node_pointer subtree_root = nullptr;
 		
-		//convert to subtree to a vector of nodes
-		if (current->left_child() != nullptr)
-			to_arr_preorder(current->left_child(), temp);
-		else if (current->right_child() != nullptr)
-			to_arr_preorder(current->right_child(), temp);
+		//convert both subtrees to a vector of nodes
+		to_arr_preorder(current->left_child(), temp);
+		to_arr_preorder(current->right_child(), temp);
 
 		//reconstruct the subtree
 		for (auto it = temp.begin(), end_it = temp.end(); it != end_it; ++it)
@@ -289,7 +426,7 @@ namespace BK_KD_tree
 	{
 		if (current != nullptr && !compare_keys(Traits::val_to_key(current->value()), key))
 		{
-			if (m_comp.compare<N>(key, Traits::val_to_key(current->value())))
+			if (m_comp.template compare<N>(key, Traits::val_to_key(current->value())))
 				return find_op<next_dim<N>()>(current->left_child(), key);
 			else
 				return find_op<next_dim<N>()>(current->right_child(), key);
@@ -309,7 +446,7 @@ namespace BK_KD_tree
 	{
 		if (current != nullptr && !compare_keys(Traits::val_to_key(current->value()), key))
 		{
-			if (m_comp.compare<N>(key, Traits::val_to_key(current->value())))
+			if (m_comp.template compare<N>(key, Traits::val_to_key(current->value())))
 				return find_op<next_dim<N>()>(current->left_child(), key);
 			else
 				return find_op<next_dim<N>()>(current->right_child(), key);
@@ -323,35 +460,47 @@ namespace BK_KD_tree
 	//---------------------------------------------------------------------------------------------
 
 	template<typename Traits>
-	template<size_t N>
+	template<size_t N, typename Allocator>
 	size_t
-	KD_tree_base<Traits>::find_erase(node_pointer &current, const key_type &key)
+	KD_tree_base<Traits>::find_erase(node_pointer &current, const key_type &key, const Allocator &alloc)
 	{
 		if (current != nullptr && !compare_keys(Traits::val_to_key(current->value()), key))
 		{
-			if (m_comp.compare<N>(key, Traits::val_to_key(current->value())))
-				return find_erase<next_dim<N>()>(current->left_child(), key);
-			else if (m_comp.compare<N>(Traits::val_to_key(current->value()), key))
-				return find_erase<next_dim<N>()>(current->right_child(), key);
+			if (m_comp.template compare<N>(key, Traits::val_to_key(current->value())))
+				return find_erase<next_dim<N>()>(current->left_child(), key, alloc);
+			else
+				return find_erase<next_dim<N>()>(current->right_child(), key, alloc);
 		}
 		else if (current == nullptr)
 			return 0;
 		else
-			return erase_op<N>(current);
+			return erase_op<N>(current, alloc);
 	}
 
 	//---------------------------------------------------------------------------------------------
 
 	template<typename Traits>
+	template<typename Container>
 	void 
-	KD_tree_base<Traits>::to_arr_preorder(node_pointer &current, std::vector<node_pointer> &arr)
+	KD_tree_base<Traits>::to_arr_preorder(node_pointer &current, Container &arr)
 	{
+		//an explicit stack avoids overflowing the call stack on a degenerate tree
+		Container stack(arr.get_allocator());
 		if (current != nullptr)
+			stack.push_back(current);
+		current = nullptr;
+		while (!stack.empty())
 		{
-			arr.push_back(current);
-			to_arr_preorder(current->left_child(), arr);
-			to_arr_preorder(current->right_child(), arr);
-			current = nullptr;
+			node_pointer node = stack.back();
+			stack.pop_back();
+			arr.push_back(node);
+
+			if (node->right_child() != nullptr)
+				stack.push_back(node->right_child());
+			if (node->left_child() != nullptr)
+				stack.push_back(node->left_child());
+			node->left_child() = nullptr;
+			node->right_child() = nullptr;
 		}
 	}
 
@@ -361,23 +510,285 @@ namespace BK_KD_tree
 	size_t
 	KD_tree_base<Traits>::erase(const key_type &key)
 	{
-		return find_erase<0>(m_root, key);
+		return unlinked_op(find_erase<0>(m_root, key, std::allocator<node_pointer>()));
 	}
 
 	//---------------------------------------------------------------------------------------------
 
 	template<typename Traits>
-	size_t
-	KD_tree_base<Traits>::size_op(const node_pointer root) const
+	bool
+	KD_tree_base<Traits>::update_key(const key_type &old_key, const key_type &new_key)
 	{
-		if (root != nullptr)
+		m_scan.reset();
+		return update_key_op<0>(m_root, old_key, new_key, true, true) == update_outcome::moved;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	typename KD_tree_base<Traits>::update_outcome
+	KD_tree_base<Traits>::update_key_op(node_pointer &current, const key_type &old_key, const key_type &new_key, bool in_place, bool relink)
+	{
+		if (current == nullptr)
+			return update_outcome::not_found;
+
+		const key_type &current_key = Traits::val_to_key(current->value());
+		if (!compare_keys(current_key, old_key))
 		{
-			size_t left_res = size_op(root->left_child());
-			size_t right_res = size_op(root->right_child());
-			return 1 + left_res + right_res;
+			//the node can only keep its place if new_key takes the same branch as old_key at every node above it
+			bool go_left = m_comp.template compare<N>(old_key, current_key);
+			in_place = in_place && go_left == m_comp.template compare<N>(new_key, current_key);
+			return update_key_op<next_dim<N>()>(go_left ? current->left_child() : current->right_child(), old_key, new_key, in_place, relink);
+		}
+		if (compare_keys(old_key, new_key))
+			return update_outcome::moved;
+
+		//the node also splits its own subtrees, which must stay on their sides of new_key, and new_key must not be taken
+		in_place = in_place && insert_loc_op<0>(m_root, new_key) == nullptr
+			&& side_op<N, next_dim<N>()>(current->left_child(), new_key, true) && side_op<N, next_dim<N>()>(current->right_child(), new_key, false);
+		if (in_place)
+			current->value().first = new_key;
+		else if (relink)
+		{
+			node_pointer node = detach_op<N>(current);
+			node->value().first = new_key;
+			relink_op(node);
 		}
 		else
-			return 0;
+			return update_outcome::deferred;
+		return update_outcome::moved;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	void
+	KD_tree_base<Traits>::relink_op(node_pointer node)
+	{
+		node_pointer &insert_loc = insert_loc_op<0>(m_root, Traits::val_to_key(node->value()));
+		if (insert_loc == nullptr)
+			insert_loc = node;
+		else //a value with the same key is overwritten, as insert would overwrite it
+		{
+			insert_loc->value() = std::move(node->value());
+			delete node;
+			--m_size;
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	typename KD_tree_base<Traits>::node_pointer
+	KD_tree_base<Traits>::detach_op(node_pointer &current)
+	{
+		node_pointer node = current;
+		if (node->left_child() == nullptr && node->right_child() == nullptr)
+		{
+			current = nullptr;
+			return node;
+		}
+
+		//every key of the left subtree is smaller in dimension N than the smallest key of the right one, so the left subtree may move
+		//to the right; the keys equal to the replacement in dimension N stay to its right, as insert_loc_op expects
+		if (node->right_child() == nullptr)
+			std::swap(node->left_child(), node->right_child());
+		const key_type &min_key = Traits::val_to_key(min_op<N, next_dim<N>()>(node->right_child())->value());
+		node_pointer replacement = detach_key_op<next_dim<N>()>(node->right_child(), min_key);
+
+		replacement->left_child() = node->left_child();
+		replacement->right_child() = node->right_child();
+		node->left_child() = nullptr;
+		node->right_child() = nullptr;
+		current = replacement;
+		return node;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	typename KD_tree_base<Traits>::node_pointer
+	KD_tree_base<Traits>::detach_key_op(node_pointer &current, const key_type &key)
+	{
+		if (current == nullptr)
+			return nullptr;
+		else if (compare_keys(Traits::val_to_key(current->value()), key))
+			return detach_op<N>(current);
+		else if (m_comp.template compare<N>(key, Traits::val_to_key(current->value())))
+			return detach_key_op<next_dim<N>()>(current->left_child(), key);
+		else
+			return detach_key_op<next_dim<N>()>(current->right_child(), key);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t D, size_t N>
+	typename KD_tree_base<Traits>::const_node_pointer
+	KD_tree_base<Traits>::min_op(const_node_pointer current) const
+	{
+		const_node_pointer res = current;
+		//the right subtree of a node that splits dimension D holds no smaller key in dimension D
+		for (const_node_pointer child : { current->left_child(), N == D ? nullptr : current->right_child() })
+		{
+			if (child == nullptr)
+				continue;
+			const_node_pointer child_min = min_op<D, next_dim<N>()>(child);
+			if (m_comp.template compare<D>(Traits::val_to_key(child_min->value()), Traits::val_to_key(res->value())))
+				res = child_min;
+		}
+		return res;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t D, size_t N>
+	bool
+	KD_tree_base<Traits>::side_op(const_node_pointer current, const key_type &split, bool before) const
+	{
+		if (current == nullptr)
+			return true;
+		if (m_comp.template compare<D>(Traits::val_to_key(current->value()), split) != before)
+			return false;
+
+		//a node that splits dimension D bounds one of its subtrees by its own key, which has just been tested
+		bool test_left = N != D || !before, test_right = N != D || before;
+		return (!test_left || side_op<D, next_dim<N>()>(current->left_child(), split, before)) && (!test_right || side_op<D, next_dim<N>()>(current->right_child(), split, before));
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<typename InputIterator>
+	std::vector<bool>
+	KD_tree_base<Traits>::update_key_batch(InputIterator first, InputIterator last)
+	{
+		typedef std::pair<key_type, key_type> move_type;
+		std::vector<move_type> moves(first, last);
+		std::vector<bool> result(moves.size(), false);
+		m_scan.reset();
+
+		//only the first pair with an old key moves it
+		std::vector<bool> primary(moves.size(), false);
+		std::vector<batch_entry> entries = make_batch(moves, [](const move_type &move) -> const key_type& { return move.first; });
+		for (auto it = entries.begin(), end_it = entries.end(); it != end_it; ++it)
+			primary[it->first] = true;
+
+		//pairs that share a new key are left to insert_batch, which keeps the value of the last one
+		std::vector<bool> shared(moves.size(), false);
+		std::vector<size_t> order(moves.size());
+		std::iota(order.begin(), order.end(), size_t(0));
+		std::sort(order.begin(), order.end(), [this, &moves](size_t lhs, size_t rhs) { return key_less(moves[lhs].second, moves[rhs].second); });
+		for (size_t i = 0, j = 0; i < order.size(); i = j)
+		{
+			for (j = i + 1; j < order.size() && !key_less(moves[order[i]].second, moves[order[j]].second); ++j);
+			for (size_t k = i; j - i > 1 && k < j; ++k)
+				shared[order[k]] = true;
+		}
+
+		//the pairs are moved in the order of a Hilbert curve through their old keys, so that consecutive pairs visit the same nodes.
+		//a node moves in place unless it has to be relinked or new_key is still taken, possibly by a node that moves later.
+		std::vector<size_t> pending, deferred;
+		for (size_t i = 0; i < moves.size(); ++i)
+		{
+			if (primary[i])
+				(shared[i] ? deferred : pending).push_back(i);
+		}
+		detail::curve_sort<key_type>(pending.data(), pending.data() + pending.size(), [&moves](size_t i) -> const key_type& { return moves[i].first; });
+		for (auto it = pending.begin(), end_it = pending.end(); it != end_it; ++it)
+		{
+			update_outcome outcome = update_key_op<0>(m_root, moves[*it].first, moves[*it].second, true, false);
+			if (outcome == update_outcome::moved)
+				result[*it] = true;
+			else if (outcome == update_outcome::deferred)
+				deferred.push_back(*it);
+		}
+
+		//the remaining nodes are all detached before any is relinked, since a new key may be the old key of another pair,
+		//and are relinked in input order, so that the last of the pairs with a new key keeps its value
+		std::sort(deferred.begin(), deferred.end());
+		std::vector<node_pointer> detached;
+		for (auto it = deferred.begin(), end_it = deferred.end(); it != end_it; ++it)
+		{
+			node_pointer node = detach_key_op<0>(m_root, moves[*it].first);
+			if (node != nullptr)
+			{
+				result[*it] = true;
+				node->value().first = moves[*it].second;
+				detached.push_back(node);
+			}
+		}
+		for (auto it = detached.begin(), end_it = detached.end(); it != end_it; ++it)
+			relink_op(*it);
+		return result;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	std::shared_ptr<const typename KD_tree_base<Traits>::scan_mirror>
+	KD_tree_base<Traits>::scan_op(size_t limit) const
+	{
+		if (m_size > limit || m_size > m_scan_limit)
+			return nullptr;
+
+		//concurrent searches of an unchanged tree may each build a mirror, and the last one is kept
+		std::shared_ptr<scan_mirror> mirror = std::atomic_load(&m_scan);
+		if (mirror != nullptr)
+			return mirror;
+		mirror = std::make_shared<scan_mirror>();
+		mirror->keys.reserve(m_size);
+		mirror->nodes.reserve(m_size);
+		std::vector<const_node_pointer> stack;
+		if (m_root != nullptr)
+			stack.push_back(m_root);
+		while (!stack.empty())
+		{
+			const_node_pointer current = stack.back();
+			stack.pop_back();
+			mirror->keys.push_back(Traits::val_to_key(current->value()));
+			mirror->nodes.push_back(current);
+			if (current->right_child() != nullptr)
+				stack.push_back(current->right_child());
+			if (current->left_child() != nullptr)
+				stack.push_back(current->left_child());
+		}
+		std::atomic_store(&m_scan, mirror);
+		return mirror;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	void
+	KD_tree_base<Traits>::linked_op(const_node_pointer node)
+	{
+		//the mirror grows with the tree until the tree outgrows the scan limit
+		if (++m_size <= m_scan_limit && m_scan != nullptr)
+		{
+			m_scan->keys.push_back(Traits::val_to_key(node->value()));
+			m_scan->nodes.push_back(node);
+		}
+		else
+			m_scan.reset();
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	size_t
+	KD_tree_base<Traits>::unlinked_op(size_t count)
+	{
+		if (count > 0)
+		{
+			m_size -= count;
+			m_scan.reset();
+		}
+		return count;
 	}
 
 	//---------------------------------------------------------------------------------------------
@@ -398,4 +809,417 @@ namespace BK_KD_tree
 	}
 
 	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	typename KD_tree_base<Traits>::node_pointer*
+	KD_tree_base<Traits>::split_op(node_pointer *begin, node_pointer *end) const
+	{
+		auto less = [this](const_node_pointer lhs, const_node_pointer rhs)
+		{
+			return m_comp.template compare<N>(Traits::val_to_key(lhs->value()), Traits::val_to_key(rhs->value()));
+		};
+
+		//select the median in dimension N
+		node_pointer *median = begin + (end - begin) / 2;
+		std::nth_element(begin, median, end, less);
+		node_pointer root = *median;
+
+		//keys smaller than the median go to the left subtree and keys equal to it in dimension N go to the right, as insert_loc_op expects
+		node_pointer *split = std::partition(begin, end, [&less, root](const_node_pointer node) { return less(node, root); });
+		std::iter_swap(std::find(split, end, root), split);
+		return split;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	typename KD_tree_base<Traits>::node_pointer
+	KD_tree_base<Traits>::build_op(node_pointer *begin, node_pointer *end)
+	{
+		if (begin == end)
+			return nullptr;
+
+		node_pointer *split = split_op<N>(begin, end);
+		node_pointer root = *split;
+		root->left_child() = build_op<next_dim<N>()>(begin, split);
+		root->right_child() = build_op<next_dim<N>()>(split + 1, end);
+		return root;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	void
+	KD_tree_base<Traits>::build_top_op(node_pointer &root, node_pointer *begin, node_pointer *end, size_t depth, std::vector<build_task> &tasks)
+	{
+		if (begin == end)
+			root = nullptr;
+		else if (depth == 0)
+			tasks.push_back(build_task{ &root, begin, end, N });
+		else
+		{
+			node_pointer *split = split_op<N>(begin, end);
+			root = *split;
+			build_top_op<next_dim<N>()>(root->left_child(), begin, split, depth - 1, tasks);
+			build_top_op<next_dim<N>()>(root->right_child(), split + 1, end, depth - 1, tasks);
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t... I>
+	void
+	KD_tree_base<Traits>::build_task_op(const build_task &task, std::index_sequence<I...>)
+	{
+		typedef node_pointer(KD_tree_base::*build_type)(node_pointer*, node_pointer*);
+		static const build_type table[] = { &KD_tree_base::template build_op<I>... };
+		*task.root = (this->*table[task.dim])(task.begin, task.end);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	void
+	KD_tree_base<Traits>::rebalance(size_t threads)
+	{
+		std::vector<node_pointer> nodes;
+		to_arr_preorder(m_root, nodes);
+
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads <= 1 || nodes.size() < rebalance_parallel_min)
+		{
+			m_root = build_op<0>(nodes.data(), nodes.data() + nodes.size());
+			return;
+		}
+
+		//split the top of the tree into a few tasks per thread; each task records the dimension its subtree starts at
+		size_t depth = 0;
+		for (size_t count = 1; count < threads * 4; count *= 2)
+			++depth;
+		std::vector<build_task> tasks;
+		build_top_op<0>(m_root, nodes.data(), nodes.data() + nodes.size(), depth, tasks);
+
+		//the tasks are taken in order by whichever thread is free
+		std::atomic<size_t> next(0);
+		std::vector<std::exception_ptr> errors(threads);
+		std::vector<std::thread> workers;
+		for (size_t w = 0; w < threads; ++w)
+		{
+			workers.emplace_back([this, &tasks, &next, &errors, w]
+			{
+				try
+				{
+					for (size_t t = next++; t < tasks.size(); t = next++)
+						build_task_op(tasks[t], std::make_index_sequence<Dim>());
+				}
+				catch (...)
+				{
+					errors[w] = std::current_exception();
+					next = tasks.size();
+				}
+			});
+		}
+		for (auto &worker : workers)
+			worker.join();
+
+		for (auto &error : errors)
+		{
+			if (error)
+				std::rethrow_exception(error);
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	size_t
+	KD_tree_base<Traits>::count_op(const_node_pointer current, size_t limit) const
+	{
+		if (current == nullptr || limit == 0)
+			return current == nullptr ? 0 : 1;
+
+		size_t left_res = count_op(current->left_child(), limit - 1);
+		if (left_res >= limit)
+			return 1 + left_res;
+		return 1 + left_res + count_op(current->right_child(), limit - 1 - left_res);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	bool
+	KD_tree_base<Traits>::key_less(const key_type &lhs, const key_type &rhs) const
+	{
+		if (m_comp.template compare<N>(lhs, rhs))
+			return true;
+		else if (m_comp.template compare<N>(rhs, lhs))
+			return false;
+		else if (N + 1 < Dim)
+			return key_less<next_dim<N>()>(lhs, rhs);
+		else
+			return false;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<typename T, typename KeyOf>
+	std::vector<typename KD_tree_base<Traits>::batch_entry>
+	KD_tree_base<Traits>::make_batch(const std::vector<T> &items, KeyOf key_of) const
+	{
+		//a stable sort keeps the elements with equal keys in input order
+		std::vector<size_t> order(items.size());
+		std::iota(order.begin(), order.end(), size_t(0));
+		std::stable_sort(order.begin(), order.end(), [this, &items, &key_of](size_t lhs, size_t rhs)
+		{
+			return key_less(key_of(items[lhs]), key_of(items[rhs]));
+		});
+
+		std::vector<batch_entry> entries;
+		for (size_t i = 0, j = 0; i < order.size(); i = j)
+		{
+			for (j = i + 1; j < order.size() && !key_less(key_of(items[order[i]]), key_of(items[order[j]])); ++j);
+			entries.push_back(batch_entry{ order[j - 1], order[i] });
+		}
+
+		return entries;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<typename InputIterator>
+	std::vector<bool>
+	KD_tree_base<Traits>::insert_batch(InputIterator begin, InputIterator end)
+	{
+		std::vector<value_type> values(begin, end);
+		std::vector<bool> result(values.size(), false);
+		std::vector<batch_entry> entries = make_batch(values, [](const value_type &value) -> const key_type& { return Traits::val_to_key(value); });
+
+		//the first element with a key inserts it unless the key is found in the tree, the others overwrite it
+		for (auto it = entries.begin(), end_it = entries.end(); it != end_it; ++it)
+			result[it->first] = true;
+
+		insert_batch_op<0>(m_root, entries.data(), entries.data() + entries.size(), values, result);
+		m_size += std::count(result.begin(), result.end(), true);
+		m_scan.reset();
+		return result;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	void
+	KD_tree_base<Traits>::insert_batch_op(node_pointer &current, batch_entry *begin, batch_entry *end, std::vector<value_type> &values, std::vector<bool> &result)
+	{
+		if (begin == end)
+			return;
+
+		size_t count = static_cast<size_t>(end - begin);
+		//a batch that is at least as large as the subtree rebuilds it together with the subtree
+		if (current == nullptr || (count >= batch_rebuild_min && count_op(current, count) <= count))
+		{
+			std::vector<node_pointer> nodes;
+			to_arr_preorder(current, nodes);
+			auto key_less_op = [this](const_node_pointer lhs, const_node_pointer rhs)
+			{
+				return key_less(Traits::val_to_key(lhs->value()), Traits::val_to_key(rhs->value()));
+			};
+			std::sort(nodes.begin(), nodes.end(), key_less_op);
+			size_t existing = nodes.size();
+
+			//the new nodes are allocated along a space filling curve, so that nodes which are close in space tend to be close in memory
+			detail::curve_sort<key_type>(begin, end, [&values](const batch_entry &entry) -> const key_type& { return Traits::val_to_key(values[entry.last]); });
+			for (batch_entry *it = begin; it != end; ++it)
+			{
+				const key_type &key = Traits::val_to_key(values[it->last]);
+				auto loc = std::lower_bound(nodes.begin(), nodes.begin() + existing, key, [this](const_node_pointer node, const key_type &k)
+				{
+					return key_less(Traits::val_to_key(node->value()), k);
+				});
+				if (loc != nodes.begin() + existing && compare_keys(Traits::val_to_key((*loc)->value()), key))
+				{
+					(*loc)->value() = std::move(values[it->last]);
+					result[it->first] = false;
+				}
+				else
+					nodes.push_back(new node_type(std::move(values[it->last])));
+			}
+
+			current = build_op<N>(nodes.data(), nodes.data() + nodes.size());
+			return;
+		}
+
+		//a batch element with the key of the current node overwrites it
+		const key_type &current_key = Traits::val_to_key(current->value());
+		batch_entry *match = std::find_if(begin, end, [this, &values, &current_key](const batch_entry &entry)
+		{
+			return compare_keys(Traits::val_to_key(values[entry.last]), current_key);
+		});
+		if (match != end)
+		{
+			current->value() = std::move(values[match->last]);
+			result[match->first] = false;
+			std::iter_swap(match, --end);
+		}
+
+		//the remaining elements are split between the subtrees like insert_loc_op would split them
+		batch_entry *split = std::partition(begin, end, [this, &values, &current_key](const batch_entry &entry)
+		{
+			return m_comp.template compare<N>(Traits::val_to_key(values[entry.last]), current_key);
+		});
+		insert_batch_op<next_dim<N>()>(current->left_child(), begin, split, values, result);
+		insert_batch_op<next_dim<N>()>(current->right_child(), split, end, values, result);
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<typename InputIterator>
+	std::vector<bool>
+	KD_tree_base<Traits>::erase_batch(InputIterator keys_begin, InputIterator keys_end)
+	{
+		std::vector<key_type> keys(keys_begin, keys_end);
+		std::vector<bool> result(keys.size(), false);
+		std::vector<batch_entry> entries = make_batch(keys, [](const key_type &key) -> const key_type& { return key; });
+
+		erase_batch_op<0>(m_root, entries.data(), entries.data() + entries.size(), keys, result);
+		unlinked_op(std::count(result.begin(), result.end(), true));
+		return result;
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	template<size_t N>
+	void
+	KD_tree_base<Traits>::erase_batch_op(node_pointer &current, batch_entry *begin, batch_entry *end, const std::vector<key_type> &keys, std::vector<bool> &result)
+	{
+		if (begin == end || current == nullptr)
+			return;
+
+		size_t count = static_cast<size_t>(end - begin);
+		//a batch that is at least as large as the subtree filters the nodes of the subtree and rebuilds it
+		if (count >= batch_rebuild_min && count_op(current, count) <= count)
+		{
+			std::sort(begin, end, [this, &keys](const batch_entry &lhs, const batch_entry &rhs) { return key_less(keys[lhs.first], keys[rhs.first]); });
+
+			std::vector<node_pointer> nodes, kept;
+			to_arr_preorder(current, nodes);
+			for (auto it = nodes.begin(), end_it = nodes.end(); it != end_it; ++it)
+			{
+				const key_type &key = Traits::val_to_key((*it)->value());
+				batch_entry *loc = std::lower_bound(begin, end, key, [this, &keys](const batch_entry &entry, const key_type &k) { return key_less(keys[entry.first], k); });
+				if (loc != end && compare_keys(keys[loc->first], key))
+				{
+					result[loc->first] = true;
+					delete *it;
+				}
+				else
+					kept.push_back(*it);
+			}
+
+			current = build_op<N>(kept.data(), kept.data() + kept.size());
+			return;
+		}
+
+		const key_type &current_key = Traits::val_to_key(current->value());
+		batch_entry *match = std::find_if(begin, end, [this, &keys, &current_key](const batch_entry &entry)
+		{
+			return compare_keys(keys[entry.first], current_key);
+		});
+		bool erase_current = match != end;
+		if (erase_current)
+		{
+			result[match->first] = true;
+			std::iter_swap(match, --end);
+		}
+
+		batch_entry *split = std::partition(begin, end, [this, &keys, &current_key](const batch_entry &entry)
+		{
+			return m_comp.template compare<N>(keys[entry.first], current_key);
+		});
+		erase_batch_op<next_dim<N>()>(current->left_child(), begin, split, keys, result);
+		erase_batch_op<next_dim<N>()>(current->right_child(), split, end, keys, result);
+
+		//an erased node is replaced by a balanced rebuild of its remaining subtrees
+		if (erase_current)
+		{
+			std::vector<node_pointer> nodes;
+			to_arr_preorder(current->left_child(), nodes);
+			to_arr_preorder(current->right_child(), nodes);
+			delete current;
+			current = build_op<N>(nodes.data(), nodes.data() + nodes.size());
+		}
+	}
+
+	//---------------------------------------------------------------------------------------------
+
+	template<typename Traits>
+	typename KD_tree_base<Traits>::diagnostics_type
+	KD_tree_base<Traits>::diagnostics() const
+	{
+		diagnostics_type res;
+		size_t depth_sum = 0;
+
+		//an explicit stack avoids overflowing the call stack on a degenerate tree
+		std::vector<std::pair<const_node_pointer, size_t>> stack;
+		if (m_root != nullptr)
+			stack.emplace_back(m_root, 1);
+		while (!stack.empty())
+		{
+			const_node_pointer current = stack.back().first;
+			size_t depth = stack.back().second;
+			stack.pop_back();
+
+			++res.node_count;
+			depth_sum += depth;
+			if (depth > res.max_depth)
+			{
+				res.max_depth = depth;
+				res.depth_histogram.resize(depth, 0);
+			}
+			++res.depth_histogram[depth - 1];
+
+			if (current->left_child() != nullptr || current->right_child() != nullptr)
+				++res.splits[(depth - 1) % Dim];
+			if (current->left_child() != nullptr)
+				stack.emplace_back(current->left_child(), depth + 1);
+			if (current->right_child() != nullptr)
+				stack.emplace_back(current->right_child(), depth + 1);
+		}
+
+		res.node_bytes = res.node_count * sizeof(node_type);
+		res.key_bytes = res.node_count * sizeof(key_type);
+		res.mapped_bytes = res.node_count * sizeof(mapped_type);
+		res.scan_limit = scan_limit();
+		res.range_scan_limit = range_scan_limit();
+		if (std::shared_ptr<const scan_mirror> mirror = std::atomic_load(&m_scan))
+			res.scan_bytes = mirror->keys.capacity() * sizeof(key_type) + mirror->nodes.capacity() * sizeof(const_node_pointer);
+		if (res.node_count == 0)
+			return res;
+
+		//a perfectly balanced tree fills every level but the last
+		size_t balanced_depth = 0, balanced_sum = 0;
+		for (size_t remaining = res.node_count, level = size_t(1); remaining > 0; level *= 2)
+		{
+			size_t count = remaining < level ? remaining : level;
+			++balanced_depth;
+			balanced_sum += count * balanced_depth;
+			remaining -= count;
+		}
+
+		res.mean_depth = double(depth_sum) / double(res.node_count);
+		res.balance_factor = double(res.max_depth) / double(balanced_depth);
+		res.estimated_query_cost = res.mean_depth;
+		res.balanced_query_cost = double(balanced_sum) / double(res.node_count);
+		return res;
+	}
 }
\ No newline at end of file
@@ -0,0 +1,297 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "KD_tree_search.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+namespace BK_KD_tree
+{
+	//A batch search strategy that runs a number of searches (lanes) at a time on one thread and switches between them while the nodes
+	//they need next are loaded from memory. It pays off on trees too large for the cache; on smaller trees it is slower than
+	//running the searches one after the other.
+	struct Interleaved
+	{
+		explicit Interleaved(size_t lanes = 16) : lanes(lanes > 0 ? lanes : 1) {}
+		size_t lanes;
+	};
+
+	namespace detail
+	{
+		//Asks the processor to start loading the first and the last cache line of an object, if the compiler offers a prefetch instruction
+		template<typename T>
+		void prefetch(const T *object)
+		{
+			const char *first = reinterpret_cast<const char*>(object), *last = first + sizeof(T) - 1;
+#if defined(__GNUC__)
+			__builtin_prefetch(first);
+			__builtin_prefetch(last);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+			_mm_prefetch(first, _MM_HINT_T0);
+			_mm_prefetch(last, _MM_HINT_T0);
+#else
+			(void)first;
+			(void)last;
+#endif
+		}
+
+		//Runs a batch of searches as resumable state machines that take turns on one thread. Every step of a search visits one node and
+		//prefetches the node of its next step, and the other searches take their steps while that load is in flight, which hides the latency
+		//of the dependent loads of a single search. The steps are taken in rounds, one dimension per round, so that the dimension of a step
+		//is dispatched once per round rather than once per node.
+		//Every search visits the same nodes in the same order as the recursive search that it mirrors, so it returns the same result.
+		template<typename Traits, typename NodePointer>
+		class KD_tree_batch_search
+		{
+		public:
+			typedef typename Traits::key_type		key_type;
+			typedef typename Traits::key_compare	key_compare;
+			static constexpr size_t Dim = Traits::Dimension;
+
+			KD_tree_batch_search(NodePointer root, const key_compare &comp, const Interleaved &strategy) : m_root(root), m_comp(comp), m_lanes(strategy.lanes) {}
+
+			//Moves the k nearest values to queries[order[i]] into results[order[i]] for every i, like KNN_search_op
+			template<typename Queue, typename Distance_op>
+			void KNN_search(size_t k, Distance_op &distance, const std::vector<key_type> &queries, const std::vector<size_t> &order, std::vector<typename Queue::container_type> &results) const;
+			//Stores the node with the key queries[order[i]], or nullptr, in results[order[i]] for every i, like find_op
+			void find(const std::vector<key_type> &queries, const std::vector<size_t> &order, std::vector<NodePointer> &results) const;
+
+		private:
+			typedef KD_tree_search<Traits> search_type;
+
+			NodePointer			m_root;
+			const key_compare	&m_comp;
+			size_t				m_lanes;	//the number of searches in flight
+
+			template<size_t N>
+			static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+			template<typename Distance_op, typename Queue>
+			class KNN_visitor;
+			class find_visitor;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Queue>
+		class KD_tree_batch_search<Traits, NodePointer>::KNN_visitor
+		{
+		public:
+			KNN_visitor(NodePointer root, size_t lanes, size_t k, const key_compare &comp, Distance_op &distance, const std::vector<key_type> &queries, const std::vector<size_t> &order,
+				std::vector<typename Queue::container_type> &results)
+				: m_root(root), m_k(k), m_comp(comp), m_distance(distance), m_queries(queries), m_order(order), m_results(results), m_started(0), m_active(0), m_lanes(lanes) {}
+
+			bool active() const { return m_active > 0 || m_started < m_order.size(); }
+
+			//Takes a step of every search whose next node splits dimension N
+			template<size_t N>
+			void visit();
+
+		private:
+			typedef typename Queue::value_type::first_type bound_type;
+
+			//The far side of a visited node, which is searched after the near side unless the distance to the splitting plane prunes it
+			struct pending
+			{
+				NodePointer	node;
+				size_t		dim;
+				bound_type	bound;
+			};
+
+			//A search in flight
+			struct lane
+			{
+				size_t					query;
+				NodePointer				next = nullptr;	//the node of the next step, or nullptr if the lane is free
+				size_t					dim;
+				Queue					q;
+				std::vector<pending>	stack;
+			};
+
+			NodePointer										m_root;
+			size_t											m_k;
+			const key_compare								&m_comp;
+			Distance_op										&m_distance;
+			const std::vector<key_type>						&m_queries;
+			const std::vector<size_t>						&m_order;
+			std::vector<typename Queue::container_type>		&m_results;
+			size_t											m_started, m_active;
+			std::vector<lane>								m_lanes;
+
+			//Moves to the most recent pending subtree that is not pruned
+			static void resume(lane &current_lane);
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		class KD_tree_batch_search<Traits, NodePointer>::find_visitor
+		{
+		public:
+			find_visitor(NodePointer root, size_t lanes, const key_compare &comp, const std::vector<key_type> &queries, const std::vector<size_t> &order, std::vector<NodePointer> &results)
+				: m_root(root), m_comp(comp), m_queries(queries), m_order(order), m_results(results), m_started(0), m_active(0), m_next(lanes, nullptr), m_query(lanes) {}
+
+			bool active() const { return m_active > 0 || m_started < m_order.size(); }
+
+			//Takes a step of every search at a depth of dimension N. A search only starts at the root on a round of dimension 0,
+			//so every search in flight is at a depth of the same dimension.
+			template<size_t N>
+			void visit();
+
+		private:
+			NodePointer						m_root;
+			const key_compare				&m_comp;
+			const std::vector<key_type>		&m_queries;
+			const std::vector<size_t>		&m_order;
+			std::vector<NodePointer>		&m_results;
+			size_t							m_started, m_active;
+			std::vector<NodePointer>		m_next;	//the node of the next step of every search, or nullptr if the lane is free
+			std::vector<size_t>				m_query;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Queue, typename Distance_op>
+		void
+		KD_tree_batch_search<Traits, NodePointer>::KNN_search(size_t k, Distance_op &distance, const std::vector<key_type> &queries, const std::vector<size_t> &order,
+			std::vector<typename Queue::container_type> &results) const
+		{
+			if (m_root == nullptr)
+				return;
+
+			KNN_visitor<Distance_op, Queue> visitor(m_root, m_lanes, k, m_comp, distance, queries, order, results);
+			for (size_t dim = 0; visitor.active(); dim = (dim + 1) % Dim)
+				search_type::dispatch_dim(dim, visitor);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Queue>
+		template<size_t N>
+		void
+		KD_tree_batch_search<Traits, NodePointer>::KNN_visitor<Distance_op, Queue>::visit()
+		{
+			for (auto current_lane = m_lanes.begin(), end_it = m_lanes.end(); current_lane != end_it; ++current_lane)
+			{
+				//a free lane starts the next query at the root, which waits for a round of dimension 0
+				if (current_lane->next == nullptr)
+				{
+					if (m_started == m_order.size())
+						continue;
+					current_lane->query = m_order[m_started++];
+					current_lane->next = m_root;
+					current_lane->dim = 0;
+					current_lane->q = Queue(m_k);
+					current_lane->stack.clear();
+					++m_active;
+				}
+				if (current_lane->dim != N)
+					continue;
+
+				NodePointer current = current_lane->next;
+				const key_type &key = m_queries[current_lane->query], &current_key = Traits::val_to_key(current->value());
+				current_lane->q.push(typename Queue::value_type{ m_distance.get_cartesian_distance(current_key, key), &Traits::val_to_mapped(current->value()) });
+
+				//the far side waits on the stack until the near side has been searched, as in the recursive search
+				bool go_left = m_comp.template compare<N>(key, current_key);
+				NodePointer near_child = go_left ? current->left_child() : current->right_child();
+				NodePointer far_child = go_left ? current->right_child() : current->left_child();
+				if (far_child != nullptr)
+					current_lane->stack.push_back(pending{ far_child, next_dim<N>(), m_distance.template get_distance_to_plane<N>(current_key, key) });
+
+				if (near_child != nullptr)
+				{
+					current_lane->next = near_child;
+					current_lane->dim = next_dim<N>();
+				}
+				else
+					resume(*current_lane);
+
+				if (current_lane->next != nullptr)
+					prefetch(&*current_lane->next);
+				else
+				{
+					m_results[current_lane->query] = std::move(current_lane->q.data());
+					--m_active;
+				}
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Queue>
+		void
+		KD_tree_batch_search<Traits, NodePointer>::KNN_visitor<Distance_op, Queue>::resume(lane &current_lane)
+		{
+			while (!current_lane.stack.empty())
+			{
+				pending next = current_lane.stack.back();
+				current_lane.stack.pop_back();
+				if (!current_lane.q.full() || next.bound < current_lane.q.top().first)
+				{
+					current_lane.next = next.node;
+					current_lane.dim = next.dim;
+					return;
+				}
+			}
+			current_lane.next = nullptr;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		void
+		KD_tree_batch_search<Traits, NodePointer>::find(const std::vector<key_type> &queries, const std::vector<size_t> &order, std::vector<NodePointer> &results) const
+		{
+			if (m_root == nullptr)
+				return;
+
+			find_visitor visitor(m_root, m_lanes, m_comp, queries, order, results);
+			for (size_t dim = 0; visitor.active(); dim = (dim + 1) % Dim)
+				search_type::dispatch_dim(dim, visitor);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<size_t N>
+		void
+		KD_tree_batch_search<Traits, NodePointer>::find_visitor::visit()
+		{
+			for (size_t i = 0, lanes = m_next.size(); i < lanes; ++i)
+			{
+				NodePointer current = m_next[i];
+				if (current == nullptr)
+				{
+					if (N != 0 || m_started == m_order.size())
+						continue;
+					m_query[i] = m_order[m_started++];
+					++m_active;
+					current = m_root;
+				}
+
+				const key_type &key = m_queries[m_query[i]], &current_key = Traits::val_to_key(current->value());
+				if (search_type::compare_keys(m_comp, current_key, key))
+				{
+					m_results[m_query[i]] = current;
+					current = nullptr;
+				}
+				else
+					current = m_comp.template compare<N>(key, current_key) ? current->left_child() : current->right_child();
+
+				m_next[i] = current;
+				if (current != nullptr)
+					prefetch(&*current);
+				else
+					--m_active;
+			}
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <utility>
+
+namespace BK_KD_tree
+{
+	//Selects cold storage for the mapped values of a tree, e.g. KD_tree<3, Cold<Vehicle>, ...>. Every mapped value is allocated apart from
+	//the nodes, which only hold the key and a pointer to it, so that a traversal only loads keys into the cache. The mapped_type of the
+	//tree is T, and the values that are returned by the searches are found through the pointers.
+	template<typename T>
+	struct Cold {};
+
+	namespace detail
+	{
+		//A mapped value in its own allocation, which is copied with the value and keeps its address when the node is moved
+		template<typename T>
+		class cold_value
+		{
+		public:
+			cold_value() : m_value(new T()) {}
+			cold_value(const T &value) : m_value(new T(value)) {}
+			cold_value(T &&value) : m_value(new T(std::move(value))) {}
+			cold_value(const cold_value &other) : m_value(other.m_value == nullptr ? nullptr : new T(*other.m_value)) {}
+			cold_value(cold_value &&other) noexcept : m_value(other.m_value) { other.m_value = nullptr; }
+			~cold_value() { delete m_value; }
+
+			cold_value& operator=(const cold_value &other)
+			{
+				//either side may be a moved from value, which has no allocation
+				if (this == &other)
+					return *this;
+				if (other.m_value == nullptr)
+				{
+					delete m_value;
+					m_value = nullptr;
+				}
+				else if (m_value == nullptr)
+					m_value = new T(*other.m_value);
+				else
+					*m_value = *other.m_value;
+				return *this;
+			}
+			cold_value& operator=(cold_value &&other) noexcept { std::swap(m_value, other.m_value); return *this; }
+
+			T& get() { return *m_value; }
+			const T& get() const { return *m_value; }
+			operator T&() { return *m_value; }
+			operator const T&() const { return *m_value; }
+
+		private:
+			T *m_value;
+		};
+
+		//Resolves the type that a node stores for a mapped type
+		template<typename Mapped>
+		struct mapped_storage
+		{
+			typedef Mapped mapped_type;
+			typedef Mapped stored_type;
+
+			static const mapped_type& get(const stored_type &stored) { return stored; }
+			static mapped_type& get(stored_type &stored) { return stored; }
+		};
+
+		template<typename T>
+		struct mapped_storage<Cold<T>>
+		{
+			typedef T mapped_type;
+			typedef cold_value<T> stored_type;
+
+			static const mapped_type& get(const stored_type &stored) { return stored.get(); }
+			static mapped_type& get(stored_type &stored) { return stored.get(); }
+		};
+	}
+}
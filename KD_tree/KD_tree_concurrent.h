@@ -0,0 +1,311 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A KD-Tree that any number of threads can insert into and search at the same time without locks. An insert descends like an insert
+	//into a KD_tree and links its new leaf with a compare and swap on the null link where the key belongs. If another thread linked a node
+	//there first, the insert continues below that node. Inserts into different parts of the tree touch different links, so writers only
+	//retry when they race for the same link. Nodes are never unlinked or moved, so searches read the tree without locks and every pointer
+	//in their results stays valid until the tree is cleared or destroyed.
+	//An insert of an existing key publishes the new value atomically (last writer wins), or keeps the old one with try_insert (first
+	//writer wins). A search sees either the old or the new value, never a mix. Since a reader may still hold a replaced value, replaced
+	//values are only freed with the tree. Values cannot be erased, and the tree is not rebalanced, so it should be built from a range
+	//of values that spreads the top levels over the space where the inserts will land.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Concurrent_KD_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
+		typedef KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_type;
+
+		explicit Concurrent_KD_tree(const key_compare &compare = key_compare()) : m_root(nullptr), m_comp(compare), m_size(0), m_replaced(nullptr) {}
+		//Copies the shape of a tree, so that a balanced tree gives the concurrent inserts a balanced top
+		explicit Concurrent_KD_tree(const tree_type &tree);
+		//Builds a balanced tree over a range of values
+		template<typename InputIterator>
+		Concurrent_KD_tree(InputIterator first, InputIterator last, const key_compare &compare = key_compare()) : Concurrent_KD_tree(bulk_build(first, last, compare)) {}
+
+		Concurrent_KD_tree(const Concurrent_KD_tree&) = delete;
+		Concurrent_KD_tree& operator=(const Concurrent_KD_tree&) = delete;
+		~Concurrent_KD_tree() { clear(); }
+
+		//Inserts a value or publishes it in place of the value of an existing key. Returns true if a new key was inserted.
+		bool insert(const value_type &value) { return insert_op(value_type(value), true); }
+		bool insert(value_type &&value) { return insert_op(std::move(value), true); }
+		template<typename... Coords>
+		bool insert(const mapped_type &mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped }, true); }
+		template<typename... Coords>
+		bool insert(mapped_type &&mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) }, true); }
+		//Inserts a value unless its key exists, in which case the existing value is kept. Returns true if a new key was inserted.
+		bool try_insert(const value_type &value) { return insert_op(value_type(value), false); }
+		bool try_insert(value_type &&value) { return insert_op(std::move(value), false); }
+		template<typename... Coords>
+		bool try_insert(const mapped_type &mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped }, false); }
+		template<typename... Coords>
+		bool try_insert(mapped_type &&mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) }, false); }
+
+		//Returns the value published last for the key; a later insert of the key does not change the returned value
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const { return search_type::template find_op<0>(root(), m_comp, key) != nullptr; }
+
+		bool empty() const { return size() == 0; }
+		size_t size() const { return m_size.load(std::memory_order_relaxed); }
+		static constexpr size_t dimension() { return Dim; }
+		//Not thread-safe: no other thread may use the tree during a clear
+		void clear();
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+		//Finds every value whose distance from key is at most radius, as (distance, mapped pointer) pairs in no particular order
+		template<typename Distance_op>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key) const { No_stats stats; return radius_search(radius, distance, key, stats); }
+		template<typename Distance_op, typename Stats>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const;
+
+	private:
+		typedef KD_tree_concurrent_node<tree_traits> node_type;
+		typedef node_type* node_pointer;
+		typedef const node_type* const_node_pointer;
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+
+		//A value published by an overwrite, kept in a list until the tree is cleared
+		struct replacement
+		{
+			value_type	value;
+			replacement	*next;
+		};
+
+		std::atomic<node_pointer>	m_root;
+		key_compare					m_comp;
+		std::atomic<size_t>			m_size;
+		std::atomic<replacement*>	m_replaced;
+
+		//Advances the dimension index
+		template<size_t N>
+		static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+		template<typename InputIterator>
+		static tree_type bulk_build(InputIterator first, InputIterator last, const key_compare &compare);
+
+		const_node_pointer root() const { return m_root.load(std::memory_order_acquire); }
+		bool insert_op(value_type &&value, bool overwrite);
+		//Links a new node for value below link and returns nullptr, or returns the node that already has its key. The node is allocated
+		//when the first null link is reached and moves value into itself; fresh holds it if it could not be linked.
+		template<size_t N>
+		node_pointer link_op(std::atomic<node_pointer> &link, value_type &value, node_pointer &fresh);
+		void overwrite_op(node_pointer node, value_type &&value);
+		//Recursively copies a subtree of a KD_tree
+		template<typename TreeNodePointer>
+		static node_pointer copy_op(TreeNodePointer source);
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::Concurrent_KD_tree(const tree_type &tree)
+		: m_root(copy_op(tree.m_root)), m_comp(tree.m_comp), m_size(tree.size()), m_replaced(nullptr)
+	{
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::tree_type
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::bulk_build(InputIterator first, InputIterator last, const key_compare &compare)
+	{
+		//an empty tree is bulk built from the whole batch
+		tree_type tree(compare);
+		tree.insert_batch(first, last);
+		return tree;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename TreeNodePointer>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::node_pointer
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::copy_op(TreeNodePointer source)
+	{
+		if (source == nullptr)
+			return nullptr;
+
+		//the tree is published to other threads by whatever hands it to them, so the links need no ordering of their own
+		node_pointer node = new node_type(source->value());
+		node->left_link().store(copy_op(source->left_child()), std::memory_order_relaxed);
+		node->right_link().store(copy_op(source->right_child()), std::memory_order_relaxed);
+		return node;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	const typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
+	{
+		const_node_pointer node = search_type::template find_op<0>(root(), m_comp, key);
+		if (node == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(node->value());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::clear()
+	{
+		//an explicit stack avoids overflowing the call stack on a degenerate tree
+		std::vector<node_pointer> stack;
+		if (m_root.load(std::memory_order_relaxed) != nullptr)
+			stack.push_back(m_root.load(std::memory_order_relaxed));
+		while (!stack.empty())
+		{
+			node_pointer current = stack.back();
+			stack.pop_back();
+			for (node_pointer child : { current->left_link().load(std::memory_order_relaxed), current->right_link().load(std::memory_order_relaxed) })
+			{
+				if (child != nullptr)
+					stack.push_back(child);
+			}
+			delete current;
+		}
+		m_root.store(nullptr, std::memory_order_relaxed);
+		m_size.store(0, std::memory_order_relaxed);
+
+		for (replacement *current = m_replaced.exchange(nullptr, std::memory_order_relaxed); current != nullptr;)
+		{
+			replacement *next = current->next;
+			delete current;
+			current = next;
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert_op(value_type &&value, bool overwrite)
+	{
+		node_pointer fresh = nullptr;
+		node_pointer existing = link_op<0>(m_root, value, fresh);
+		if (existing == nullptr)
+		{
+			m_size.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		//the value moved into a node that lost the race for its link to a node with the same key
+		if (fresh != nullptr)
+		{
+			if (overwrite)
+				overwrite_op(existing, value_type(fresh->value()));
+			delete fresh;
+		}
+		else if (overwrite)
+			overwrite_op(existing, std::move(value));
+		return false;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::node_pointer
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::link_op(std::atomic<node_pointer> &link, value_type &value, node_pointer &fresh)
+	{
+		node_pointer current = link.load(std::memory_order_acquire);
+		while (current == nullptr)
+		{
+			if (fresh == nullptr)
+				fresh = new node_type(std::move(value));
+			//the release half publishes the new node to the threads that load the link; a failed exchange loads the winning node
+			if (link.compare_exchange_weak(current, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+				return nullptr;
+		}
+
+		//the key has moved into fresh once it has been allocated
+		const key_type &key = tree_traits::val_to_key(fresh != nullptr ? fresh->value() : value);
+		const key_type &current_key = tree_traits::val_to_key(current->value());
+		if (search_type::compare_keys(m_comp, current_key, key))
+			return current;
+		else if (m_comp.template compare<N>(key, current_key))
+			return link_op<next_dim<N>()>(current->left_link(), value, fresh);
+		else
+			return link_op<next_dim<N>()>(current->right_link(), value, fresh);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::overwrite_op(node_pointer node, value_type &&value)
+	{
+		replacement *published = new replacement{ std::move(value), m_replaced.load(std::memory_order_relaxed) };
+		while (!m_replaced.compare_exchange_weak(published->next, published, std::memory_order_relaxed, std::memory_order_relaxed))
+			;
+		//the replaced value stays readable, since it is either stored in the node or kept in the list
+		node->publish(&published->value);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		search_type::template KNN_search_op<0>(root(), m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		search_type::template range_search_op<0>(root(), m_comp, lower, upper, result, detail::accept_all(), stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Stats>
+	typename Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Concurrent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const
+	{
+		KNN_container_type result;
+		search_type::template radius_search_op<0>(root(), m_comp, distance, key, radius, result, detail::accept_all(), stats);
+		return result;
+	}
+}
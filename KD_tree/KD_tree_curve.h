@@ -0,0 +1,246 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "KD_tree_point.h"
+#include "tuple.h"
+
+namespace BK_KD_tree
+{
+	//The space filling curves that a Curve_order can follow
+	enum class Curve { morton, hilbert };
+
+	namespace detail
+	{
+		template<bool... B>
+		struct bool_pack {};
+
+		//Checks if every coordinate of a key is arithmetic, which is required to map the key to a space filling curve
+		template<typename Key>
+		struct has_arithmetic_coordinates : std::false_type {};
+
+		template<size_t Dim, typename ElemType>
+		struct has_arithmetic_coordinates<Point<Dim, ElemType>> : std::is_arithmetic<ElemType> {};
+
+		template<typename... Args>
+		struct has_arithmetic_coordinates<BK_Tuple::Tuple<Args...>>
+			: std::is_same<bool_pack<true, std::is_arithmetic<Args>::value...>, bool_pack<std::is_arithmetic<Args>::value..., true>> {};
+
+		//Checks if a key can be mapped to a 64 bit curve code, which holds at most 64 dimensions
+		template<typename Key, bool = has_arithmetic_coordinates<Key>::value>
+		struct has_curve_order : std::false_type {};
+
+		template<typename Key>
+		struct has_curve_order<Key, true> : std::integral_constant<bool, (Key::dimension() <= 64)> {};
+
+		struct identity_key
+		{
+			template<typename Key>
+			const Key& operator()(const Key &key) const { return key; }
+		};
+
+		//Spreads the bits of a byte Dim - 1 bits apart
+		template<size_t Dim>
+		std::uint64_t spread_byte(std::uint32_t byte)
+		{
+			struct table_type
+			{
+				std::uint64_t entries[256];
+				table_type()
+				{
+					for (std::uint32_t i = 0; i < 256; ++i)
+					{
+						entries[i] = 0;
+						for (size_t bit = 0; bit < 8 && bit * Dim < 64; ++bit)
+							entries[i] |= std::uint64_t((i >> bit) & 1u) << (bit * Dim);
+					}
+				}
+			};
+			static const table_type table;
+			return table.entries[byte & 0xffu];
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	//The number of bits of every coordinate in a 64 bit curve code of Dim dimensions
+	template<size_t Dim>
+	constexpr size_t curve_bits() { return 64 / Dim > 32 ? 32 : 64 / Dim; }
+
+	//Interleaves the bits of the cell coordinates into a Morton (Z-order) code, with dimension 0 in the most significant bit of every group.
+	//Every coordinate must be smaller than 2^bits, and bits must not exceed curve_bits<Dim>().
+	template<size_t Dim>
+	std::uint64_t morton_code(const std::array<std::uint32_t, Dim> &cell, size_t bits = curve_bits<Dim>())
+	{
+		static_assert(Dim > 0 && Dim <= 64, "A curve code holds at most 64 dimensions");
+
+		//the bits of every coordinate are spread a byte at a time
+		std::uint64_t code = 0;
+		for (size_t i = 0; i < Dim; ++i)
+		{
+			std::uint64_t spread = 0;
+			for (size_t bit = 0; bit < bits; bit += 8)
+				spread |= detail::spread_byte<Dim>(cell[i] >> bit) << (bit * Dim);
+			code |= spread << (Dim - 1 - i);
+		}
+		return code;
+	}
+
+	//Returns the position of a cell along a Hilbert curve, which unlike the Morton order only steps between adjacent cells.
+	//Every coordinate must be smaller than 2^bits, and bits must not exceed curve_bits<Dim>().
+	//Uses the transposition algorithm of J. Skilling, "Programming the Hilbert curve" (2004).
+	template<size_t Dim>
+	std::uint64_t hilbert_code(std::array<std::uint32_t, Dim> cell, size_t bits = curve_bits<Dim>())
+	{
+		const std::uint32_t top = std::uint32_t(1) << (bits - 1);
+		//undo the excess work of the curve, from the coarsest bit down
+		for (std::uint32_t q = top; q > 1; q >>= 1)
+		{
+			std::uint32_t p = q - 1;
+			for (size_t i = 0; i < Dim; ++i)
+			{
+				//if bit q of cell[i] is set, the low bits of cell[0] are inverted, otherwise they are exchanged with those of cell[i].
+				//the branches are replaced by masks, since the bits of the coordinates are unpredictable.
+				std::uint32_t set = 0u - ((cell[i] & q) != 0 ? 1u : 0u);
+				std::uint32_t t = (cell[0] ^ cell[i]) & p & ~set;
+				cell[0] ^= (p & set) | t;
+				cell[i] ^= t;
+			}
+		}
+
+		//gray encode
+		for (size_t i = 1; i < Dim; ++i)
+			cell[i] ^= cell[i - 1];
+		std::uint32_t t = 0;
+		for (std::uint32_t q = top; q > 1; q >>= 1)
+			if (cell[Dim - 1] & q)
+				t ^= q - 1;
+		for (size_t i = 0; i < Dim; ++i)
+			cell[i] ^= t;
+
+		//the transposed code holds the bits of the position in the Morton order of its coordinates
+		return morton_code(cell, bits);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	//Maps keys to their positions along a space filling curve through a bounding box. Every coordinate is scaled to
+	//bits bits (curve_bits<Dim>() by default), so keys in the same cell share a position. Keys outside of the box are clamped to it.
+	//Fewer bits are cheaper to encode and still order the keys as well when there are far fewer keys than cells.
+	template<typename Key>
+	class Curve_order
+	{
+	public:
+		static constexpr size_t Dim = Key::dimension();
+		typedef std::array<double, Dim> coordinates_type;
+
+		static_assert(detail::has_arithmetic_coordinates<Key>::value, "Curve_order requires arithmetic coordinates");
+
+		Curve_order(const Key &min, const Key &max, Curve curve = Curve::hilbert, size_t bits = curve_bits<Dim>())
+			: Curve_order(coordinates(min, std::make_index_sequence<Dim>()), coordinates(max, std::make_index_sequence<Dim>()), curve, bits) {}
+		//Spans the bounding box of the keys of a nonempty range
+		template<typename InputIterator, typename KeyOf = detail::identity_key>
+		static Curve_order bounding(InputIterator first, InputIterator last, KeyOf key_of = KeyOf(), Curve curve = Curve::hilbert, size_t bits = curve_bits<Dim>());
+
+		std::uint64_t operator()(const Key &key) const;
+
+	private:
+		coordinates_type	m_min, m_scale;
+		Curve				m_curve;
+		size_t				m_bits;
+		double				m_top;	//the largest cell coordinate
+
+		Curve_order(const coordinates_type &min, const coordinates_type &max, Curve curve, size_t bits);
+
+		template<size_t... I>
+		static coordinates_type coordinates(const Key &key, std::index_sequence<I...>) { return coordinates_type{ { double(Key::template get<I>(key))... } }; }
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Key>
+	Curve_order<Key>::Curve_order(const coordinates_type &min, const coordinates_type &max, Curve curve, size_t bits)
+		: m_min(min), m_curve(curve), m_bits(bits), m_top(double((std::uint64_t(1) << bits) - 1))
+	{
+		for (size_t d = 0; d < Dim; ++d)
+			m_scale[d] = max[d] > min[d] ? m_top / (max[d] - min[d]) : 0.0;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Key>
+	template<typename InputIterator, typename KeyOf>
+	Curve_order<Key>
+	Curve_order<Key>::bounding(InputIterator first, InputIterator last, KeyOf key_of, Curve curve, size_t bits)
+	{
+		coordinates_type min, max;
+		min.fill(std::numeric_limits<double>::infinity());
+		max.fill(-std::numeric_limits<double>::infinity());
+		for (; first != last; ++first)
+		{
+			coordinates_type coords = coordinates(key_of(*first), std::make_index_sequence<Dim>());
+			for (size_t d = 0; d < Dim; ++d)
+			{
+				min[d] = std::min(min[d], coords[d]);
+				max[d] = std::max(max[d], coords[d]);
+			}
+		}
+		return Curve_order(min, max, curve, bits);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Key>
+	std::uint64_t
+	Curve_order<Key>::operator()(const Key &key) const
+	{
+		coordinates_type coords = coordinates(key, std::make_index_sequence<Dim>());
+		std::array<std::uint32_t, Dim> cell;
+		for (size_t d = 0; d < Dim; ++d)
+		{
+			//a NaN coordinate fails both tests and goes to cell 0
+			double x = (coords[d] - m_min[d]) * m_scale[d];
+			cell[d] = x > 0.0 ? static_cast<std::uint32_t>(x < m_top ? x : m_top) : 0;
+		}
+		return m_curve == Curve::hilbert ? hilbert_code(cell, m_bits) : morton_code(cell, m_bits);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	namespace detail
+	{
+		//Sorts an array along a Hilbert curve through the bounding box of its keys
+		template<typename Key, typename T, typename KeyOf>
+		typename std::enable_if<has_curve_order<Key>::value>::type
+		curve_sort(T *first, T *last, KeyOf key_of)
+		{
+			if (first == last)
+				return;
+
+			//about 16 cells per key are enough to order them, and each bit less shortens the encoding
+			size_t count = static_cast<size_t>(last - first), bits = 1;
+			while (bits < curve_bits<Curve_order<Key>::Dim>() && (count >> (bits * Curve_order<Key>::Dim)) > 0)
+				++bits;
+			bits = std::min(bits + (4 + Curve_order<Key>::Dim - 1) / Curve_order<Key>::Dim, curve_bits<Curve_order<Key>::Dim>());
+
+			Curve_order<Key> order = Curve_order<Key>::bounding(first, last, key_of, Curve::hilbert, bits);
+			std::vector<std::pair<std::uint64_t, T>> coded;
+			coded.reserve(static_cast<size_t>(last - first));
+			for (T *it = first; it != last; ++it)
+				coded.emplace_back(order(key_of(*it)), std::move(*it));
+			std::sort(coded.begin(), coded.end(), [](const std::pair<std::uint64_t, T> &lhs, const std::pair<std::uint64_t, T> &rhs) { return lhs.first < rhs.first; });
+			for (auto it = coded.begin(), end_it = coded.end(); it != end_it; ++it)
+				*first++ = std::move(it->second);
+		}
+
+		//Keys that cannot be mapped to a curve, or that have more than 64 dimensions, keep their order
+		template<typename Key, typename T, typename KeyOf>
+		typename std::enable_if<!has_curve_order<Key>::value>::type
+		curve_sort(T*, T*, KeyOf) {}
+	}
+}
@@ -0,0 +1,630 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <initializer_list>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace BK_KD_tree
+{
+	namespace detail
+	{
+		//A flat view of any tree representation whose nodes expose value(), left_child() and right_child().
+		//The tree is stored in preorder, and every node records the corners of the bounding box of its subtree as two keys,
+		//so that the distance between two subtrees can be bounded with get_distance_to_plane alone.
+		template<typename Traits, typename NodePointer>
+		class KD_tree_flat
+		{
+		public:
+			typedef typename Traits::key_type		key_type;
+			typedef typename Traits::value_type		value_type;
+			typedef typename Traits::key_compare	key_compare;
+			static constexpr size_t Dim = Traits::Dimension;
+			static constexpr size_t npos = size_t(-1);
+
+			//The bounding box of a subtree; min holds the smallest and max the largest coordinate of the subtree in each dimension
+			struct box
+			{
+				key_type min;
+				key_type max;
+			};
+			struct flat_node
+			{
+				const value_type *value;
+				size_t left;
+				size_t right;
+				size_t size;
+				box bounds;
+			};
+
+			KD_tree_flat(NodePointer root, const key_compare &comp);
+
+			const flat_node& operator[](size_t i) const { return m_nodes[i]; }
+			//The keys are copied in preorder so that scanning a subtree does not chase pointers into the tree
+			const key_type& key(size_t i) const { return m_keys[i]; }
+			size_t size() const { return m_nodes.size(); }
+			bool empty() const { return m_nodes.empty(); }
+
+			//Returns a lower bound of the distance between two boxes
+			template<typename Distance_op>
+			double box_distance(const box &lhs, const box &rhs, Distance_op &distance) const { return box_distance_op<0>(lhs.min, lhs.max, rhs.min, rhs.max, distance); }
+			//Returns a lower bound of the distance between a key and a box
+			template<typename Distance_op>
+			double box_distance(const key_type &key, const box &rhs, Distance_op &distance) const { return box_distance_op<0>(key, key, rhs.min, rhs.max, distance); }
+
+		private:
+			//Advances the dimension index
+			template<size_t N>
+			static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+			size_t flatten_op(NodePointer current);
+			//Returns the key that takes the smaller (or with Max, the larger) coordinate of lhs and rhs in every dimension
+			template<bool Max, size_t... I>
+			key_type corner(const key_type &lhs, const key_type &rhs, std::index_sequence<I...>) const;
+			template<size_t N, typename Distance_op>
+			double box_distance_op(const key_type &lhs_min, const key_type &lhs_max, const key_type &rhs_min, const key_type &rhs_max, Distance_op &distance) const;
+
+			std::vector<flat_node>	m_nodes;
+			std::vector<key_type>	m_keys;
+			const key_compare		&m_comp;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		//A fixed radius self join over a flat view of a tree
+		template<typename Traits, typename NodePointer>
+		class KD_tree_join
+		{
+		public:
+			typedef typename Traits::key_type		key_type;
+			typedef typename Traits::value_type		value_type;
+			typedef typename Traits::key_compare	key_compare;
+
+			KD_tree_join(NodePointer root, const key_compare &comp) : m_tree(root, comp) {}
+
+			//Calls sink(a, b, distance) once for every unordered pair of values whose keys are at most epsilon apart
+			template<typename Distance_op, typename Sink>
+			void run(double epsilon, Distance_op &distance, Sink &sink) const;
+			//Splits the top of the recursion into tasks that are shared by a number of threads; sink is called concurrently
+			template<typename Distance_op, typename Sink>
+			void run(double epsilon, const Distance_op &distance, Sink &sink, size_t threads) const;
+
+		private:
+			typedef KD_tree_flat<Traits, NodePointer>	flat_type;
+			typedef typename flat_type::box				box;
+			typedef typename flat_type::flat_node		flat_node;
+			static constexpr size_t npos = flat_type::npos;
+
+			//A unit of work: the pairs within subtree first, or between subtree first and subtree second, or between the value of first and subtree second
+			struct task
+			{
+				enum kind_type { self, cross, point } kind;
+				size_t first;
+				size_t second;
+			};
+
+			template<typename Distance_op, typename Sink>
+			void self_op(size_t i, double epsilon, Distance_op &distance, Sink &sink) const;
+			template<typename Distance_op, typename Sink>
+			void cross_op(size_t i, size_t j, double epsilon, Distance_op &distance, Sink &sink) const;
+			template<typename Distance_op, typename Sink>
+			void point_op(size_t i, const key_type &point, size_t j, double epsilon, Distance_op &distance, Sink &sink) const;
+			template<typename Distance_op, typename Sink>
+			void run_task(const task &t, double epsilon, Distance_op &distance, Sink &sink) const;
+			//Splits a task into the tasks that make up its recursion until depth reaches 0
+			void expand_op(const task &t, size_t depth, std::vector<task> &tasks) const;
+
+			flat_type m_tree;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		//The k nearest neighbours of every value of a tree among the values of the same tree, found with a dual tree traversal that visits
+		//every unordered pair of subtrees once and offers every distance to both of its values. Every node keeps an upper bound of the k-th
+		//distances of its subtree, and a pair of subtrees is skipped as soon as the distance between their boxes exceeds both bounds.
+		template<typename Traits, typename NodePointer>
+		class KD_tree_all_KNN
+		{
+		public:
+			typedef typename Traits::key_type					key_type;
+			typedef typename Traits::value_type					value_type;
+			typedef typename Traits::mapped_type				mapped_type;
+			typedef KD_tree_flat<Traits, NodePointer>			flat_type;
+			typedef std::pair<double, const mapped_type*>		neighbor_type;
+
+			//With include_self, every value is also a neighbour of itself
+			KD_tree_all_KNN(const flat_type &tree, size_t k, bool include_self) : m_tree(tree), m_k(k), m_include_self(include_self) {}
+
+			//Fills queries with the values in the preorder of the tree, and neighbors with k entries per value, nearest first.
+			//Rows with fewer than k neighbours are padded with (infinity, nullptr).
+			template<typename Distance_op>
+			void run(Distance_op &distance, std::vector<const value_type*> &queries, std::vector<neighbor_type> &neighbors);
+
+		private:
+			typedef typename flat_type::flat_node		flat_node;
+			static constexpr size_t npos = flat_type::npos;
+			//Subtrees up to this size are compared pair by pair instead of being split further
+			static constexpr size_t leaf_size = 16;
+
+			//Offers the pairs within subtree q
+			template<typename Distance_op>
+			void self_op(size_t q, Distance_op &distance);
+			//Offers the pairs between subtrees a and b, unless lower_bound proves that none of their values can gain a neighbour
+			template<typename Distance_op>
+			void cross_op(size_t a, size_t b, double lower_bound, Distance_op &distance);
+			//Offers the pairs between value i and subtree b
+			template<typename Distance_op>
+			void point_op(size_t i, size_t b, Distance_op &distance);
+			void offer_both(size_t i, size_t j, double dist) { offer(i, j, dist); offer(j, i, dist); }
+
+			//Most offers are rejected by the k-th distance alone, without touching the row
+			void offer(size_t q, size_t r, double dist) { if (dist < m_kth[q]) insert(q, r, dist); }
+			void insert(size_t q, size_t r, double dist);
+			void update_bound(size_t q);
+			//Sets the bound of a leaf from the k-th distances of its values
+			void update_leaf_bound(size_t q);
+			void update_any_bound(size_t q) { if (m_tree[q].size <= leaf_size) update_leaf_bound(q); else update_bound(q); }
+
+			const flat_type				&m_tree;
+			size_t						m_k;
+			bool						m_include_self;
+			//row q of m_rows is a max heap of the distances and indices of the m_counts[q] best neighbours of value q
+			std::vector<std::pair<double, size_t>>	m_rows;
+			std::vector<size_t>			m_counts;
+			//the k-th distance of every value, kept apart from the rows so that rejecting a neighbour reads little memory
+			std::vector<double>			m_kth;
+			std::vector<double>			m_bounds;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		//The constants are bound to references, e.g. by std::pair, so C++14 builds need their definitions
+		template<typename Traits, typename NodePointer>
+		constexpr size_t KD_tree_flat<Traits, NodePointer>::npos;
+		template<typename Traits, typename NodePointer>
+		constexpr size_t KD_tree_join<Traits, NodePointer>::npos;
+		template<typename Traits, typename NodePointer>
+		constexpr size_t KD_tree_all_KNN<Traits, NodePointer>::npos;
+		template<typename Traits, typename NodePointer>
+		constexpr size_t KD_tree_all_KNN<Traits, NodePointer>::leaf_size;
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		KD_tree_flat<Traits, NodePointer>::KD_tree_flat(NodePointer root, const key_compare &comp) : m_comp(comp)
+		{
+			flatten_op(root);
+
+			//children follow their parent in preorder, so the boxes can be built from the back
+			m_keys.reserve(m_nodes.size());
+			for (auto &node : m_nodes)
+				m_keys.push_back(Traits::val_to_key(*node.value));
+			for (size_t i = m_nodes.size(); i-- > 0;)
+			{
+				flat_node &node = m_nodes[i];
+				key_type min = m_keys[i], max = m_keys[i];
+				for (size_t child : { node.left, node.right })
+				{
+					if (child == npos)
+						continue;
+					node.size += m_nodes[child].size;
+					min = corner<false>(min, m_nodes[child].bounds.min, std::make_index_sequence<Dim>());
+					max = corner<true>(max, m_nodes[child].bounds.max, std::make_index_sequence<Dim>());
+				}
+				node.bounds = box{ std::move(min), std::move(max) };
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		size_t
+		KD_tree_flat<Traits, NodePointer>::flatten_op(NodePointer current)
+		{
+			if (current == nullptr)
+				return npos;
+
+			size_t index = m_nodes.size();
+			m_nodes.push_back(flat_node{ &current->value(), npos, npos, 1, box{ key_type(), key_type() } });
+
+			size_t left = flatten_op(current->left_child());
+			size_t right = flatten_op(current->right_child());
+
+			//the vector may have been reallocated by the recursive calls
+			m_nodes[index].left = left;
+			m_nodes[index].right = right;
+			return index;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<bool Max, size_t... I>
+		typename KD_tree_flat<Traits, NodePointer>::key_type
+		KD_tree_flat<Traits, NodePointer>::corner(const key_type &lhs, const key_type &rhs, std::index_sequence<I...>) const
+		{
+			return key_type(key_type::template get<I>(m_comp.template compare<I>(lhs, rhs) != Max ? lhs : rhs)...);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<size_t N, typename Distance_op>
+		double
+		KD_tree_flat<Traits, NodePointer>::box_distance_op(const key_type &lhs_min, const key_type &lhs_max, const key_type &rhs_min, const key_type &rhs_max, Distance_op &distance) const
+		{
+			//the gap between the two boxes in dimension N
+			double gap = 0.0;
+			if (m_comp.template compare<N>(lhs_max, rhs_min))
+				gap = distance.template get_distance_to_plane<N>(lhs_max, rhs_min);
+			else if (m_comp.template compare<N>(rhs_max, lhs_min))
+				gap = distance.template get_distance_to_plane<N>(rhs_max, lhs_min);
+
+			if (N + 1 < Dim)
+			{
+				double other = box_distance_op<next_dim<N>()>(lhs_min, lhs_max, rhs_min, rhs_max, distance);
+				return gap < other ? other : gap;
+			}
+			else
+				return gap;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::run(double epsilon, Distance_op &distance, Sink &sink) const
+		{
+			if (!m_tree.empty())
+				self_op(0, epsilon, distance, sink);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::self_op(size_t i, double epsilon, Distance_op &distance, Sink &sink) const
+		{
+			if (i == npos)
+				return;
+
+			//the pairs of a subtree are the pairs of its root with its children plus the pairs within and between the children
+			const flat_node &node = m_tree[i];
+			point_op(i, m_tree.key(i), node.left, epsilon, distance, sink);
+			point_op(i, m_tree.key(i), node.right, epsilon, distance, sink);
+			self_op(node.left, epsilon, distance, sink);
+			self_op(node.right, epsilon, distance, sink);
+			cross_op(node.left, node.right, epsilon, distance, sink);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::cross_op(size_t i, size_t j, double epsilon, Distance_op &distance, Sink &sink) const
+		{
+			if (i == npos || j == npos || m_tree.box_distance(m_tree[i].bounds, m_tree[j].bounds, distance) > epsilon)
+				return;
+
+			//split the larger subtree into its root and its children
+			if (m_tree[i].size < m_tree[j].size)
+				std::swap(i, j);
+			const flat_node &node = m_tree[i];
+			point_op(i, m_tree.key(i), j, epsilon, distance, sink);
+			cross_op(node.left, j, epsilon, distance, sink);
+			cross_op(node.right, j, epsilon, distance, sink);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::point_op(size_t i, const key_type &point, size_t j, double epsilon, Distance_op &distance, Sink &sink) const
+		{
+			if (j == npos || m_tree.box_distance(point, m_tree[j].bounds, distance) > epsilon)
+				return;
+
+			double dist = distance.get_cartesian_distance(m_tree.key(i), m_tree.key(j));
+			if (dist <= epsilon)
+				sink(*m_tree[i].value, *m_tree[j].value, dist);
+
+			point_op(i, point, m_tree[j].left, epsilon, distance, sink);
+			point_op(i, point, m_tree[j].right, epsilon, distance, sink);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::run_task(const task &t, double epsilon, Distance_op &distance, Sink &sink) const
+		{
+			switch (t.kind)
+			{
+			case task::self: self_op(t.first, epsilon, distance, sink); break;
+			case task::cross: cross_op(t.first, t.second, epsilon, distance, sink); break;
+			case task::point: point_op(t.first, m_tree.key(t.first), t.second, epsilon, distance, sink); break;
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		void
+		KD_tree_join<Traits, NodePointer>::expand_op(const task &t, size_t depth, std::vector<task> &tasks) const
+		{
+			if (t.first == npos || (t.kind != task::self && t.second == npos))
+				return;
+			//a point task is cheap, and a cross task is pruned by its first call
+			if (depth == 0 || t.kind != task::self)
+			{
+				tasks.push_back(t);
+				return;
+			}
+
+			const flat_node &node = m_tree[t.first];
+			tasks.push_back(task{ task::point, t.first, node.left });
+			tasks.push_back(task{ task::point, t.first, node.right });
+			tasks.push_back(task{ task::cross, node.left, node.right });
+			expand_op(task{ task::self, node.left, npos }, depth - 1, tasks);
+			expand_op(task{ task::self, node.right, npos }, depth - 1, tasks);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op, typename Sink>
+		void
+		KD_tree_join<Traits, NodePointer>::run(double epsilon, const Distance_op &distance, Sink &sink, size_t threads) const
+		{
+			if (threads == 0)
+				threads = std::thread::hardware_concurrency();
+			if (threads <= 1 || m_tree.empty())
+			{
+				Distance_op local(distance);
+				run(epsilon, local, sink);
+				return;
+			}
+
+			//split the top levels of the tree into a few tasks per thread
+			std::vector<task> tasks;
+			size_t depth = 0;
+			for (size_t count = 1; count < threads * 4; count *= 2)
+				++depth;
+			expand_op(task{ task::self, 0, npos }, depth, tasks);
+
+			std::atomic<size_t> next(0);
+			std::vector<std::exception_ptr> errors(threads);
+			std::vector<std::thread> workers;
+			for (size_t w = 0; w < threads; ++w)
+			{
+				workers.emplace_back([this, &tasks, &next, &errors, &distance, &sink, epsilon, w]
+				{
+					try
+					{
+						//every thread uses its own copy of the distance functor
+						Distance_op local(distance);
+						for (size_t t = next++; t < tasks.size(); t = next++)
+							run_task(tasks[t], epsilon, local, sink);
+					}
+					catch (...)
+					{
+						errors[w] = std::current_exception();
+						next = tasks.size();
+					}
+				});
+			}
+			for (auto &worker : workers)
+				worker.join();
+
+			for (auto &error : errors)
+			{
+				if (error)
+					std::rethrow_exception(error);
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::run(Distance_op &distance, std::vector<const value_type*> &queries, std::vector<neighbor_type> &neighbors)
+		{
+			size_t n = m_tree.size();
+			m_rows.assign(n * m_k, std::pair<double, size_t>(std::numeric_limits<double>::infinity(), npos));
+			m_counts.assign(n, 0);
+			m_kth.assign(n, std::numeric_limits<double>::infinity());
+			m_bounds.assign(n, std::numeric_limits<double>::infinity());
+			if (m_k > 0 && !m_tree.empty())
+			{
+				//the traversal only pairs distinct values
+				if (m_include_self)
+				{
+					for (size_t q = 0; q < n; ++q)
+						offer(q, q, distance.get_cartesian_distance(m_tree.key(q), m_tree.key(q)));
+				}
+				self_op(0, distance);
+			}
+
+			queries.resize(n);
+			neighbors.assign(n * m_k, neighbor_type(std::numeric_limits<double>::infinity(), nullptr));
+			for (size_t q = 0; q < n; ++q)
+			{
+				queries[q] = m_tree[q].value;
+				//turn the heap into a sorted row; the padding stays at its end
+				auto row = m_rows.begin() + q * m_k;
+				std::sort_heap(row, row + m_counts[q]);
+				for (size_t i = 0; i < m_counts[q]; ++i)
+					neighbors[q * m_k + i] = neighbor_type(row[i].first, &Traits::val_to_mapped(*m_tree[row[i].second].value));
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::self_op(size_t q, Distance_op &distance)
+		{
+			if (q == npos)
+				return;
+
+			const flat_node &node = m_tree[q];
+			if (node.size <= leaf_size)
+			{
+				for (size_t i = q; i < q + node.size; ++i)
+				{
+					for (size_t j = i + 1; j < q + node.size; ++j)
+						offer_both(i, j, distance.get_cartesian_distance(m_tree.key(i), m_tree.key(j)));
+				}
+				update_leaf_bound(q);
+				return;
+			}
+
+			//the children are searched first, since their pairs are the closest
+			self_op(node.left, distance);
+			self_op(node.right, distance);
+			point_op(q, node.left, distance);
+			point_op(q, node.right, distance);
+			if (node.left != npos && node.right != npos)
+				cross_op(node.left, node.right, m_tree.box_distance(m_tree[node.left].bounds, m_tree[node.right].bounds, distance), distance);
+			update_bound(q);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::cross_op(size_t a, size_t b, double lower_bound, Distance_op &distance)
+		{
+			if (a == npos || b == npos || (lower_bound > m_bounds[a] && lower_bound > m_bounds[b]))
+				return;
+
+			if (m_tree[a].size < m_tree[b].size)
+				std::swap(a, b);
+			const flat_node &lhs = m_tree[a], &rhs = m_tree[b];
+			if (lhs.size <= leaf_size)
+			{
+				for (size_t i = a; i < a + lhs.size; ++i)
+				{
+					for (size_t j = b; j < b + rhs.size; ++j)
+						offer_both(i, j, distance.get_cartesian_distance(m_tree.key(i), m_tree.key(j)));
+				}
+				update_leaf_bound(a);
+				update_leaf_bound(b);
+				return;
+			}
+
+			//split the larger subtree into its root and its children, and pair the closer child first
+			point_op(a, b, distance);
+			size_t near = lhs.left, far = lhs.right;
+			double near_bound = near == npos ? 0.0 : m_tree.box_distance(m_tree[near].bounds, rhs.bounds, distance);
+			double far_bound = far == npos ? 0.0 : m_tree.box_distance(m_tree[far].bounds, rhs.bounds, distance);
+			if (far_bound < near_bound)
+			{
+				std::swap(near, far);
+				std::swap(near_bound, far_bound);
+			}
+			cross_op(near, b, near_bound, distance);
+			cross_op(far, b, far_bound, distance);
+			update_bound(a);
+			update_any_bound(b);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		template<typename Distance_op>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::point_op(size_t i, size_t b, Distance_op &distance)
+		{
+			if (b == npos)
+				return;
+
+			//the subtree is skipped only when neither the value nor any value of the subtree can gain a neighbour
+			const flat_node &node = m_tree[b];
+			double lower_bound = m_tree.box_distance(m_tree.key(i), node.bounds, distance);
+			if (lower_bound > m_kth[i] && lower_bound > m_bounds[b])
+				return;
+
+			if (node.size <= leaf_size)
+			{
+				for (size_t j = b; j < b + node.size; ++j)
+					offer_both(i, j, distance.get_cartesian_distance(m_tree.key(i), m_tree.key(j)));
+				update_leaf_bound(b);
+				return;
+			}
+
+			offer_both(i, b, distance.get_cartesian_distance(m_tree.key(i), m_tree.key(b)));
+			point_op(i, node.left, distance);
+			point_op(i, node.right, distance);
+			update_bound(b);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::insert(size_t q, size_t r, double dist)
+		{
+			auto row = m_rows.begin() + q * m_k;
+			size_t &count = m_counts[q];
+			if (count < m_k)
+			{
+				row[count++] = std::pair<double, size_t>(dist, r);
+				std::push_heap(row, row + count);
+			}
+			else
+			{
+				std::pop_heap(row, row + count);
+				row[count - 1] = std::pair<double, size_t>(dist, r);
+				std::push_heap(row, row + count);
+			}
+			if (count == m_k)
+				m_kth[q] = row->first;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::update_bound(size_t q)
+		{
+			//the k-th distances only shrink, so a bound computed from stale child bounds is still an upper bound
+			const flat_node &query = m_tree[q];
+			double bound = m_kth[q];
+			if (query.left != npos && bound < m_bounds[query.left])
+				bound = m_bounds[query.left];
+			if (query.right != npos && bound < m_bounds[query.right])
+				bound = m_bounds[query.right];
+			m_bounds[q] = bound;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits, typename NodePointer>
+		void
+		KD_tree_all_KNN<Traits, NodePointer>::update_leaf_bound(size_t q)
+		{
+			//the bounds of the nodes inside a leaf are never read
+			double bound = 0.0;
+			for (size_t i = q; i < q + m_tree[q].size; ++i)
+			{
+				double kth = m_kth[i];
+				if (bound < kth)
+					bound = kth;
+			}
+			m_bounds[q] = bound;
+		}
+	} //namespace detail
+}
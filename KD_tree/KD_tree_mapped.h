@@ -0,0 +1,520 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "KD_tree.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace BK_KD_tree
+{
+	class invalid_tree_file : public std::runtime_error
+	{
+	public:
+		using runtime_error::runtime_error;
+	};
+
+	namespace detail
+	{
+		//64-bit FNV-1a hash, used for the key layout signature and the node block checksum
+		static constexpr std::uint64_t fnv_offset_basis = 14695981039346656037ull;
+		static constexpr std::uint64_t fnv_prime = 1099511628211ull;
+
+		inline std::uint64_t fnv1a(const void *data, size_t size, std::uint64_t hash = fnv_offset_basis)
+		{
+			const unsigned char *bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; ++i)
+				hash = (hash ^ bytes[i]) * fnv_prime;
+			return hash;
+		}
+
+		//Mixes the size and the kind of one coordinate type into a layout signature
+		template<typename T>
+		std::uint64_t element_signature(std::uint64_t hash)
+		{
+			const std::uint64_t desc[] = { sizeof(T), alignof(T), std::is_floating_point<T>::value, std::is_signed<T>::value };
+			return fnv1a(desc, sizeof(desc), hash);
+		}
+
+		//Describes the in-memory layout of a key type, so that a file written with a different key is rejected
+		template<typename T>
+		struct key_layout;
+
+		template<size_t Dim, typename ElemType>
+		struct key_layout<Point<Dim, ElemType>>
+		{
+			static std::uint64_t value()
+			{
+				std::uint64_t hash = fnv_offset_basis;
+				for (size_t i = 0; i < Dim; ++i)
+					hash = element_signature<ElemType>(hash);
+				return hash;
+			}
+		};
+
+		template<typename... Args>
+		struct key_layout<BK_Tuple::Tuple<Args...>>
+		{
+			static std::uint64_t value()
+			{
+				std::uint64_t hash = fnv_offset_basis;
+				using expand = int[];
+				(void)expand{ 0, (hash = element_signature<Args>(hash), 0)... };
+				return hash;
+			}
+		};
+
+		//The fixed-size header at the start of every tree file
+		struct mapped_tree_header
+		{
+			char			magic[8];
+			std::uint32_t	version;
+			std::uint32_t	byte_order;		//0x01020304 as written by the producer
+			std::uint64_t	dimension;
+			std::uint64_t	key_layout;
+			std::uint64_t	key_size;
+			std::uint64_t	mapped_size;
+			std::uint64_t	node_size;
+			std::uint64_t	node_align;
+			std::uint64_t	node_offset;	//byte offset of the first node, the root
+			std::uint64_t	node_count;
+			std::uint64_t	checksum;		//FNV-1a of the node block
+		};
+
+		//A read-only memory mapping of a whole file
+		class mapped_file
+		{
+		public:
+			explicit mapped_file(const std::string &path);
+			mapped_file(const mapped_file&) = delete;
+			mapped_file(mapped_file &&file);
+			~mapped_file() { unmap(); }
+
+			mapped_file& operator=(const mapped_file&) = delete;
+			mapped_file& operator=(mapped_file &&file);
+
+			const char* data() const { return m_data; }
+			size_t size() const { return m_size; }
+
+		private:
+			void unmap();
+
+			const char	*m_data;
+			size_t		m_size;
+#ifdef _WIN32
+			HANDLE		m_file;
+			HANDLE		m_mapping;
+#endif
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+		inline mapped_file::mapped_file(const std::string &path) : m_data(nullptr), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr)
+		{
+			m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER file_size;
+			if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &file_size) || file_size.QuadPart == 0)
+			{
+				unmap();
+				throw invalid_tree_file("Unable to open " + path);
+			}
+
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_mapping != nullptr)
+				m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+			if (m_data == nullptr)
+			{
+				unmap();
+				throw invalid_tree_file("Unable to map " + path);
+			}
+			m_size = static_cast<size_t>(file_size.QuadPart);
+		}
+
+		inline mapped_file::mapped_file(mapped_file &&file) : m_data(file.m_data), m_size(file.m_size), m_file(file.m_file), m_mapping(file.m_mapping)
+		{
+			file.m_data = nullptr;
+			file.m_size = 0;
+			file.m_file = INVALID_HANDLE_VALUE;
+			file.m_mapping = nullptr;
+		}
+
+		inline mapped_file& mapped_file::operator=(mapped_file &&file)
+		{
+			if (&file != this)
+			{
+				unmap();
+				std::swap(m_data, file.m_data);
+				std::swap(m_size, file.m_size);
+				std::swap(m_file, file.m_file);
+				std::swap(m_mapping, file.m_mapping);
+			}
+
+			return *this;
+		}
+
+		inline void mapped_file::unmap()
+		{
+			if (m_data != nullptr)
+				UnmapViewOfFile(m_data);
+			if (m_mapping != nullptr)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+			m_data = nullptr;
+			m_size = 0;
+			m_mapping = nullptr;
+			m_file = INVALID_HANDLE_VALUE;
+		}
+#else
+		inline mapped_file::mapped_file(const std::string &path) : m_data(nullptr), m_size(0)
+		{
+			int fd = ::open(path.c_str(), O_RDONLY);
+			struct stat file_stat;
+			if (fd < 0 || ::fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+			{
+				if (fd >= 0)
+					::close(fd);
+				throw invalid_tree_file("Unable to open " + path);
+			}
+
+			void *addr = ::mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+			//the mapping stays valid after the descriptor is closed
+			::close(fd);
+			if (addr == MAP_FAILED)
+				throw invalid_tree_file("Unable to map " + path);
+
+			m_data = static_cast<const char*>(addr);
+			m_size = static_cast<size_t>(file_stat.st_size);
+		}
+
+		inline mapped_file::mapped_file(mapped_file &&file) : m_data(file.m_data), m_size(file.m_size)
+		{
+			file.m_data = nullptr;
+			file.m_size = 0;
+		}
+
+		inline mapped_file& mapped_file::operator=(mapped_file &&file)
+		{
+			if (&file != this)
+			{
+				unmap();
+				std::swap(m_data, file.m_data);
+				std::swap(m_size, file.m_size);
+			}
+
+			return *this;
+		}
+
+		inline void mapped_file::unmap()
+		{
+			if (m_data != nullptr)
+				::munmap(const_cast<char*>(m_data), m_size);
+			m_data = nullptr;
+			m_size = 0;
+		}
+#endif
+	} //namespace detail
+
+//---------------------------------------------------------------------------------------------
+
+	//A read-only tree that is queried in place from a memory-mapped file. Processes that map the same file share its pages.
+	//Files are produced by Mapped_KD_tree::write from a KD_tree with the same template arguments.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Mapped_KD_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
+		typedef KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_type;
+
+		//The version of the file format
+		static constexpr std::uint32_t version = 1;
+
+		//Values are stored byte for byte, so they must not own external resources
+		static_assert(std::is_standard_layout<value_type>::value && std::is_trivially_destructible<value_type>::value,
+			"Mapped_KD_tree requires standard layout, trivially destructible keys and mapped values");
+
+		explicit Mapped_KD_tree(const std::string &path, bool verify_checksum = false, const key_compare &compare = key_compare());
+		Mapped_KD_tree(const Mapped_KD_tree&) = delete;
+		Mapped_KD_tree(Mapped_KD_tree &&tree) = default;
+
+		Mapped_KD_tree& operator=(const Mapped_KD_tree&) = delete;
+		Mapped_KD_tree& operator=(Mapped_KD_tree &&tree) = default;
+
+		//Writes tree to path in the mapped file format
+		static void write(const tree_type &tree, const std::string &path);
+
+		bool empty() const { return m_root == nullptr; }
+		size_t size() const { return static_cast<size_t>(header().node_count); }
+		static constexpr size_t dimension() { return Dim; }
+		//Recomputes the checksum of the node block
+		bool verify() const;
+		//Checks that every child offset points to a later node of the node block; the constructor does this when it skips the checksum
+		bool verify_links() const;
+
+		const mapped_type& operator[](const key_type &key) const { return at(key); }
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const;
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		//Select the best first strategy for one search
+		template<typename Distance_op>
+		KNN_container_type KNN_search(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key) const { return KNN_search_if(strategy, k, distance, key, detail::accept_all()); }
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(strategy, k, distance, key, detail::accept_all(), stats); }
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(strategy, k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+
+	private:
+		typedef KD_tree_static_node<tree_traits> node_type;
+		typedef const node_type* const_node_pointer;
+		typedef typename tree_type::const_node_pointer tree_node_pointer;
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+
+		detail::mapped_file	m_file;
+		const_node_pointer	m_root;
+		key_compare			m_comp;
+
+		const detail::mapped_tree_header& header() const { return *reinterpret_cast<const detail::mapped_tree_header*>(m_file.data()); }
+		//Fills in every header field except node_count and checksum
+		static detail::mapped_tree_header make_header();
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	detail::mapped_tree_header
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::make_header()
+	{
+		detail::mapped_tree_header h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, "BKKDTREE", sizeof(h.magic));
+		h.version = version;
+		h.byte_order = 0x01020304;
+		h.dimension = Dim;
+		h.key_layout = detail::key_layout<key_type>::value();
+		h.key_size = sizeof(key_type);
+		h.mapped_size = sizeof(mapped_type);
+		h.node_size = sizeof(node_type);
+		h.node_align = alignof(node_type);
+		//the nodes start on a cache line boundary
+		size_t align = alignof(node_type) > 64 ? alignof(node_type) : 64;
+		h.node_offset = (sizeof(h) + align - 1) / align * align;
+		return h;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::write(const tree_type &tree, const std::string &path)
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if (!out)
+			throw invalid_tree_file("Unable to open " + path);
+
+		detail::mapped_tree_header h = make_header();
+		std::vector<char> padding(static_cast<size_t>(h.node_offset), 0);
+		out.write(padding.data(), padding.size());
+
+		//the nodes are written in breadth first order, so the top levels of the tree share the first pages of the file
+		//and the index of every child is known when its parent is written
+		std::deque<tree_node_pointer> pending;
+		if (tree.m_root != nullptr)
+			pending.push_back(tree.m_root);
+
+		std::uint64_t index = 0, next_index = 1, checksum = detail::fnv_offset_basis;
+		//zeroed storage keeps the padding bytes of the nodes deterministic
+		typename std::aligned_storage<sizeof(node_type), alignof(node_type)>::type buffer;
+		while (!pending.empty())
+		{
+			tree_node_pointer current = pending.front();
+			pending.pop_front();
+
+			std::int64_t left = 0, right = 0;
+			if (current->left_child() != nullptr)
+			{
+				left = static_cast<std::int64_t>(next_index++ - index) * static_cast<std::int64_t>(sizeof(node_type));
+				pending.push_back(current->left_child());
+			}
+			if (current->right_child() != nullptr)
+			{
+				right = static_cast<std::int64_t>(next_index++ - index) * static_cast<std::int64_t>(sizeof(node_type));
+				pending.push_back(current->right_child());
+			}
+
+			std::memset(&buffer, 0, sizeof(buffer));
+			new (&buffer) node_type(current->value(), left, right);
+			checksum = detail::fnv1a(&buffer, sizeof(buffer), checksum);
+			out.write(reinterpret_cast<const char*>(&buffer), sizeof(buffer));
+			++index;
+		}
+
+		h.node_count = index;
+		h.checksum = checksum;
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		if (!out)
+			throw invalid_tree_file("Unable to write " + path);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::Mapped_KD_tree(const std::string &path, bool verify_checksum, const key_compare &compare)
+		: m_file(path), m_root(nullptr), m_comp(compare)
+	{
+		if (m_file.size() < sizeof(detail::mapped_tree_header))
+			throw invalid_tree_file("Truncated header in " + path);
+
+		const detail::mapped_tree_header &h = header();
+		const detail::mapped_tree_header expected = make_header();
+		if (std::memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0)
+			throw invalid_tree_file("Not a tree file: " + path);
+		if (h.version != expected.version || h.byte_order != expected.byte_order)
+			throw invalid_tree_file("Unsupported version or byte order in " + path);
+		if (h.dimension != expected.dimension || h.key_layout != expected.key_layout || h.key_size != expected.key_size ||
+			h.mapped_size != expected.mapped_size || h.node_size != expected.node_size || h.node_align != expected.node_align ||
+			h.node_offset != expected.node_offset)
+			throw invalid_tree_file("The key or value layout of " + path + " does not match the tree type");
+		if (m_file.size() < h.node_offset || h.node_count > (m_file.size() - h.node_offset) / h.node_size)
+			throw invalid_tree_file("Truncated node block in " + path);
+		if (verify_checksum ? !verify() : !verify_links())
+			throw invalid_tree_file((verify_checksum ? "Checksum mismatch in " : "Child offset out of range in ") + path);
+
+		if (h.node_count > 0)
+			m_root = reinterpret_cast<const_node_pointer>(m_file.data() + h.node_offset);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::verify() const
+	{
+		const detail::mapped_tree_header &h = header();
+		return detail::fnv1a(m_file.data() + h.node_offset, static_cast<size_t>(h.node_count * h.node_size)) == h.checksum;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::verify_links() const
+	{
+		//write stores the nodes in breadth first order, so a child always follows its parent; this also rules out cycles
+		const detail::mapped_tree_header &h = header();
+		const node_type *nodes = reinterpret_cast<const node_type*>(m_file.data() + h.node_offset);
+		const std::int64_t node_size = static_cast<std::int64_t>(sizeof(node_type));
+		for (std::uint64_t index = 0; index < h.node_count; ++index)
+		{
+			for (std::int64_t offset : { nodes[index].left_offset(), nodes[index].right_offset() })
+			{
+				if (offset == 0)
+					continue;
+				if (offset < 0 || offset % node_size != 0 || static_cast<std::uint64_t>(offset / node_size) >= h.node_count - index)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	const typename Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
+	{
+		const_node_pointer node = search_type::template find_op<0>(m_root, m_comp, key);
+		if (node == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(node->value());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::contains(const key_type &key) const
+	{
+		return search_type::template find_op<0>(m_root, m_comp, key) != nullptr;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		search_type::template KNN_search_op<0>(m_root, m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(const Best_first &strategy, size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		search_type::KNN_best_first_op(m_root, m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats, strategy);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	Mapped_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		search_type::template range_search_op<0>(m_root, m_comp, lower, upper, result, detail::accept_all(), stats);
+		return result;
+	}
+}
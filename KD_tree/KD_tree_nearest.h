@@ -0,0 +1,145 @@
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "KD_tree_search.h"
+#include "Priority_queue.h"
+
+namespace BK_KD_tree
+{
+	//Browses the values of a tree in order of their distance from a key, nearest first (G. R. Hjaltason and H. Samet, "Distance browsing
+	//in spatial databases", 1999). A priority queue holds both values, keyed by their distance, and subtrees that have not been expanded yet,
+	//keyed by a lower bound of the distance to any value inside them. A value is yielded once it is at the top of the queue, since nothing
+	//that is still queued can be closer, so each increment only expands the subtrees needed to certify the next value.
+	//Copies of an iterator share the queue, like the copies of an input stream iterator share the stream. A default constructed iterator
+	//marks the end of the values. The tree must not be modified while an iterator is in use.
+	template<typename Traits, typename NodePointer, typename Distance_op>
+	class Nearest_iterator
+	{
+	public:
+		typedef typename Traits::key_type							key_type;
+		typedef typename Traits::key_compare						key_compare;
+		typedef typename Traits::mapped_type						mapped_type;
+		typedef std::pair<double, const mapped_type*>				value_type;
+		typedef std::ptrdiff_t										difference_type;
+		typedef const value_type*									pointer;
+		typedef const value_type&									reference;
+		typedef std::input_iterator_tag								iterator_category;
+
+		Nearest_iterator() {}
+		Nearest_iterator(NodePointer root, const key_compare &comp, Distance_op distance, const key_type &key);
+
+		reference operator*() const { return m_current; }
+		pointer operator->() const { return &m_current; }
+		Nearest_iterator& operator++() { advance(); return *this; }
+		Nearest_iterator operator++(int) { Nearest_iterator ret(*this); advance(); return ret; }
+
+		//Iterators compare equal when both have reached the end
+		bool operator==(const Nearest_iterator &other) const { return m_state == other.m_state; }
+		bool operator!=(const Nearest_iterator &other) const { return !(*this == other); }
+
+	private:
+		typedef detail::KD_tree_search<Traits> search_type;
+
+		//A value that has been measured or a subtree that has not been expanded yet
+		struct pending
+		{
+			double		bound;	//the distance of a value, or a lower bound of the distances inside a subtree
+			NodePointer	node;
+			size_t		dim;
+			bool		is_value;
+		};
+		//Orders the queue so that its top holds the smallest bound, and a value before a subtree of the same bound
+		struct pending_compare
+		{
+			bool operator()(const pending &lhs, const pending &rhs) const { return rhs.bound < lhs.bound || (!(lhs.bound < rhs.bound) && !lhs.is_value && rhs.is_value); }
+		};
+
+		typedef BK_heap::Priority_queue<pending, std::vector<pending>, pending_compare> queue_type;
+
+		struct state
+		{
+			const key_compare	&comp;
+			Distance_op			distance;
+			key_type			key;
+			queue_type			queue;
+		};
+
+		//Queues the values along the path from a subtree root to a leaf on the side of the key, and the other sides of the path
+		struct descend_visitor
+		{
+			state &s;
+
+			template<size_t N>
+			void visit(NodePointer current, double bound);
+		};
+
+		std::shared_ptr<state>	m_state;	//nullptr at the end
+		value_type				m_current;
+
+		//Expands subtrees until a value reaches the top of the queue, or moves to the end when the queue runs out
+		void advance();
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Traits, typename NodePointer, typename Distance_op>
+	Nearest_iterator<Traits, NodePointer, Distance_op>::Nearest_iterator(NodePointer root, const key_compare &comp, Distance_op distance, const key_type &key)
+	{
+		if (root == nullptr)
+			return;
+		m_state = std::make_shared<state>(state{ comp, distance, key, queue_type() });
+		m_state->queue.push(pending{ 0.0, root, 0, false });
+		advance();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Traits, typename NodePointer, typename Distance_op>
+	void
+	Nearest_iterator<Traits, NodePointer, Distance_op>::advance()
+	{
+		queue_type &queue = m_state->queue;
+		while (!queue.empty())
+		{
+			pending next = queue.top();
+			queue.pop();
+			if (next.is_value)
+			{
+				m_current = value_type{ next.bound, &Traits::val_to_mapped(next.node->value()) };
+				return;
+			}
+			descend_visitor visitor{ *m_state };
+			search_type::dispatch_dim(next.dim, visitor, next.node, next.bound);
+		}
+		m_state.reset();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<typename Traits, typename NodePointer, typename Distance_op>
+	template<size_t N>
+	void
+	Nearest_iterator<Traits, NodePointer, Distance_op>::descend_visitor::visit(NodePointer current, double bound)
+	{
+		if (current == nullptr)
+			return;
+
+		const key_type &current_key = Traits::val_to_key(current->value());
+		s.queue.push(pending{ s.distance.get_cartesian_distance(current_key, s.key), current, 0, true });
+
+		bool go_left = s.comp.template compare<N>(s.key, current_key);
+		NodePointer far_child = go_left ? current->right_child() : current->left_child();
+		if (far_child != nullptr)
+		{
+			//every value on the other side of the splitting hyperplane is at least as far as the plane and the bound of this subtree
+			double dist_to_plane = s.distance.template get_distance_to_plane<N>(current_key, s.key);
+			s.queue.push(pending{ bound < dist_to_plane ? dist_to_plane : bound, far_child, search_type::template next_dim<N>(), false });
+		}
+
+		//the near side keeps the bound of the subtree, which is the smallest in the queue, so it is expanded right away
+		visit<search_type::template next_dim<N>()>(go_left ? current->left_child() : current->right_child(), bound);
+	}
+}
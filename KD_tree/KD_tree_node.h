@@ -1,7 +1,11 @@
 #pragma once
 #include "tuple.h"
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <initializer_list>
 #include <iostream>
+#include <vector>
 
 namespace BK_KD_tree
 {
@@ -39,6 +43,139 @@ namespace BK_KD_tree
 		node_pointer	right;
 	};
 
+	//A pointer-free node for trees that are built once and stored in a contiguous block (a vector or a mapped file).
+	//The children are stored as byte offsets relative to the node itself (0 for no child), so the block can be moved as a whole.
+	template<typename Traits>
+	class KD_tree_static_node
+	{
+	public:
+		typedef typename Traits::value_type	value_type;
+		typedef const KD_tree_static_node*	const_node_pointer;
+
+		template<typename Value>
+		KD_tree_static_node(Value &&value, std::int64_t left_offset = 0, std::int64_t right_offset = 0) : val(std::forward<Value>(value)), left(left_offset), right(right_offset) {}
+
+		value_type& value() { return val; }
+		const value_type& value() const { return val; }
+
+		const_node_pointer left_child() const { return child(left); }
+		const_node_pointer right_child() const { return child(right); }
+
+		std::int64_t& left_offset() { return left; }
+		std::int64_t& right_offset() { return right; }
+		std::int64_t left_offset() const { return left; }
+		std::int64_t right_offset() const { return right; }
+
+	private:
+		const_node_pointer child(std::int64_t offset) const
+		{
+			return offset == 0 ? nullptr : reinterpret_cast<const_node_pointer>(reinterpret_cast<const char*>(this) + offset);
+		}
+
+		value_type		val;
+		std::int64_t	left;
+		std::int64_t	right;
+	};
+
+	//A reference counted node that persistent trees share after a copy. The count includes every tree and node that links to the node.
+	//A node with a count of 1 that is reached through nodes with a count of 1 belongs to a single tree, which may change it in place;
+	//any other node must be copied before it is changed.
+	template<typename Traits>
+	class KD_tree_shared_node
+	{
+	public:
+		typedef typename Traits::value_type	value_type;
+		typedef KD_tree_shared_node*		node_pointer;
+		typedef const KD_tree_shared_node*	const_node_pointer;
+
+		//The node takes over one reference to each of its children
+		template<typename Value>
+		KD_tree_shared_node(Value &&value, node_pointer left_child_ptr = nullptr, node_pointer right_child_ptr = nullptr) : val(std::forward<Value>(value)), refs(1), left(left_child_ptr), right(right_child_ptr) {}
+		KD_tree_shared_node(const KD_tree_shared_node&) = delete;
+		KD_tree_shared_node& operator=(const KD_tree_shared_node&) = delete;
+
+		value_type& value() { return val; }
+		const value_type& value() const { return val; }
+
+		node_pointer& left_child() { return left; }
+		const_node_pointer left_child() const { return left; }
+
+		node_pointer& right_child() { return right; }
+		const_node_pointer right_child() const { return right; }
+
+		bool shared() const { return refs.load(std::memory_order_acquire) != 1; }
+
+		//Adds a reference to node and returns it
+		static node_pointer acquire(node_pointer node)
+		{
+			if (node != nullptr)
+				node->refs.fetch_add(1, std::memory_order_relaxed);
+			return node;
+		}
+		//Drops a reference to node and deletes the nodes that are no longer linked
+		static void release(node_pointer node);
+
+	private:
+		value_type				val;
+		std::atomic<size_t>		refs;
+		node_pointer			left;
+		node_pointer			right;
+	};
+
+	template<typename Traits>
+	void KD_tree_shared_node<Traits>::release(node_pointer node)
+	{
+		if (node == nullptr || node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		//an explicit stack avoids overflowing the call stack on a degenerate tree
+		std::vector<node_pointer> stack{ node };
+		while (!stack.empty())
+		{
+			node_pointer current = stack.back();
+			stack.pop_back();
+			for (node_pointer child : { current->left, current->right })
+			{
+				if (child != nullptr && child->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					stack.push_back(child);
+			}
+			delete current;
+		}
+	}
+
+	//A node that is linked into a tree while other threads traverse it. The links are atomic, a null link is replaced by a single
+	//compare and swap, and a linked node is never unlinked. The node publishes its value through an atomic pointer, which points at
+	//the value stored in the node until an overwrite publishes a replacement value that lives elsewhere; the key never changes.
+	template<typename Traits>
+	class KD_tree_concurrent_node
+	{
+	public:
+		typedef typename Traits::value_type		value_type;
+		typedef KD_tree_concurrent_node*		node_pointer;
+		typedef const KD_tree_concurrent_node*	const_node_pointer;
+
+		template<typename Value>
+		KD_tree_concurrent_node(Value &&value) : val(std::forward<Value>(value)), published(&val), left(nullptr), right(nullptr) {}
+		KD_tree_concurrent_node(const KD_tree_concurrent_node&) = delete;
+		KD_tree_concurrent_node& operator=(const KD_tree_concurrent_node&) = delete;
+
+		const value_type& value() const { return *published.load(std::memory_order_acquire); }
+		//Publishes a replacement value with the same key and returns the value it replaces
+		const value_type* publish(const value_type *value) { return published.exchange(value, std::memory_order_acq_rel); }
+
+		const_node_pointer left_child() const { return left.load(std::memory_order_acquire); }
+		const_node_pointer right_child() const { return right.load(std::memory_order_acquire); }
+
+		std::atomic<node_pointer>& left_link() { return left; }
+		std::atomic<node_pointer>& right_link() { return right; }
+
+	private:
+		value_type							val;
+		std::atomic<const value_type*>		published;
+		std::atomic<node_pointer>			left;
+		std::atomic<node_pointer>			right;
+	};
+
 	template<typename Traits>
 	void swap(KD_tree_node<Traits> &a, KD_tree_node<Traits> &b)
 	{
@@ -0,0 +1,316 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A persistent KD-Tree: copies share their nodes, so copying a tree takes constant time and memory.
+	//A change copies the O(depth) nodes on the path to the changed node that are shared with another tree, and changes
+	//the nodes that belong to this tree alone in place. Nodes are reference counted and freed by the last tree that uses them.
+	//Different copies can be read and changed by different threads at the same time, but a single tree is not thread-safe.
+	//Stored values are only reachable through const references, since they may be shared.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Persistent_KD_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
+
+		explicit Persistent_KD_tree(const key_compare &compare = key_compare()) : m_root(nullptr), m_size(0), m_comp(compare) {}
+		Persistent_KD_tree(const Persistent_KD_tree &tree) : m_root(node_type::acquire(tree.m_root)), m_size(tree.m_size), m_comp(tree.m_comp) {}
+		Persistent_KD_tree(Persistent_KD_tree &&tree);
+
+		Persistent_KD_tree& operator=(const Persistent_KD_tree &tree);
+		Persistent_KD_tree& operator=(Persistent_KD_tree &&tree);
+
+		~Persistent_KD_tree() { clear(); }
+
+		//Inserts a value or overwrites the mapped value of an existing key. Returns true if a new key was inserted.
+		bool insert(const value_type &value) { return insert_op<0>(m_root, value); }
+		bool insert(value_type &&value) { return insert_op<0>(m_root, std::move(value)); }
+		template<typename... Coords>
+		bool insert(const mapped_type &mapped, Coords&&... coordinates);
+		template<typename... Coords>
+		bool insert(mapped_type &&mapped, Coords&&... coordinates);
+		size_t erase(const key_type &key);
+
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const { return search_type::template find_op<0>(const_node_pointer(m_root), m_comp, key) != nullptr; }
+
+		bool empty() const { return m_root == nullptr; }
+		size_t size() const { return m_size; }
+		static constexpr size_t dimension() { return Dim; }
+		void clear();
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+
+	private:
+		typedef KD_tree_shared_node<tree_traits> node_type;
+		typedef node_type* node_pointer;
+		typedef const node_type* const_node_pointer;
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+
+		node_pointer	m_root;
+		size_t			m_size;
+		key_compare		m_comp;
+
+		template<size_t N>
+		static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+		//Replaces a node that is shared with another tree by a copy that only this tree links to
+		static void own(node_pointer &current);
+		template<size_t N, typename Value>
+		bool insert_op(node_pointer &current, Value &&value);
+		//Erases a key that is known to be in the subtree
+		template<size_t N>
+		void erase_op(node_pointer &current, const key_type &key);
+		//Returns the node with the smallest coordinate in dimension D of a subtree whose root splits dimension N
+		template<size_t D, size_t N>
+		const_node_pointer min_op(const_node_pointer current) const;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::Persistent_KD_tree(Persistent_KD_tree &&tree) : m_root(nullptr), m_size(0), m_comp(tree.m_comp)
+	{
+		std::swap(m_root, tree.m_root);
+		std::swap(m_size, tree.m_size);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>&
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::operator=(const Persistent_KD_tree &tree)
+	{
+		//the new root is acquired first, in case it is the current one
+		node_pointer root = node_type::acquire(tree.m_root);
+		node_type::release(m_root);
+		m_root = root;
+		m_size = tree.m_size;
+		m_comp = tree.m_comp;
+		return *this;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>&
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::operator=(Persistent_KD_tree &&tree)
+	{
+		if (&tree != this)
+		{
+			clear();
+			std::swap(m_root, tree.m_root);
+			std::swap(m_size, tree.m_size);
+			m_comp = std::move(tree.m_comp);
+		}
+
+		return *this;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename... Coords>
+	bool
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(const mapped_type &mapped, Coords&&... coordinates)
+	{
+		return insert_op<0>(m_root, value_type{ key_type(std::forward<Coords>(coordinates)...), mapped });
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename... Coords>
+	bool
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert(mapped_type &&mapped, Coords&&... coordinates)
+	{
+		return insert_op<0>(m_root, value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) });
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::own(node_pointer &current)
+	{
+		if (!current->shared())
+			return;
+
+		//the copy links to the children of the original, which become shared if they were not
+		node_pointer copy = new node_type(current->value(), node_type::acquire(current->left_child()), node_type::acquire(current->right_child()));
+		node_type::release(current);
+		current = copy;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N, typename Value>
+	bool
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert_op(node_pointer &current, Value &&value)
+	{
+		if (current == nullptr)
+		{
+			current = new node_type(std::forward<Value>(value));
+			++m_size;
+			return true;
+		}
+
+		own(current);
+		const key_type &key = tree_traits::val_to_key(value), &current_key = tree_traits::val_to_key(current->value());
+		if (search_type::compare_keys(m_comp, current_key, key))
+		{
+			current->value() = std::forward<Value>(value);
+			return false;
+		}
+		else if (m_comp.template compare<N>(key, current_key))
+			return insert_op<next_dim<N>()>(current->left_child(), std::forward<Value>(value));
+		else
+			return insert_op<next_dim<N>()>(current->right_child(), std::forward<Value>(value));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	size_t
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase(const key_type &key)
+	{
+		//a missing key must not copy the path to it
+		if (!contains(key))
+			return 0;
+
+		erase_op<0>(m_root, key);
+		--m_size;
+		return 1;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N>
+	void
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase_op(node_pointer &current, const key_type &key)
+	{
+		own(current);
+		const key_type &current_key = tree_traits::val_to_key(current->value());
+		if (!search_type::compare_keys(m_comp, current_key, key))
+		{
+			if (m_comp.template compare<N>(key, current_key))
+				erase_op<next_dim<N>()>(current->left_child(), key);
+			else
+				erase_op<next_dim<N>()>(current->right_child(), key);
+			return;
+		}
+
+		if (current->left_child() == nullptr && current->right_child() == nullptr)
+		{
+			node_type::release(current);
+			current = nullptr;
+			return;
+		}
+
+		//the node takes the value with the smallest coordinate in dimension N from its right subtree, which keeps the keys equal to it in
+		//dimension N on the right; without a right subtree, the left subtree moves to the right, since no key in it is smaller than that value
+		if (current->right_child() == nullptr)
+			std::swap(current->left_child(), current->right_child());
+		current->value() = min_op<N, next_dim<N>()>(current->right_child())->value();
+		erase_op<next_dim<N>()>(current->right_child(), tree_traits::val_to_key(current->value()));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t D, size_t N>
+	typename Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::const_node_pointer
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::min_op(const_node_pointer current) const
+	{
+		if (current == nullptr)
+			return nullptr;
+
+		const_node_pointer res = current;
+		auto keep_smaller = [this, &res](const_node_pointer node)
+		{
+			if (node != nullptr && m_comp.template compare<D>(tree_traits::val_to_key(node->value()), tree_traits::val_to_key(res->value())))
+				res = node;
+		};
+		keep_smaller(min_op<D, next_dim<N>()>(current->left_child()));
+		//the right subtree of a node that splits dimension D holds no smaller coordinate in that dimension
+		if (N != D)
+			keep_smaller(min_op<D, next_dim<N>()>(current->right_child()));
+		return res;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	const typename Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type&
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
+	{
+		const_node_pointer node = search_type::template find_op<0>(const_node_pointer(m_root), m_comp, key);
+		if (node == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(node->value());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::clear()
+	{
+		//the nodes that other trees still link to survive
+		node_type::release(m_root);
+		m_root = nullptr;
+		m_size = 0;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		search_type::template KNN_search_op<0>(const_node_pointer(m_root), m_comp, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	Persistent_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		search_type::template range_search_op<0>(const_node_pointer(m_root), m_comp, lower, upper, result, detail::accept_all(), stats);
+		return result;
+	}
+}
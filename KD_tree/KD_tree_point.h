@@ -1,5 +1,7 @@
 #pragma once
 #include <cassert>
+#include <cstddef>
+#include <utility>
 #include <type_traits>
 
 namespace BK_KD_tree
@@ -57,7 +59,7 @@ namespace BK_KD_tree
 	template<size_t Dim, typename ElemType>
 	Point<Dim, ElemType>::Point()
 	{
-		for (size_t i = 0; i < Dim; --i)
+		for (size_t i = 0; i < Dim; ++i)
 			coords[i] = 0;
 	}
 
@@ -103,14 +105,14 @@ namespace BK_KD_tree
 	template<size_t Dim, typename ElemType>
 	Point<Dim, ElemType>::Point(const Point &p)
 	{
-		for (auto i = 0; i < Dim; ++i)
+		for (size_t i = 0; i < Dim; ++i)
 			coords[i] = p.coords[i];
 	}
 
 	template<size_t Dim, typename ElemType>
 	Point<Dim, ElemType>::Point(Point &&p)
 	{
-		for (auto i = 0; i < Dim; ++i)
+		for (size_t i = 0; i < Dim; ++i)
 		{
 			coords[i] = ElemType();
 			coords[i] = std::move(p.coords[i]);
@@ -0,0 +1,532 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	namespace detail
+	{
+		//Converts a bound of a quantisation cell to a coordinate type. Integers are rounded away from the cell, so that the
+		//converted bound still lies between the cell and any integer coordinate outside of it.
+		template<typename T>
+		typename std::enable_if<std::is_integral<T>::value, T>::type
+		cell_bound(double bound, bool upper)
+		{
+			return static_cast<T>(upper ? std::ceil(bound) : std::floor(bound));
+		}
+
+		//The conversion between floating point types is monotonic, so it keeps the order of the bound and any coordinate
+		template<typename T>
+		typename std::enable_if<std::is_floating_point<T>::value, T>::type
+		cell_bound(double bound, bool)
+		{
+			return static_cast<T>(bound);
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	//A static KD-Tree that searches a compressed copy of its keys. The values are kept in buckets of up to bucket_size values,
+	//and every coordinate in a bucket is quantised to a Code (an 8 or 16 bit unsigned integer) relative to the bounding box of the bucket.
+	//A search computes a lower bound of the distance to the quantisation cell of a key and only reads the full precision key from
+	//the separate array of values when the bound does not rule the value out.
+	//Coordinates must be arithmetic and are quantised as double. The comparison of every dimension must order the coordinates
+	//numerically, like std::less or std::greater, and the distance must not shrink when the difference of two keys grows in any dimension.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code = std::uint16_t>
+	class Quantized_KD_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<const value_type*>			range_container_type;
+		typedef KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_type;
+		typedef Code											code_type;
+
+		static_assert(std::is_integral<Code>::value && std::is_unsigned<Code>::value && sizeof(Code) <= 2, "Code must be an 8 or 16 bit unsigned integer");
+
+		//The largest number of values that share a quantisation grid
+		static constexpr size_t bucket_size = 32;
+
+		explicit Quantized_KD_tree(const tree_type &tree);
+		template<typename InputIterator>
+		Quantized_KD_tree(InputIterator first, InputIterator last, const key_compare &compare = key_compare());
+
+		bool empty() const { return m_values.empty(); }
+		size_t size() const { return m_values.size(); }
+		static constexpr size_t dimension() { return Dim; }
+		//The bytes that the searches read for every value: the nodes, the grids of the buckets and the quantised keys
+		size_t hot_bytes() const { return m_nodes.size() * sizeof(node) + m_grids.size() * sizeof(grid) + m_codes.size() * sizeof(Code); }
+		//The bytes of the full precision values, which are only read to verify a candidate
+		size_t cold_bytes() const { return m_values.size() * sizeof(value_type); }
+
+		const mapped_type& operator[](const key_type &key) const { return at(key); }
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const { return find(key) != nullptr; }
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats. Every quantisation cell that is tested counts as a plane test,
+		//a value that is ruled out by its cell counts as a pruned subtree and only the distances to full precision keys count as distance evaluations.
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+
+	private:
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+		typedef typename tree_type::const_node_pointer tree_node_pointer;
+		typedef std::array<double, Dim> coordinates_type;
+
+		template<size_t I>
+		using element_type = typename std::decay<decltype(key_type::template get<I>(std::declval<const key_type&>()))>::type;
+
+		//How much of a quantisation cell lies inside a range
+		enum class cell_overlap { none, partial, full };
+
+		//The nodes are stored in preorder, so the left child of an inner node follows it. A bucket has no children.
+		struct node
+		{
+			key_type	split;		//the smallest key of the right subtree in the splitting dimension
+			size_t		begin, end;	//the values of the subtree
+			size_t		right;		//the index of the right child, or 0 for a bucket
+			size_t		grid;		//the index of the quantisation grid of a bucket
+		};
+
+		//Code c of dimension d stands for a coordinate in [min[d] + c * step[d], min[d] + (c + 1) * step[d]]
+		struct grid
+		{
+			coordinates_type	min, step;
+		};
+
+		std::vector<node>		m_nodes;
+		std::vector<grid>		m_grids;
+		std::vector<Code>		m_codes;	//Dim codes for every value, in the order of m_values
+		std::vector<value_type>	m_values;
+		key_compare				m_comp;
+
+		template<size_t N>
+		static constexpr size_t next_dim() { return (N + 1) % Dim; }
+		static constexpr size_t levels() { return size_t(std::numeric_limits<Code>::max()) + 1; }
+
+		template<size_t... I>
+		static coordinates_type coordinates(const key_type &key, std::index_sequence<I...>) { return coordinates_type{ { double(key_type::template get<I>(key))... } }; }
+		//The bounds of the cell of a code in dimension d of a grid
+		static double cell_min(const grid &g, size_t d, size_t code) { return g.min[d] + double(code) * g.step[d]; }
+		static double cell_max(const grid &g, size_t d, size_t code) { return g.min[d] + double(code + 1) * g.step[d]; }
+
+		void build();
+		template<size_t N>
+		void build_op(size_t begin, size_t end);
+		size_t quantize(size_t begin, size_t end);
+
+		const value_type* find(const key_type &key) const { return empty() ? nullptr : find_op<0>(0, key); }
+		template<size_t N>
+		const value_type* find_op(size_t index, const key_type &key) const;
+		template<size_t N, typename Distance_op, typename Predicate, typename Stats>
+		void KNN_search_op(size_t index, Distance_op &distance, const key_type &key, const coordinates_type &coords, queue_type &q, const Predicate &pred, Stats &stats) const;
+		template<size_t N, typename Stats>
+		void range_search_op(size_t index, const key_type &lower, const key_type &upper, range_container_type &result, Stats &stats) const;
+
+		//Returns the distance from key to the nearest point of the box [min, max], a lower bound of the distance to any key inside the box
+		template<typename Distance_op, size_t... I>
+		static double box_distance(Distance_op &distance, const key_type &key, const coordinates_type &coords, const coordinates_type &min, const coordinates_type &max, std::index_sequence<I...>);
+		//Returns the coordinate of [min, max] that is nearest to key in dimension I, which is the coordinate of key if it lies inside
+		template<size_t I>
+		static element_type<I> nearest_bound(const key_type &key, const coordinates_type &coords, double min, double max);
+		//Returns the lower (upper is false) or the upper corner of the cell of a quantised key
+		template<size_t... I>
+		static key_type cell_corner(const grid &g, const Code *codes, bool upper, std::index_sequence<I...>);
+		template<size_t N>
+		cell_overlap overlap_op(const key_type &cell_lower, const key_type &cell_upper, const key_type &lower, const key_type &upper) const;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::Quantized_KD_tree(const tree_type &tree) : m_comp(tree.m_comp)
+	{
+		m_values.reserve(tree.size());
+		std::vector<tree_node_pointer> pending;
+		if (tree.m_root != nullptr)
+			pending.push_back(tree.m_root);
+		while (!pending.empty())
+		{
+			tree_node_pointer current = pending.back();
+			pending.pop_back();
+			m_values.push_back(current->value());
+			if (current->right_child() != nullptr)
+				pending.push_back(current->right_child());
+			if (current->left_child() != nullptr)
+				pending.push_back(current->left_child());
+		}
+		build();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<typename InputIterator>
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::Quantized_KD_tree(InputIterator first, InputIterator last, const key_compare &compare)
+		: m_values(first, last), m_comp(compare)
+	{
+		build();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	void
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::build()
+	{
+		m_codes.resize(m_values.size() * Dim);
+		if (!m_values.empty())
+			build_op<0>(0, m_values.size());
+		m_nodes.shrink_to_fit();
+		m_grids.shrink_to_fit();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t N>
+	void
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::build_op(size_t begin, size_t end)
+	{
+		size_t index = m_nodes.size();
+		m_nodes.push_back(node{ tree_traits::val_to_key(m_values[begin]), begin, end, 0, 0 });
+
+		if (end - begin > bucket_size)
+		{
+			auto less = [this](const value_type &lhs, const value_type &rhs) { return m_comp.template compare<N>(tree_traits::val_to_key(lhs), tree_traits::val_to_key(rhs)); };
+			auto first = m_values.begin() + begin, last = m_values.begin() + end, median = first + (end - begin) / 2;
+			std::nth_element(first, median, last, less);
+			key_type pivot = tree_traits::val_to_key(*median);
+
+			//keys that are equal to the median in dimension N go right, since the left subtree only holds smaller keys
+			auto split = std::partition(first, median, [this, &pivot](const value_type &value) { return m_comp.template compare<N>(tree_traits::val_to_key(value), pivot); });
+			if (split == first)
+			{
+				//the lower half equals the median, so the equal keys go left and the split moves to the next larger key
+				split = std::partition(median, last, [this, &pivot](const value_type &value) { return !m_comp.template compare<N>(pivot, tree_traits::val_to_key(value)); });
+				if (split != last)
+					std::iter_swap(split, std::min_element(split, last, less));
+			}
+
+			//a bucket whose keys are all equal in dimension N is not split
+			if (split != first && split != last)
+			{
+				size_t middle = static_cast<size_t>(split - m_values.begin());
+				m_nodes[index].split = tree_traits::val_to_key(*split);
+				build_op<next_dim<N>()>(begin, middle);
+				m_nodes[index].right = m_nodes.size();
+				build_op<next_dim<N>()>(middle, end);
+				return;
+			}
+		}
+
+		m_nodes[index].grid = quantize(begin, end);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	size_t
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::quantize(size_t begin, size_t end)
+	{
+		coordinates_type min, max;
+		min.fill(std::numeric_limits<double>::infinity());
+		max.fill(-std::numeric_limits<double>::infinity());
+		for (size_t i = begin; i < end; ++i)
+		{
+			coordinates_type coords = coordinates(tree_traits::val_to_key(m_values[i]), std::make_index_sequence<Dim>());
+			for (size_t d = 0; d < Dim; ++d)
+			{
+				min[d] = std::min(min[d], coords[d]);
+				max[d] = std::max(max[d], coords[d]);
+			}
+		}
+
+		grid g{ min, {} };
+		for (size_t d = 0; d < Dim; ++d)
+		{
+			//the step is rounded up until the last cell reaches the largest coordinate
+			g.step[d] = (max[d] - min[d]) / double(levels());
+			while (cell_max(g, d, levels() - 1) < max[d])
+				g.step[d] = std::nextafter(g.step[d], std::numeric_limits<double>::infinity());
+		}
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			coordinates_type coords = coordinates(tree_traits::val_to_key(m_values[i]), std::make_index_sequence<Dim>());
+			for (size_t d = 0; d < Dim; ++d)
+			{
+				size_t code = 0;
+				if (g.step[d] > 0.0)
+				{
+					double cell = (coords[d] - min[d]) / g.step[d];
+					code = cell < double(levels() - 1) ? static_cast<size_t>(cell) : levels() - 1;
+				}
+				//the searches decode the cells with the same arithmetic, so rounding errors are fixed here and the cell always holds the coordinate
+				while (code > 0 && cell_min(g, d, code) > coords[d])
+					--code;
+				while (cell_max(g, d, code) < coords[d])
+					++code;
+				m_codes[i * Dim + d] = static_cast<Code>(code);
+			}
+		}
+
+		m_grids.push_back(g);
+		return m_grids.size() - 1;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	const typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::mapped_type&
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::at(const key_type &key) const
+	{
+		const value_type *value = find(key);
+		if (value == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(*value);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t N>
+	const typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::value_type*
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::find_op(size_t index, const key_type &key) const
+	{
+		const node &current = m_nodes[index];
+		if (current.right != 0)
+			return find_op<next_dim<N>()>(m_comp.template compare<N>(key, current.split) ? index + 1 : current.right, key);
+
+		for (size_t i = current.begin; i < current.end; ++i)
+		{
+			if (search_type::compare_keys(m_comp, tree_traits::val_to_key(m_values[i]), key))
+				return &m_values[i];
+		}
+		return nullptr;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::KNN_container_type
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		queue_type q(k);
+		if (!empty())
+			KNN_search_op<0>(0, distance, key, coordinates(key, std::make_index_sequence<Dim>()), q, pred, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t N, typename Distance_op, typename Predicate, typename Stats>
+	void
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::KNN_search_op(size_t index, Distance_op &distance, const key_type &key, const coordinates_type &coords,
+		queue_type &q, const Predicate &pred, Stats &stats) const
+	{
+		const node &current = m_nodes[index];
+		stats.enter_node();
+		if (current.right != 0)
+		{
+			bool go_left = m_comp.template compare<N>(key, current.split);
+			KNN_search_op<next_dim<N>()>(go_left ? index + 1 : current.right, distance, key, coords, q, pred, stats);
+
+			//the split key bounds the far side of the splitting hyperplane from either side
+			auto dist_to_plane = distance.template get_distance_to_plane<N>(current.split, key);
+			stats.plane_tested();
+			if (!q.full() || dist_to_plane < q.top().first)
+				KNN_search_op<next_dim<N>()>(go_left ? current.right : index + 1, distance, key, coords, q, pred, stats);
+			else
+				stats.subtree_pruned();
+		}
+		else
+		{
+			const grid &g = m_grids[current.grid];
+			coordinates_type min, max;
+			//only a full queue has a bound that the box of the bucket and the cells can be tested against
+			if (q.full())
+			{
+				for (size_t d = 0; d < Dim; ++d)
+					max[d] = cell_max(g, d, levels() - 1);
+				stats.plane_tested();
+				if (!(box_distance(distance, key, coords, g.min, max, std::make_index_sequence<Dim>()) < q.top().first))
+				{
+					stats.subtree_pruned();
+					stats.leave_node();
+					return;
+				}
+			}
+
+			for (size_t i = current.begin; i < current.end; ++i)
+			{
+				if (q.full())
+				{
+					const Code *codes = &m_codes[i * Dim];
+					for (size_t d = 0; d < Dim; ++d)
+					{
+						min[d] = cell_min(g, d, codes[d]);
+						max[d] = cell_max(g, d, codes[d]);
+					}
+					stats.plane_tested();
+					if (!(box_distance(distance, key, coords, min, max, std::make_index_sequence<Dim>()) < q.top().first))
+					{
+						stats.subtree_pruned();
+						continue;
+					}
+				}
+
+				const value_type &value = m_values[i];
+				if (!pred(value))
+					continue;
+				auto radius = distance.get_cartesian_distance(tree_traits::val_to_key(value), key);
+				stats.distance_evaluated();
+				if (q.full() && radius < q.top().first)
+					stats.queue_replaced();
+				q.push(KNN_type{ radius, &tree_traits::val_to_mapped(value) });
+			}
+		}
+		stats.leave_node();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<typename Distance_op, size_t... I>
+	double
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::box_distance(Distance_op &distance, const key_type &key, const coordinates_type &coords,
+		const coordinates_type &min, const coordinates_type &max, std::index_sequence<I...>)
+	{
+		//the nearest point of the box only differs from key in the dimensions in which key lies outside of the box,
+		//and in those it is at most as far from key as any point inside
+		return distance.get_cartesian_distance(key_type(nearest_bound<I>(key, coords, min[I], max[I])...), key);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t I>
+	typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::template element_type<I>
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::nearest_bound(const key_type &key, const coordinates_type &coords, double min, double max)
+	{
+		if (coords[I] < min)
+			return detail::cell_bound<element_type<I>>(min, false);
+		else if (coords[I] > max)
+			return detail::cell_bound<element_type<I>>(max, true);
+		else
+			return key_type::template get<I>(key);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<typename Stats>
+	typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::range_container_type
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		if (!empty())
+			range_search_op<0>(0, lower, upper, result, stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t N, typename Stats>
+	void
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::range_search_op(size_t index, const key_type &lower, const key_type &upper, range_container_type &result, Stats &stats) const
+	{
+		const node &current = m_nodes[index];
+		stats.enter_node();
+		if (current.right != 0)
+		{
+			//the left subtree only holds keys that are smaller than the split key in dimension N
+			stats.plane_tested();
+			if (m_comp.template compare<N>(lower, current.split))
+				range_search_op<next_dim<N>()>(index + 1, lower, upper, result, stats);
+			else
+				stats.subtree_pruned();
+			//the right subtree only holds keys that are not smaller than the split key in dimension N
+			stats.plane_tested();
+			if (!m_comp.template compare<N>(upper, current.split))
+				range_search_op<next_dim<N>()>(current.right, lower, upper, result, stats);
+			else
+				stats.subtree_pruned();
+		}
+		else
+		{
+			const grid &g = m_grids[current.grid];
+			for (size_t i = current.begin; i < current.end; ++i)
+			{
+				const Code *codes = &m_codes[i * Dim];
+				stats.plane_tested();
+				cell_overlap overlap = overlap_op<0>(cell_corner(g, codes, false, std::make_index_sequence<Dim>()),
+					cell_corner(g, codes, true, std::make_index_sequence<Dim>()), lower, upper);
+				//the full precision key is only read when the range cuts through its cell
+				if (overlap == cell_overlap::full || (overlap == cell_overlap::partial && search_type::in_range(m_comp, tree_traits::val_to_key(m_values[i]), lower, upper)))
+					result.push_back(&m_values[i]);
+				else if (overlap == cell_overlap::none)
+					stats.subtree_pruned();
+			}
+		}
+		stats.leave_node();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t... I>
+	typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::key_type
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::cell_corner(const grid &g, const Code *codes, bool upper, std::index_sequence<I...>)
+	{
+		return key_type(detail::cell_bound<element_type<I>>(upper ? cell_max(g, I, codes[I]) : cell_min(g, I, codes[I]), upper)...);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Code>
+	template<size_t N>
+	typename Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::cell_overlap
+	Quantized_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Code>::overlap_op(const key_type &cell_lower, const key_type &cell_upper, const key_type &lower, const key_type &upper) const
+	{
+		//the comparison may order the coordinates in either direction, so both corners are tested against both ends of the range
+		bool lower_below = m_comp.template compare<N>(cell_lower, lower), upper_below = m_comp.template compare<N>(cell_upper, lower);
+		bool lower_above = m_comp.template compare<N>(upper, cell_lower), upper_above = m_comp.template compare<N>(upper, cell_upper);
+		if ((lower_below && upper_below) || (lower_above && upper_above))
+			return cell_overlap::none;
+
+		cell_overlap rest = N + 1 < Dim ? overlap_op<next_dim<N>()>(cell_lower, cell_upper, lower, upper) : cell_overlap::full;
+		if (rest == cell_overlap::full && (lower_below || upper_below || lower_above || upper_above))
+			return cell_overlap::partial;
+		return rest;
+	}
+}
@@ -0,0 +1,438 @@
+#pragma once
+#include "KD_tree_stats.h"
+#include "Priority_queue.h"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace BK_KD_tree
+{
+	//A KNN search strategy that expands the pending subtree with the smallest lower bound distance first.
+	//It stops after visiting max_nodes nodes (0 for no limit), in which case the result is approximate.
+	struct Best_first
+	{
+		explicit Best_first(size_t max_nodes = 0) : max_nodes(max_nodes) {}
+		size_t max_nodes;
+	};
+
+	namespace detail
+	{
+		//A node filter that accepts every node
+		struct accept_all
+		{
+			template<typename NodePointer>
+			bool operator()(const NodePointer&) const { return true; }
+		};
+
+		//A node filter that accepts the nodes accepted by Filter whose values satisfy a predicate on value_type
+		template<typename Predicate, typename Filter = accept_all>
+		struct value_filter
+		{
+			const Predicate &pred;
+			Filter filter;
+
+			value_filter(const Predicate &predicate, Filter node_filter = Filter()) : pred(predicate), filter(node_filter) {}
+
+			template<typename NodePointer>
+			bool operator()(const NodePointer &node) const { return filter(node) && pred(node->value()); }
+		};
+
+		//Read-only traversals shared by every tree representation whose nodes expose value(), left_child() and right_child().
+		//NodePointer may be a pointer to a heap-allocated KD_tree_node or to a KD_tree_static_node.
+		//Nodes rejected by the Filter are still traversed, but their values are not reported.
+		//Every step of the traversal is reported to the Stats policy (see KD_tree_stats.h).
+		template<typename Traits>
+		class KD_tree_search
+		{
+		public:
+			typedef typename Traits::key_type		key_type;
+			typedef typename Traits::value_type		value_type;
+			typedef typename Traits::key_compare	key_compare;
+			static constexpr size_t Dim = Traits::Dimension;
+
+			//Advances the dimension index
+			template<size_t N>
+			static constexpr size_t next_dim() { return (N + 1) % Dim; }
+
+			//Tests two keys for equality
+			template<size_t N = 0>
+			static bool compare_keys(const key_compare &comp, const key_type &lhs, const key_type &rhs);
+			//Tests whether lower <= key <= upper holds in every dimension
+			template<size_t N = 0>
+			static bool in_range(const key_compare &comp, const key_type &key, const key_type &lower, const key_type &upper);
+
+			//Returns the node with the given key or nullptr
+			template<size_t N, typename NodePointer>
+			static NodePointer find_op(NodePointer current, const key_compare &comp, const key_type &key);
+			//Depth first KNN search that fills a bounded priority queue
+			template<size_t N, typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+			static void KNN_search_op(NodePointer current, const key_compare &comp, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats);
+			//Appends a pointer to every value with lower <= key <= upper to result
+			template<size_t N, typename NodePointer, typename Container, typename Filter, typename Stats>
+			static void range_search_op(NodePointer current, const key_compare &comp, const key_type &lower, const key_type &upper, Container &result, const Filter &filter, Stats &stats);
+			//Appends a (distance, mapped pointer) pair for every value at most radius away from key to result
+			template<size_t N, typename NodePointer, typename Distance_op, typename Container, typename Filter, typename Stats>
+			static void radius_search_op(NodePointer current, const key_compare &comp, Distance_op &distance, const key_type &key, double radius, Container &result, const Filter &filter, Stats &stats);
+			//Linear scans that do the work of KNN_search_op and range_search_op over an array of keys and an array of their nodes.
+			//A node is only dereferenced once its key qualifies for the result.
+			template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+			static void KNN_scan_op(const key_type *keys, const NodePointer *nodes, size_t count, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats);
+			template<typename NodePointer, typename Container, typename Filter, typename Stats>
+			static void range_scan_op(const key_type *keys, const NodePointer *nodes, size_t count, const key_compare &comp, const key_type &lower, const key_type &upper, Container &result, const Filter &filter, Stats &stats);
+			//Best first KNN search that fills a bounded priority queue
+			template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+			static void KNN_best_first_op(NodePointer root, const key_compare &comp, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats, const Best_first &strategy);
+
+			//Calls visitor.visit<N>(args...) for a dimension index n that is only known at runtime
+			template<typename Visitor, typename... Args>
+			static void dispatch_dim(size_t n, Visitor &visitor, Args... args) { dispatch_dim_op(n, visitor, std::make_index_sequence<Dim>(), args...); }
+
+		private:
+			template<typename Visitor, size_t... I, typename... Args>
+			static void dispatch_dim_op(size_t n, Visitor &visitor, std::index_sequence<I...>, Args... args);
+			template<size_t N, typename Visitor, typename... Args>
+			static void visit_op(Visitor &visitor, Args... args) { visitor.template visit<N>(args...); }
+
+			template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+			class best_first_visitor;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		//The state of a best first search. The frontier holds the subtrees that have not been expanded yet, keyed by a lower bound
+		//of the distance from the test point to any point inside them.
+		template<typename Traits>
+		template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		class KD_tree_search<Traits>::best_first_visitor
+		{
+		public:
+			typedef typename Queue::value_type::first_type bound_type;
+
+			best_first_visitor(const key_compare &comp, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats, size_t max_nodes)
+				: comp(comp), distance(distance), key(key), q(q), filter(filter), stats(stats), max_nodes(max_nodes), visited(0),
+				frontier(frontier_container(typename frontier_container::allocator_type(q.data().get_allocator()))) {}
+
+			void run(NodePointer root);
+
+			//Descends from a subtree root to a leaf along the side of the test point and queues the other sides
+			template<size_t N>
+			void visit(NodePointer current, bound_type bound);
+
+		private:
+			struct pending
+			{
+				bound_type bound;
+				NodePointer node;
+				size_t dim;
+			};
+			//Orders the frontier so that its top holds the smallest bound
+			struct pending_compare
+			{
+				bool operator()(const pending &lhs, const pending &rhs) const { return rhs.bound < lhs.bound; }
+			};
+			//the frontier allocates like the container of the queue
+			typedef std::vector<pending, typename std::allocator_traits<typename Queue::container_type::allocator_type>::template rebind_alloc<pending>> frontier_container;
+
+			bool exhausted() const { return max_nodes > 0 && visited >= max_nodes; }
+			//Tests whether a subtree with the given bound can hold a point closer than the current k-th nearest point
+			bool may_improve(bound_type bound) const { return !q.full() || bound < q.top().first; }
+
+			const key_compare &comp;
+			Distance_op &distance;
+			const key_type &key;
+			Queue &q;
+			const Filter &filter;
+			Stats &stats;
+			size_t max_nodes;
+			size_t visited;
+			BK_heap::Priority_queue<pending, frontier_container, pending_compare> frontier;
+		};
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N>
+		bool
+		KD_tree_search<Traits>::compare_keys(const key_compare &comp, const key_type &lhs, const key_type &rhs)
+		{
+			//if the current dimensions compare equal
+			if (!comp.template compare<N>(lhs, rhs) && !comp.template compare<N>(rhs, lhs))
+			{
+				//if N is not the last dimension
+				if (N + 1 < Dim)
+					return compare_keys<next_dim<N>()>(comp, lhs, rhs);
+				else //the end of the key has been reached and all dimensions compare equal
+					return true;
+			}
+			else //a pair of nonequal dimensions has been found
+				return false;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N>
+		bool
+		KD_tree_search<Traits>::in_range(const key_compare &comp, const key_type &key, const key_type &lower, const key_type &upper)
+		{
+			if (comp.template compare<N>(key, lower) || comp.template compare<N>(upper, key))
+				return false;
+			else if (N + 1 < Dim)
+				return in_range<next_dim<N>()>(comp, key, lower, upper);
+			else
+				return true;
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N, typename NodePointer>
+		NodePointer
+		KD_tree_search<Traits>::find_op(NodePointer current, const key_compare &comp, const key_type &key)
+		{
+			if (current == nullptr || compare_keys(comp, Traits::val_to_key(current->value()), key))
+				return current;
+			else if (comp.template compare<N>(key, Traits::val_to_key(current->value())))
+				return find_op<next_dim<N>()>(current->left_child(), comp, key);
+			else
+				return find_op<next_dim<N>()>(current->right_child(), comp, key);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N, typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::KNN_search_op(NodePointer current, const key_compare &comp, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats)
+		{
+			//if a null node has been reached
+			if (current == nullptr)
+				return;
+
+			stats.enter_node();
+			if (filter(current))
+			{
+				//compute the distance from the current point to the test point (key)
+				auto radius = distance.get_cartesian_distance(Traits::val_to_key(current->value()), key);
+				stats.distance_evaluated();
+				if (q.full() && radius < q.top().first)
+					stats.queue_replaced();
+				//push the result to the bounded priority queue
+				q.push(typename Queue::value_type{ radius, &Traits::val_to_mapped(current->value()) });
+			}
+
+			//recursively traverse the tree in the direction of the test point
+			bool go_left = comp.template compare<N>(key, Traits::val_to_key(current->value()));
+			KNN_search_op<next_dim<N>()>(go_left ? current->left_child() : current->right_child(), comp, distance, key, q, filter, stats);
+
+			NodePointer far_child = go_left ? current->right_child() : current->left_child();
+			if (far_child != nullptr)
+			{
+				//once a leaf has been reached, compute the distance to the test point
+				auto dist_to_plane = distance.template get_distance_to_plane<N>(Traits::val_to_key(current->value()), key);
+				stats.plane_tested();
+				//if the queue is not full, or if the distance is smaller than the current largest distance in the queue
+				if (!q.full() || dist_to_plane < q.top().first)
+				{
+					//check the other side of the splitting hyperplane for points that are closer
+					KNN_search_op<next_dim<N>()>(far_child, comp, distance, key, q, filter, stats);
+				}
+				else
+					stats.subtree_pruned();
+			}
+			stats.leave_node();
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N, typename NodePointer, typename Container, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::range_search_op(NodePointer current, const key_compare &comp, const key_type &lower, const key_type &upper, Container &result, const Filter &filter, Stats &stats)
+		{
+			if (current == nullptr)
+				return;
+
+			stats.enter_node();
+			const key_type &current_key = Traits::val_to_key(current->value());
+			if (in_range(comp, current_key, lower, upper) && filter(current))
+				result.push_back(&current->value());
+
+			//the left subtree only holds keys that are smaller than the current key in dimension N
+			stats.plane_tested();
+			if (comp.template compare<N>(lower, current_key))
+				range_search_op<next_dim<N>()>(current->left_child(), comp, lower, upper, result, filter, stats);
+			else if (current->left_child() != nullptr)
+				stats.subtree_pruned();
+			//the right subtree only holds keys that are not smaller than the current key in dimension N
+			stats.plane_tested();
+			if (!comp.template compare<N>(upper, current_key))
+				range_search_op<next_dim<N>()>(current->right_child(), comp, lower, upper, result, filter, stats);
+			else if (current->right_child() != nullptr)
+				stats.subtree_pruned();
+			stats.leave_node();
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<size_t N, typename NodePointer, typename Distance_op, typename Container, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::radius_search_op(NodePointer current, const key_compare &comp, Distance_op &distance, const key_type &key, double radius, Container &result, const Filter &filter, Stats &stats)
+		{
+			if (current == nullptr)
+				return;
+
+			stats.enter_node();
+			const key_type &current_key = Traits::val_to_key(current->value());
+			if (filter(current))
+			{
+				auto dist = distance.get_cartesian_distance(current_key, key);
+				stats.distance_evaluated();
+				if (!(radius < dist))
+					result.push_back(typename Container::value_type{ dist, &Traits::val_to_mapped(current->value()) });
+			}
+
+			bool go_left = comp.template compare<N>(key, current_key);
+			radius_search_op<next_dim<N>()>(go_left ? current->left_child() : current->right_child(), comp, distance, key, radius, result, filter, stats);
+
+			NodePointer far_child = go_left ? current->right_child() : current->left_child();
+			if (far_child != nullptr)
+			{
+				//unlike a KNN search, the bound of the other side does not shrink during the search
+				stats.plane_tested();
+				if (!(radius < distance.template get_distance_to_plane<N>(current_key, key)))
+					radius_search_op<next_dim<N>()>(far_child, comp, distance, key, radius, result, filter, stats);
+				else
+					stats.subtree_pruned();
+			}
+			stats.leave_node();
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::KNN_scan_op(const key_type *keys, const NodePointer *nodes, size_t count, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats)
+		{
+			//every scanned key counts as a visited node
+			for (size_t i = 0; i < count; ++i)
+			{
+				stats.enter_node();
+				auto radius = distance.get_cartesian_distance(keys[i], key);
+				stats.distance_evaluated();
+				if (!(q.full() && !(radius < q.top().first)) && filter(nodes[i]))
+				{
+					if (q.full())
+						stats.queue_replaced();
+					q.push(typename Queue::value_type{ radius, &Traits::val_to_mapped(nodes[i]->value()) });
+				}
+				stats.leave_node();
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename NodePointer, typename Container, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::range_scan_op(const key_type *keys, const NodePointer *nodes, size_t count, const key_compare &comp, const key_type &lower, const key_type &upper, Container &result, const Filter &filter, Stats &stats)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				stats.enter_node();
+				if (in_range(comp, keys[i], lower, upper) && filter(nodes[i]))
+					result.push_back(&nodes[i]->value());
+				stats.leave_node();
+			}
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::KNN_best_first_op(NodePointer root, const key_compare &comp, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats, const Best_first &strategy)
+		{
+			best_first_visitor<NodePointer, Distance_op, Queue, Filter, Stats> visitor(comp, distance, key, q, filter, stats, strategy.max_nodes);
+			visitor.run(root);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename Visitor, size_t... I, typename... Args>
+		void
+		KD_tree_search<Traits>::dispatch_dim_op(size_t n, Visitor &visitor, std::index_sequence<I...>, Args... args)
+		{
+			typedef void(*visit_type)(Visitor&, Args...);
+			static const visit_type table[] = { &visit_op<I, Visitor, Args...>... };
+			table[n](visitor, args...);
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		void
+		KD_tree_search<Traits>::best_first_visitor<NodePointer, Distance_op, Queue, Filter, Stats>::run(NodePointer root)
+		{
+			if (root != nullptr)
+				frontier.push(pending{ bound_type(), root, 0 });
+
+			while (!frontier.empty() && !exhausted())
+			{
+				pending next = frontier.top();
+				//the frontier is ordered by bound, so no pending subtree can improve the result once the closest one cannot
+				if (!may_improve(next.bound))
+					break;
+				frontier.pop();
+				dispatch_dim(next.dim, *this, next.node, next.bound);
+			}
+
+			for (size_t i = 0; i < frontier.size(); ++i)
+				stats.subtree_pruned();
+		}
+
+		//---------------------------------------------------------------------------------------------
+
+		template<typename Traits>
+		template<typename NodePointer, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		template<size_t N>
+		void
+		KD_tree_search<Traits>::best_first_visitor<NodePointer, Distance_op, Queue, Filter, Stats>::visit(NodePointer current, bound_type bound)
+		{
+			if (current == nullptr || exhausted())
+				return;
+
+			++visited;
+			stats.enter_node();
+			if (filter(current))
+			{
+				auto radius = distance.get_cartesian_distance(Traits::val_to_key(current->value()), key);
+				stats.distance_evaluated();
+				if (q.full() && radius < q.top().first)
+					stats.queue_replaced();
+				q.push(typename Queue::value_type{ radius, &Traits::val_to_mapped(current->value()) });
+			}
+
+			bool go_left = comp.template compare<N>(key, Traits::val_to_key(current->value()));
+			NodePointer far_child = go_left ? current->right_child() : current->left_child();
+			if (far_child != nullptr)
+			{
+				//every point on the other side of the splitting hyperplane is at least as far as the plane and the bound of this subtree
+				bound_type dist_to_plane = distance.template get_distance_to_plane<N>(Traits::val_to_key(current->value()), key);
+				stats.plane_tested();
+				bound_type far_bound = bound < dist_to_plane ? dist_to_plane : bound;
+				if (may_improve(far_bound))
+					frontier.push(pending{ far_bound, far_child, next_dim<N>() });
+				else
+					stats.subtree_pruned();
+			}
+
+			visit<next_dim<N>()>(go_left ? current->left_child() : current->right_child(), bound);
+			stats.leave_node();
+		}
+	} //namespace detail
+}
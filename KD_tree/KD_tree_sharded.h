@@ -0,0 +1,537 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A KD-Tree split into independent shards that threads can read and change at the same time. The space is partitioned once,
+	//at construction, by the top levels of a KD-Tree over a sample of keys: every leaf of this partition tree is a shard, which is a
+	//KD_tree guarded by its own lock. Inserts and erases lock only the shard that owns the key, and queries descend the partition tree
+	//like a search of the tree below it, so they only lock the shards they can reach. All shards of a KNN search fill one bounded priority queue.
+	//Another thread may erase or overwrite a value as soon as its shard is unlocked, so searches copy the values they find while the shard
+	//is locked, and their results hold copies of the values instead of pointers.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	class Sharded_KD_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef typename std::pair<double, mapped_type>			KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+		typedef typename std::vector<value_type>				range_container_type;
+		typedef KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_type;
+
+		//Splits the space into up to the given number of shards, at the quantiles of the keys of a range of values, and inserts the values.
+		//There are never more shards than values, so a tree built from an empty range has one shard.
+		template<typename InputIterator>
+		Sharded_KD_tree(size_t shards, InputIterator first, InputIterator last, const key_compare &compare = key_compare());
+
+		Sharded_KD_tree(const Sharded_KD_tree&) = delete;
+		Sharded_KD_tree& operator=(const Sharded_KD_tree&) = delete;
+
+		//Inserts a value or overwrites the mapped value of an existing key. Returns true if a new key was inserted.
+		bool insert(const value_type &value) { return insert_op(value_type(value)); }
+		bool insert(value_type &&value) { return insert_op(std::move(value)); }
+		template<typename... Coords>
+		bool insert(const mapped_type &mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped }); }
+		template<typename... Coords>
+		bool insert(mapped_type &&mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) }); }
+		size_t erase(const key_type &key);
+		//Inserts a range of values. The shards are filled by a number of threads (0 for one per hardware thread), one shard per thread at a time.
+		//Bit i of the result is set if value i inserted a new key and cleared if it overwrote one.
+		template<typename InputIterator>
+		std::vector<bool> insert_batch(InputIterator first, InputIterator last, size_t threads = 1);
+		//Erases a range of keys like insert_batch. Bit i of the result is set if key i was found and erased.
+		template<typename InputIterator>
+		std::vector<bool> erase_batch(InputIterator first, InputIterator last, size_t threads = 1);
+
+		//Returns a copy of the mapped value, since another thread may erase the value
+		mapped_type at(const key_type &key) const;
+		bool contains(const key_type &key) const;
+
+		bool empty() const { return size() == 0; }
+		size_t size() const;
+		static constexpr size_t dimension() { return Dim; }
+		size_t shards() const { return m_shards.size(); }
+		//The number of values in every shard
+		std::vector<size_t> shard_sizes() const;
+		void clear();
+
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		range_container_type range_search(const key_type &lower, const key_type &upper) const { No_stats stats; return range_search(lower, upper, stats); }
+		//Report every step of the query to a stats policy such as Search_stats
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const { return KNN_search_if(k, distance, key, detail::accept_all(), stats); }
+		//Finds the k nearest values that satisfy pred, which is called on value_type before a value enters the result
+		template<typename Distance_op, typename Predicate>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred) const { No_stats stats; return KNN_search_if(k, distance, key, pred, stats); }
+		template<typename Distance_op, typename Predicate, typename Stats>
+		KNN_container_type KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const;
+		template<typename Stats>
+		range_container_type range_search(const key_type &lower, const key_type &upper, Stats &stats) const;
+
+	private:
+		typedef typename tree_type::node_type node_type;
+		typedef typename tree_type::node_pointer node_pointer;
+		typedef typename tree_type::const_node_pointer const_node_pointer;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+		typedef std::shared_timed_mutex mutex_type;
+
+		//A bounded priority queue that copies the mapped value of every candidate it accepts. The search pushes pointers while the shard
+		//of the candidate is locked, and the copy outlives the lock.
+		class copying_queue
+		{
+		public:
+			typedef std::pair<double, const mapped_type*> value_type;
+
+			explicit copying_queue(size_t k) : q(k) {}
+
+			bool full() const { return q.full(); }
+			const KNN_type& top() const { return q.top(); }
+			void push(const value_type &val) { if (!q.full() || val.first < q.top().first) q.push(KNN_type(val.first, *val.second)); }
+			KNN_container_type& data() { return q.data(); }
+
+		private:
+			detail::bounded_priority_queue<KNN_type, KNN_container_type> q;
+		};
+
+		//A node of the partition tree. Keys smaller than split in the dimension of the node's depth belong to the left side.
+		struct split_node
+		{
+			key_type		split;
+			std::int64_t	left, right;	//the index of a child node, or -1 - s for shard s
+		};
+
+		//The padding keeps the lock and the tree of different shards out of each other's cache lines
+		struct shard
+		{
+			explicit shard(const key_compare &compare) : tree(compare), count(0) {}
+
+			mutable mutex_type	lock;
+			tree_type			tree;
+			size_t				count;
+			char				padding[64];
+		};
+
+		std::vector<split_node>				m_nodes;
+		std::vector<std::unique_ptr<shard>>	m_shards;
+		key_compare							m_comp;
+
+		template<size_t N>
+		static constexpr size_t next_dim() { return (N + 1) % Dim; }
+		static size_t shard_index(std::int64_t child) { return static_cast<size_t>(-1 - child); }
+
+		//Partitions [begin, end) among up to shards shards, numbered from the current number of shards, and returns the child that holds them
+		template<size_t N>
+		std::int64_t build_op(key_type *begin, key_type *end, size_t shards);
+		//Returns the shard that owns a key
+		size_t route(const key_type &key) const { return m_nodes.empty() ? 0 : route_op<0>(0, key); }
+		template<size_t N>
+		size_t route_op(std::int64_t child, const key_type &key) const;
+		template<typename Value>
+		bool insert_op(Value &&value);
+		//Calls task(s) for every shard s on a number of threads
+		template<typename Task>
+		void for_each_shard(size_t threads, Task task);
+		template<size_t N, typename Distance_op, typename Queue, typename Filter, typename Stats>
+		void KNN_search_op(std::int64_t child, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats) const;
+		template<size_t N, typename Stats>
+		void range_search_op(std::int64_t child, const key_type &lower, const key_type &upper, range_container_type &result, Stats &stats) const;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::Sharded_KD_tree(size_t shards, InputIterator first, InputIterator last, const key_compare &compare)
+		: m_comp(compare)
+	{
+		std::vector<value_type> values(first, last);
+		std::vector<key_type> keys;
+		keys.reserve(values.size());
+		for (auto it = values.begin(), end_it = values.end(); it != end_it; ++it)
+			keys.push_back(tree_traits::val_to_key(*it));
+
+		shards = std::max<size_t>(1, std::min(shards, keys.size()));
+		if (shards > 1)
+			build_op<0>(keys.data(), keys.data() + keys.size(), shards);
+		else
+			m_shards.emplace_back(new shard(m_comp));
+
+		insert_batch(std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N>
+	std::int64_t
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::build_op(key_type *begin, key_type *end, size_t shards)
+	{
+		size_t count = static_cast<size_t>(end - begin);
+		if (shards <= 1 || count <= 1)
+		{
+			m_shards.emplace_back(new shard(m_comp));
+			return -1 - static_cast<std::int64_t>(m_shards.size() - 1);
+		}
+
+		//split at the quantile that gives each side its share of the shards
+		const key_compare &comp = m_comp;
+		size_t left_shards = shards / 2;
+		key_type *quantile = begin + count * left_shards / shards;
+		std::nth_element(begin, quantile, end, [&comp](const key_type &lhs, const key_type &rhs) { return comp.template compare<N>(lhs, rhs); });
+		key_type split = *quantile;
+		//keys equal to the split in dimension N go right, as in the tree
+		key_type *middle = std::partition(begin, end, [&comp, &split](const key_type &key) { return comp.template compare<N>(key, split); });
+
+		std::int64_t index = static_cast<std::int64_t>(m_nodes.size());
+		m_nodes.push_back(split_node{ split, 0, 0 });
+		std::int64_t left = build_op<next_dim<N>()>(begin, middle, std::min(left_shards, std::max<size_t>(1, static_cast<size_t>(middle - begin))));
+		std::int64_t right = build_op<next_dim<N>()>(middle, end, shards - left_shards);
+		m_nodes[static_cast<size_t>(index)].left = left;
+		m_nodes[static_cast<size_t>(index)].right = right;
+		return index;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N>
+	size_t
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::route_op(std::int64_t child, const key_type &key) const
+	{
+		if (child < 0)
+			return shard_index(child);
+
+		const split_node &current = m_nodes[static_cast<size_t>(child)];
+		return route_op<next_dim<N>()>(m_comp.template compare<N>(key, current.split) ? current.left : current.right, key);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Value>
+	bool
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert_op(Value &&value)
+	{
+		shard &owner = *m_shards[route(tree_traits::val_to_key(value))];
+		std::unique_lock<mutex_type> lock(owner.lock);
+
+		node_pointer &insert_loc = owner.tree.template insert_loc_op<0>(owner.tree.m_root, tree_traits::val_to_key(value));
+		if (insert_loc != nullptr)
+		{
+			insert_loc->value() = std::forward<Value>(value);
+			return false;
+		}
+		insert_loc = new node_type(std::forward<Value>(value));
+		owner.tree.linked_op(insert_loc);
+		++owner.count;
+		return true;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	size_t
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase(const key_type &key)
+	{
+		shard &owner = *m_shards[route(key)];
+		std::unique_lock<mutex_type> lock(owner.lock);
+
+		size_t erased = owner.tree.erase(key);
+		owner.count -= erased;
+		return erased;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Task>
+	void
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::for_each_shard(size_t threads, Task task)
+	{
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		threads = std::min(threads, m_shards.size());
+		if (threads <= 1)
+		{
+			for (size_t s = 0; s < m_shards.size(); ++s)
+				task(s);
+			return;
+		}
+
+		//the shards are taken in order by whichever thread is free
+		std::atomic<size_t> next(0);
+		std::vector<std::exception_ptr> errors(threads);
+		std::vector<std::thread> workers;
+		for (size_t w = 0; w < threads; ++w)
+		{
+			workers.emplace_back([this, &task, &next, &errors, w]
+			{
+				try
+				{
+					for (size_t s = next++; s < m_shards.size(); s = next++)
+						task(s);
+				}
+				catch (...)
+				{
+					errors[w] = std::current_exception();
+					next = m_shards.size();
+				}
+			});
+		}
+		for (auto &worker : workers)
+			worker.join();
+
+		for (auto &error : errors)
+		{
+			if (error)
+				std::rethrow_exception(error);
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	std::vector<bool>
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::insert_batch(InputIterator first, InputIterator last, size_t threads)
+	{
+		//deal the values to their shards, remembering where each came from
+		std::vector<std::vector<value_type>> values(m_shards.size());
+		std::vector<std::vector<size_t>> positions(m_shards.size());
+		size_t count = 0;
+		for (; first != last; ++first, ++count)
+		{
+			value_type value(*first);
+			size_t s = route(tree_traits::val_to_key(value));
+			values[s].push_back(std::move(value));
+			positions[s].push_back(count);
+		}
+
+		std::vector<bool> result(count, false);
+		std::vector<std::vector<bool>> inserted(m_shards.size());
+		for_each_shard(threads, [this, &values, &inserted](size_t s)
+		{
+			shard &owner = *m_shards[s];
+			std::unique_lock<mutex_type> lock(owner.lock);
+			inserted[s] = owner.tree.insert_batch(std::make_move_iterator(values[s].begin()), std::make_move_iterator(values[s].end()));
+			owner.count += static_cast<size_t>(std::count(inserted[s].begin(), inserted[s].end(), true));
+		});
+
+		for (size_t s = 0; s < m_shards.size(); ++s)
+		{
+			for (size_t i = 0; i < positions[s].size(); ++i)
+				result[positions[s][i]] = inserted[s][i];
+		}
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename InputIterator>
+	std::vector<bool>
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::erase_batch(InputIterator first, InputIterator last, size_t threads)
+	{
+		std::vector<std::vector<key_type>> keys(m_shards.size());
+		std::vector<std::vector<size_t>> positions(m_shards.size());
+		size_t count = 0;
+		for (; first != last; ++first, ++count)
+		{
+			key_type key(*first);
+			size_t s = route(key);
+			keys[s].push_back(std::move(key));
+			positions[s].push_back(count);
+		}
+
+		std::vector<bool> result(count, false);
+		std::vector<std::vector<bool>> erased(m_shards.size());
+		for_each_shard(threads, [this, &keys, &erased](size_t s)
+		{
+			shard &owner = *m_shards[s];
+			std::unique_lock<mutex_type> lock(owner.lock);
+			erased[s] = owner.tree.erase_batch(keys[s].begin(), keys[s].end());
+			owner.count -= static_cast<size_t>(std::count(erased[s].begin(), erased[s].end(), true));
+		});
+
+		for (size_t s = 0; s < m_shards.size(); ++s)
+		{
+			for (size_t i = 0; i < positions[s].size(); ++i)
+				result[positions[s][i]] = erased[s][i];
+		}
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	typename Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::mapped_type
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::at(const key_type &key) const
+	{
+		const shard &owner = *m_shards[route(key)];
+		std::shared_lock<mutex_type> lock(owner.lock);
+
+		const_node_pointer node = search_type::template find_op<0>(const_node_pointer(owner.tree.m_root), m_comp, key);
+		if (node == nullptr)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(node->value());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	bool
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::contains(const key_type &key) const
+	{
+		const shard &owner = *m_shards[route(key)];
+		std::shared_lock<mutex_type> lock(owner.lock);
+
+		return search_type::template find_op<0>(const_node_pointer(owner.tree.m_root), m_comp, key) != nullptr;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	size_t
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::size() const
+	{
+		size_t result = 0;
+		for (auto it = m_shards.begin(), end_it = m_shards.end(); it != end_it; ++it)
+		{
+			std::shared_lock<mutex_type> lock((*it)->lock);
+			result += (*it)->count;
+		}
+
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	std::vector<size_t>
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::shard_sizes() const
+	{
+		std::vector<size_t> result;
+		for (auto it = m_shards.begin(), end_it = m_shards.end(); it != end_it; ++it)
+		{
+			std::shared_lock<mutex_type> lock((*it)->lock);
+			result.push_back((*it)->count);
+		}
+
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	void
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::clear()
+	{
+		for (auto it = m_shards.begin(), end_it = m_shards.end(); it != end_it; ++it)
+		{
+			std::unique_lock<mutex_type> lock((*it)->lock);
+			(*it)->tree.clear();
+			(*it)->count = 0;
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Distance_op, typename Predicate, typename Stats>
+	typename Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_container_type
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_if(size_t k, Distance_op distance, const key_type &key, Predicate pred, Stats &stats) const
+	{
+		copying_queue q(k);
+		KNN_search_op<0>(m_nodes.empty() ? -1 : 0, distance, key, q, detail::value_filter<Predicate>{ pred }, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N, typename Distance_op, typename Queue, typename Filter, typename Stats>
+	void
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::KNN_search_op(std::int64_t child, Distance_op &distance, const key_type &key, Queue &q, const Filter &filter, Stats &stats) const
+	{
+		if (child < 0)
+		{
+			const shard &owner = *m_shards[shard_index(child)];
+			std::shared_lock<mutex_type> lock(owner.lock);
+			search_type::template KNN_search_op<0>(const_node_pointer(owner.tree.m_root), m_comp, distance, key, q, filter, stats);
+			return;
+		}
+
+		//the shards on the side of the key fill the queue first, and the other side is skipped if its splitting plane is too far
+		const split_node &current = m_nodes[static_cast<size_t>(child)];
+		bool go_left = m_comp.template compare<N>(key, current.split);
+		KNN_search_op<next_dim<N>()>(go_left ? current.left : current.right, distance, key, q, filter, stats);
+
+		auto dist_to_plane = distance.template get_distance_to_plane<N>(current.split, key);
+		stats.plane_tested();
+		if (!q.full() || dist_to_plane < q.top().first)
+			KNN_search_op<next_dim<N>()>(go_left ? current.right : current.left, distance, key, q, filter, stats);
+		else
+			stats.subtree_pruned();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<typename Stats>
+	typename Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_container_type
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search(const key_type &lower, const key_type &upper, Stats &stats) const
+	{
+		range_container_type result;
+		range_search_op<0>(m_nodes.empty() ? -1 : 0, lower, upper, result, stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl>
+	template<size_t N, typename Stats>
+	void
+	Sharded_KD_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl>::range_search_op(std::int64_t child, const key_type &lower, const key_type &upper, range_container_type &result, Stats &stats) const
+	{
+		if (child < 0)
+		{
+			//the values are copied before the shard is unlocked
+			std::vector<const value_type*> found;
+			const shard &owner = *m_shards[shard_index(child)];
+			std::shared_lock<mutex_type> lock(owner.lock);
+			search_type::template range_search_op<0>(const_node_pointer(owner.tree.m_root), m_comp, lower, upper, found, detail::accept_all(), stats);
+			for (auto it = found.begin(), end_it = found.end(); it != end_it; ++it)
+				result.push_back(**it);
+			return;
+		}
+
+		const split_node &current = m_nodes[static_cast<size_t>(child)];
+		if (m_comp.template compare<N>(lower, current.split))
+			range_search_op<next_dim<N>()>(current.left, lower, upper, result, stats);
+		else
+			stats.subtree_pruned();
+		if (!m_comp.template compare<N>(upper, current.split))
+			range_search_op<next_dim<N>()>(current.right, lower, upper, result, stats);
+		else
+			stats.subtree_pruned();
+	}
+}
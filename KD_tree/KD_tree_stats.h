@@ -0,0 +1,170 @@
+#pragma once
+#include <cstddef>
+#include <array>
+#include <vector>
+
+namespace BK_KD_tree
+{
+	//Stats policies are passed to the queries of the tree and receive a call for every step of the traversal.
+	//A custom policy (e.g. one that traces the visited nodes) must provide the same member functions as No_stats.
+
+	//The default policy; every hook is empty and compiles to nothing
+	struct No_stats
+	{
+		void enter_node() {}
+		void leave_node() {}
+		void distance_evaluated() {}
+		void plane_tested() {}
+		void subtree_pruned() {}
+		void queue_replaced() {}
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//Counts the work done by a single query. Call reset() before reusing an instance for the next query.
+	struct Search_stats
+	{
+		size_t nodes_visited = 0;
+		size_t distance_evaluations = 0;
+		size_t plane_tests = 0;
+		size_t pruned_subtrees = 0;
+		size_t max_depth = 0;
+		size_t queue_replacements = 0;
+
+		void enter_node()
+		{
+			++nodes_visited;
+			if (++depth > max_depth)
+				max_depth = depth;
+		}
+		void leave_node() { --depth; }
+		void distance_evaluated() { ++distance_evaluations; }
+		void plane_tested() { ++plane_tests; }
+		void subtree_pruned() { ++pruned_subtrees; }
+		void queue_replaced() { ++queue_replacements; }
+
+		void reset() { *this = Search_stats(); }
+
+	private:
+		size_t depth = 0;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//A histogram with power of two buckets: bucket 0 counts the value 0 and bucket i counts values in [2^(i-1), 2^i)
+	class Stats_histogram
+	{
+	public:
+		static constexpr size_t bucket_count = sizeof(size_t) * 8 + 1;
+
+		void add(size_t value);
+		void clear() { *this = Stats_histogram(); }
+
+		size_t count() const { return m_count; }
+		size_t max() const { return m_max; }
+		double mean() const { return m_count == 0 ? 0.0 : double(m_sum) / double(m_count); }
+		size_t operator[](size_t bucket) const { return m_buckets[bucket]; }
+		//Returns an upper bound of the value below which the given fraction (0 to 1) of the values lie
+		size_t percentile(double fraction) const;
+
+	private:
+		std::array<size_t, bucket_count> m_buckets{};
+		size_t m_count = 0;
+		size_t m_sum = 0;
+		size_t m_max = 0;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//Aggregates the stats of many queries
+	struct Search_stats_histogram
+	{
+		Stats_histogram nodes_visited;
+		Stats_histogram distance_evaluations;
+		Stats_histogram plane_tests;
+		Stats_histogram pruned_subtrees;
+		Stats_histogram max_depth;
+		Stats_histogram queue_replacements;
+
+		void record(const Search_stats &stats);
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	inline void Stats_histogram::add(size_t value)
+	{
+		size_t bucket = 0;
+		for (size_t v = value; v != 0; v >>= 1)
+			++bucket;
+
+		++m_buckets[bucket];
+		++m_count;
+		m_sum += value;
+		if (value > m_max)
+			m_max = value;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	inline size_t Stats_histogram::percentile(double fraction) const
+	{
+		size_t target = static_cast<size_t>(fraction * double(m_count) + 0.5), seen = 0;
+		for (size_t i = 0; i < bucket_count; ++i)
+		{
+			seen += m_buckets[i];
+			if (seen >= target && seen > 0)
+			{
+				if (i == 0)
+					return 0;
+				//the largest value in bucket i is 2^i - 1, but never report more than the largest value seen
+				size_t upper = i < bucket_count - 1 ? (size_t(1) << i) - 1 : m_max;
+				return upper < m_max ? upper : m_max;
+			}
+		}
+		return m_max;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	inline void Search_stats_histogram::record(const Search_stats &stats)
+	{
+		nodes_visited.add(stats.nodes_visited);
+		distance_evaluations.add(stats.distance_evaluations);
+		plane_tests.add(stats.plane_tests);
+		pruned_subtrees.add(stats.pruned_subtrees);
+		max_depth.add(stats.max_depth);
+		queue_replacements.add(stats.queue_replacements);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	//The shape and memory footprint of a tree. Depths count nodes, so the root has depth 1.
+	template<size_t Dim>
+	struct Tree_diagnostics
+	{
+		size_t node_count = 0;
+		size_t max_depth = 0;
+		double mean_depth = 0.0;
+		//depth_histogram[i] is the number of nodes at depth i + 1
+		std::vector<size_t> depth_histogram;
+		//splits[d] is the number of nodes with children that split dimension d
+		std::array<size_t, Dim> splits{};
+		//max_depth divided by the depth of a perfectly balanced tree of the same size; 1 is optimal
+		double balance_factor = 1.0;
+
+		//node_bytes includes the keys and mapped values stored in the nodes, but not memory they own (e.g. string buffers)
+		size_t node_bytes = 0;
+		size_t key_bytes = 0;
+		size_t mapped_bytes = 0;
+
+		//The mean number of nodes visited by a lookup of a stored key, for this tree and for a perfectly balanced tree
+		double estimated_query_cost = 0.0;
+		double balanced_query_cost = 0.0;
+
+		//The largest trees that KNN_search and range_search scan instead of traversing, and the size of the copy of the keys
+		//that they scan, which is 0 until a search makes it
+		size_t scan_limit = 0;
+		size_t range_scan_limit = 0;
+		size_t scan_bytes = 0;
+	};
+}
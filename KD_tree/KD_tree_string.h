@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+namespace BK_KD_tree
+{
+	namespace detail
+	{
+		//Packs the first 8 bytes of a string into an integer that orders like the bytes, padding a shorter string with zeros
+		inline std::uint64_t string_prefix(const std::string &str)
+		{
+			std::uint64_t prefix = 0;
+			for (size_t i = 0; i < 8; ++i)
+				prefix = (prefix << 8) | (i < str.size() ? static_cast<unsigned char>(str[i]) : 0u);
+			return prefix;
+		}
+
+		//Orders two strings with equal prefixes. Their first 8 bytes are equal, or the shorter one ends within them and the other one
+		//continues with zeros.
+		inline bool tail_less(const std::string &lhs, const std::string &rhs)
+		{
+			if (lhs.size() < 8 || rhs.size() < 8)
+				return lhs.size() < rhs.size();
+			return lhs.compare(8, std::string::npos, rhs, 8, std::string::npos) < 0;
+		}
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	//A string dimension that caches the first 8 bytes of the string in an integer, e.g. Type_wrapper<int, int, Prefixed_string>.
+	//Strings that differ in their first 8 bytes are ordered by one integer comparison, and only the rest of the strings is compared
+	//otherwise. It orders like std::string, so the default std::less predicate applies.
+	class Prefixed_string
+	{
+	public:
+		Prefixed_string() : m_prefix(0) {}
+		Prefixed_string(std::string str) : m_str(std::move(str)), m_prefix(detail::string_prefix(m_str)) {}
+		Prefixed_string(const char *str) : Prefixed_string(std::string(str)) {}
+
+		const std::string& str() const { return m_str; }
+		operator const std::string&() const { return m_str; }
+
+		friend bool operator<(const Prefixed_string &lhs, const Prefixed_string &rhs)
+		{
+			return lhs.m_prefix != rhs.m_prefix ? lhs.m_prefix < rhs.m_prefix : detail::tail_less(lhs.m_str, rhs.m_str);
+		}
+		friend bool operator==(const Prefixed_string &lhs, const Prefixed_string &rhs) { return lhs.m_prefix == rhs.m_prefix && lhs.m_str == rhs.m_str; }
+		friend bool operator!=(const Prefixed_string &lhs, const Prefixed_string &rhs) { return !(lhs == rhs); }
+		friend bool operator>(const Prefixed_string &lhs, const Prefixed_string &rhs) { return rhs < lhs; }
+		friend bool operator<=(const Prefixed_string &lhs, const Prefixed_string &rhs) { return !(rhs < lhs); }
+		friend bool operator>=(const Prefixed_string &lhs, const Prefixed_string &rhs) { return !(lhs < rhs); }
+
+	private:
+		std::string		m_str;
+		std::uint64_t	m_prefix;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//A string dimension for data with few distinct strings, e.g. categories. Every distinct string is stored once in a process wide pool,
+	//and a key holds a pointer to it and the prefix of Prefixed_string, so equal strings compare equal by their pointers and most others
+	//by their prefixes. It orders like std::string. The pool keeps every string until the process exits.
+	class Interned_string
+	{
+	public:
+		Interned_string() : m_str(empty()), m_prefix(0) {}
+		Interned_string(const std::string &str) : m_str(intern(str)), m_prefix(detail::string_prefix(str)) {}
+		Interned_string(const char *str) : Interned_string(std::string(str)) {}
+
+		const std::string& str() const { return *m_str; }
+		operator const std::string&() const { return *m_str; }
+
+		friend bool operator<(const Interned_string &lhs, const Interned_string &rhs)
+		{
+			if (lhs.m_str == rhs.m_str)
+				return false;
+			return lhs.m_prefix != rhs.m_prefix ? lhs.m_prefix < rhs.m_prefix : detail::tail_less(*lhs.m_str, *rhs.m_str);
+		}
+		friend bool operator==(const Interned_string &lhs, const Interned_string &rhs) { return lhs.m_str == rhs.m_str; }
+		friend bool operator!=(const Interned_string &lhs, const Interned_string &rhs) { return lhs.m_str != rhs.m_str; }
+		friend bool operator>(const Interned_string &lhs, const Interned_string &rhs) { return rhs < lhs; }
+		friend bool operator<=(const Interned_string &lhs, const Interned_string &rhs) { return !(rhs < lhs); }
+		friend bool operator>=(const Interned_string &lhs, const Interned_string &rhs) { return !(lhs < rhs); }
+
+	private:
+		const std::string	*m_str;
+		std::uint64_t		m_prefix;
+
+		//Returns the pooled copy of a string; the elements of an unordered_set keep their addresses when it grows
+		static const std::string* intern(const std::string &str)
+		{
+			static std::mutex lock;
+			static std::unordered_set<std::string> pool;
+			std::lock_guard<std::mutex> guard(lock);
+			return &*pool.insert(str).first;
+		}
+		//Default constructed keys, e.g. the temporaries of Tuple, share the empty string without locking the pool
+		static const std::string* empty()
+		{
+			static const std::string *str = intern(std::string());
+			return str;
+		}
+	};
+}
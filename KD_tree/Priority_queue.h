@@ -20,6 +20,8 @@ namespace BK_heap
 		typedef	typename Container::size_type	size_type;
 
 		explicit Priority_queue	(const Compare &comp = Compare()) : end_pos(0), c(comp) {}
+		//Stores the heap in an empty container, e.g. one that was constructed with an allocator
+		explicit Priority_queue	(Container &&storage, const Compare &comp = Compare()) : arr(std::move(storage)), end_pos(0), c(comp) { assert(arr.empty()); }
 		Priority_queue			(const Priority_queue &h) : arr(h.arr), end_pos(h.end_pos), c(h.c) {}
 		Priority_queue			(Priority_queue &&h) : arr(std::move(h.arr)), end_pos(h.end_pos), c(std::move(h.c)) {}
 		template<typename InputIterator>
@@ -156,7 +158,7 @@ namespace BK_heap
 	{
 		size_type lc = left_child(pos), rc = lc + 1;
 		if (rc < end_pos)
-			return arr[lc] < arr[rc] ? rc : lc;
+			return c(arr[lc], arr[rc]) ? rc : lc;
 		else if (lc < end_pos)
 			return lc;
 		else
@@ -199,16 +201,12 @@ namespace BK_heap
 	{
 		using std::swap;
 
-		size_type largest;
-		try //if the left child exists
-		{
-			//find the largest child
-			largest = largest_child(pos);
-		}
-		catch(...) //otherwise, the bottom of the heap has been reached and we are done
-		{
+		//if the left child does not exist, the bottom of the heap has been reached and we are done
+		if (left_child(pos) >= end_pos)
 			return;
-		}
+
+		//find the largest child
+		size_type largest = largest_child(pos);
 
 		//if the current node is smaller than the largest child
 		if (c(arr[pos], arr[largest]))
@@ -0,0 +1,437 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <random>
+#include <utility>
+#include <vector>
+#include "KD_tree.h"
+
+namespace BK_KD_tree
+{
+	//A vantage point tree (P. N. Yianilos, "Data structures and algorithms for nearest neighbor search in general metric spaces", 1993)
+	//with the interface of KD_tree, so that either can be chosen by a typedef. A node holds a value, the vantage point, and the median mu
+	//of the distances from its key to the keys of its subtree; keys closer than mu go to the inside subtree and the others to the outside
+	//one. The tree only measures distances between whole keys with get_cartesian_distance, so it prunes well for metrics whose distance
+	//to an axis aligned plane is a poor bound or undefined, e.g. the haversine distance or the edit distance of a string dimension.
+	//Metric::get_cartesian_distance must be a metric: symmetric, zero only for equal keys and obeying the triangle inequality, so a
+	//euclidean distance works but its square does not. The Distance_op of a search must measure the same distances as the Metric.
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	class VP_tree
+	{
+	private:
+		typedef KD_tree_traits<Dim, Mapped, PredWrapper, DimWrapper, Mfl> tree_traits;
+	public:
+		typedef typename tree_traits::mapped_type				mapped_type;
+		typedef typename tree_traits::key_type					key_type;
+		typedef typename tree_traits::value_type				value_type;
+		typedef typename tree_traits::size_type					size_type;
+		typedef typename tree_traits::key_compare				key_compare;
+		typedef Metric											metric_type;
+		typedef typename std::pair<double, const mapped_type*>	KNN_type;
+		typedef typename std::vector<KNN_type>					KNN_container_type;
+
+		VP_tree(const metric_type &metric = metric_type(), const key_compare &compare = key_compare()) : m_root(npos), m_metric(metric), m_comp(compare) {}
+		//Builds a balanced tree over a range of values
+		template<typename InputIterator>
+		VP_tree(InputIterator first, InputIterator last, const metric_type &metric = metric_type(), const key_compare &compare = key_compare());
+
+		//Inserts a value or overwrites the mapped value of an equal key. The nodes are stored in one array, so inserts invalidate
+		//references to the values and the results of searches.
+		template<typename... Coords>
+		value_type& insert(const mapped_type &mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), mapped }); }
+		template<typename... Coords>
+		value_type& insert(mapped_type &&mapped, Coords&&... coordinates) { return insert_op(value_type{ key_type(std::forward<Coords>(coordinates)...), std::move(mapped) }); }
+		value_type& insert(const value_type &value) { return insert_op(value_type(value)); }
+		value_type& insert(value_type &&value) { return insert_op(std::move(value)); }
+		template<typename... Coords>
+		size_t erase(Coords&&... coordinates) { return erase_op(key_type(std::forward<Coords>(coordinates)...)); }
+
+		mapped_type& operator[](const key_type &key);
+		const mapped_type& operator[](const key_type &key) const { return at(key); }
+		mapped_type& at(const key_type &key);
+		const mapped_type& at(const key_type &key) const;
+		bool contains(const key_type &key) const { return find_op(key) != npos; }
+		bool empty() const { return m_root == npos; }
+		size_t size() const { return m_root == npos ? 0 : m_nodes[m_root].size; }
+		void clear();
+
+		//Finds the k nearest values, or every value if k is 0
+		template<typename Distance_op>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key) const { No_stats stats; return KNN_search(k, distance, key, stats); }
+		//Report every step of the query to a stats policy such as Search_stats; a test of a child against the median counts as a plane test
+		template<typename Distance_op, typename Stats>
+		KNN_container_type KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const;
+		//Finds every value whose distance from key is at most radius, as (distance, mapped pointer) pairs in no particular order
+		template<typename Distance_op>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key) const { No_stats stats; return radius_search(radius, distance, key, stats); }
+		template<typename Distance_op, typename Stats>
+		KNN_container_type radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const;
+
+	private:
+		typedef detail::bounded_priority_queue<KNN_type, KNN_container_type> queue_type;
+		typedef detail::KD_tree_search<tree_traits> search_type;
+
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		//Nodes refer to their children by index. The slots of erased nodes are reused by later inserts.
+		struct node
+		{
+			value_type	value;
+			double		mu;
+			size_t		inside, outside;
+			size_t		size;
+		};
+
+		std::vector<node>	m_nodes;
+		std::vector<size_t>	m_free;
+		size_t				m_root;
+		metric_type			m_metric;
+		key_compare			m_comp;
+		std::minstd_rand	m_engine;
+
+		double distance_to(size_t index, const key_type &key) const { return m_metric.get_cartesian_distance(tree_traits::val_to_key(m_nodes[index].value), key); }
+		bool is_leaf(size_t index) const { return m_nodes[index].inside == npos && m_nodes[index].outside == npos; }
+		//Keys at distance mu from the vantage point go outside, during builds as well as during inserts, so equal keys take the same path
+		size_t& child(size_t index, double dist) { return dist < m_nodes[index].mu ? m_nodes[index].inside : m_nodes[index].outside; }
+		size_t child_size(size_t index) const { return index == npos ? 0 : m_nodes[index].size; }
+
+		//Returns the index of the node with the given key or npos
+		size_t find_op(const key_type &key) const;
+		value_type& insert_op(value_type &&value);
+		size_t erase_op(const key_type &key);
+		//Links the nodes listed in [first, last) into a balanced subtree and returns its root
+		size_t build_op(size_t *first, size_t *last);
+		//Lists the nodes of a subtree
+		void collect_op(size_t index, std::vector<size_t> &nodes) const;
+		size_t allocate_op(value_type &&value);
+
+		template<typename Distance_op, typename Stats>
+		void KNN_search_op(size_t index, Distance_op &distance, const key_type &key, queue_type &q, Stats &stats) const;
+		template<typename Distance_op, typename Stats>
+		void radius_search_op(size_t index, Distance_op &distance, const key_type &key, double radius, KNN_container_type &result, Stats &stats) const;
+	};
+
+//---------------------------------------------------------------------------------------------
+
+	//C++14 builds need the definition of a constant that is bound to a reference
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	constexpr size_t VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::npos;
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	template<typename InputIterator>
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::VP_tree(InputIterator first, InputIterator last, const metric_type &metric, const key_compare &compare)
+		: m_root(npos), m_metric(metric), m_comp(compare)
+	{
+		//the range may hold equal keys, so the values are inserted one at a time and the last mapped value of a key wins
+		for (; first != last; ++first)
+			insert_op(value_type(*first));
+		std::vector<size_t> nodes;
+		collect_op(m_root, nodes);
+		m_root = build_op(nodes.data(), nodes.data() + nodes.size());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::mapped_type&
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::operator[](const key_type &key)
+	{
+		size_t index = find_op(key);
+		return tree_traits::val_to_mapped(index != npos ? m_nodes[index].value : insert_op(value_type{ key, mapped_type() }));
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::mapped_type&
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::at(const key_type &key)
+	{
+		size_t index = find_op(key);
+		if (index == npos)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(m_nodes[index].value);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	const typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::mapped_type&
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::at(const key_type &key) const
+	{
+		size_t index = find_op(key);
+		if (index == npos)
+			throw not_found("Key not found");
+		return tree_traits::val_to_mapped(m_nodes[index].value);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	void
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::clear()
+	{
+		m_nodes.clear();
+		m_free.clear();
+		m_root = npos;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	size_t
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::find_op(const key_type &key) const
+	{
+		size_t current = m_root;
+		while (current != npos && !search_type::compare_keys(m_comp, tree_traits::val_to_key(m_nodes[current].value), key))
+			current = distance_to(current, key) < m_nodes[current].mu ? m_nodes[current].inside : m_nodes[current].outside;
+		return current;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::value_type&
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::insert_op(value_type &&value)
+	{
+		const key_type &key = tree_traits::val_to_key(value);
+		std::vector<size_t> path;
+		size_t current = m_root;
+		double dist = 0.0;
+		while (current != npos)
+		{
+			if (search_type::compare_keys(m_comp, tree_traits::val_to_key(m_nodes[current].value), key))
+			{
+				tree_traits::val_to_mapped(m_nodes[current].value) = std::move(tree_traits::val_to_mapped(value));
+				return m_nodes[current].value;
+			}
+			path.push_back(current);
+			dist = distance_to(current, key);
+			//a leaf takes the distance to its first child as its median
+			if (is_leaf(current))
+				m_nodes[current].mu = dist;
+			current = child(current, dist);
+		}
+
+		size_t inserted = allocate_op(std::move(value));
+		if (path.empty())
+			m_root = inserted;
+		else
+			child(path.back(), dist) = inserted;
+		for (size_t index : path)
+			++m_nodes[index].size;
+
+		//like a scapegoat tree, rebuild the highest subtree on the path where one side holds more than three quarters of the nodes
+		for (size_t i = 0; i < path.size(); ++i)
+		{
+			const node &top = m_nodes[path[i]];
+			size_t larger = std::max(child_size(top.inside), child_size(top.outside));
+			if (top.size < 8 || larger * 4 <= top.size * 3)
+				continue;
+			std::vector<size_t> nodes;
+			collect_op(path[i], nodes);
+			size_t root = build_op(nodes.data(), nodes.data() + nodes.size());
+			if (i == 0)
+				m_root = root;
+			else
+				m_nodes[path[i - 1]].inside == path[i] ? m_nodes[path[i - 1]].inside = root : m_nodes[path[i - 1]].outside = root;
+			break;
+		}
+		return m_nodes[inserted].value;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	size_t
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::erase_op(const key_type &key)
+	{
+		std::vector<size_t> path;
+		size_t current = m_root;
+		while (current != npos && !search_type::compare_keys(m_comp, tree_traits::val_to_key(m_nodes[current].value), key))
+		{
+			path.push_back(current);
+			current = child(current, distance_to(current, key));
+		}
+		if (current == npos)
+			return 0;
+
+		//the remaining nodes of the subtree of the erased node are rebuilt around a new vantage point
+		std::vector<size_t> nodes;
+		collect_op(current, nodes);
+		nodes.erase(std::find(nodes.begin(), nodes.end(), current));
+		size_t root = build_op(nodes.data(), nodes.data() + nodes.size());
+		if (path.empty())
+			m_root = root;
+		else
+			m_nodes[path.back()].inside == current ? m_nodes[path.back()].inside = root : m_nodes[path.back()].outside = root;
+		for (size_t index : path)
+			--m_nodes[index].size;
+
+		//release the resources of the value, e.g. the memory of a string
+		m_nodes[current].value = value_type();
+		m_free.push_back(current);
+		return 1;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	size_t
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::build_op(size_t *first, size_t *last)
+	{
+		if (first == last)
+			return npos;
+
+		//a random vantage point
+		std::swap(*first, first[std::uniform_int_distribution<size_t>(0, size_t(last - first) - 1)(m_engine)]);
+		size_t root = *first;
+		node &vantage = m_nodes[root];
+		vantage.size = size_t(last - first);
+		vantage.inside = vantage.outside = npos;
+		vantage.mu = 0.0;
+		if (++first == last)
+			return root;
+
+		std::vector<std::pair<double, size_t>> distances;
+		distances.reserve(size_t(last - first));
+		for (size_t *it = first; it != last; ++it)
+			distances.emplace_back(distance_to(root, tree_traits::val_to_key(m_nodes[*it].value)), *it);
+		auto middle = distances.begin() + distances.size() / 2;
+		std::nth_element(distances.begin(), middle, distances.end());
+		double mu = middle->first;
+		//keys at distance mu belong to the outside subtree, which may therefore hold more than half of the keys
+		auto split = std::partition(distances.begin(), distances.end(), [mu](const std::pair<double, size_t> &entry) { return entry.first < mu; });
+		for (size_t i = 0; i < distances.size(); ++i)
+			first[i] = distances[i].second;
+
+		size_t *boundary = first + (split - distances.begin());
+		size_t inside = build_op(first, boundary), outside = build_op(boundary, last);
+		m_nodes[root].mu = mu;
+		m_nodes[root].inside = inside;
+		m_nodes[root].outside = outside;
+		return root;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	void
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::collect_op(size_t index, std::vector<size_t> &nodes) const
+	{
+		if (index == npos)
+			return;
+		nodes.push_back(index);
+		collect_op(m_nodes[index].inside, nodes);
+		collect_op(m_nodes[index].outside, nodes);
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	size_t
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::allocate_op(value_type &&value)
+	{
+		if (m_free.empty())
+		{
+			m_nodes.push_back(node{ std::move(value), 0.0, npos, npos, 1 });
+			return m_nodes.size() - 1;
+		}
+		size_t index = m_free.back();
+		m_free.pop_back();
+		m_nodes[index] = node{ std::move(value), 0.0, npos, npos, 1 };
+		return index;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	template<typename Distance_op, typename Stats>
+	typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::KNN_container_type
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::KNN_search(size_t k, Distance_op distance, const key_type &key, Stats &stats) const
+	{
+		queue_type q(k);
+		KNN_search_op(m_root, distance, key, q, stats);
+		return std::move(q.data());
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	template<typename Distance_op, typename Stats>
+	typename VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::KNN_container_type
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::radius_search(double radius, Distance_op distance, const key_type &key, Stats &stats) const
+	{
+		KNN_container_type result;
+		radius_search_op(m_root, distance, key, radius, result, stats);
+		return result;
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	template<typename Distance_op, typename Stats>
+	void
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::KNN_search_op(size_t index, Distance_op &distance, const key_type &key, queue_type &q, Stats &stats) const
+	{
+		if (index == npos)
+			return;
+
+		stats.enter_node();
+		const node &current = m_nodes[index];
+		double dist = distance.get_cartesian_distance(tree_traits::val_to_key(current.value), key);
+		stats.distance_evaluated();
+		if (q.full() && dist < q.top().first)
+			stats.queue_replaced();
+		q.push(KNN_type{ dist, &tree_traits::val_to_mapped(current.value) });
+
+		//search the side of the test point first; by the triangle inequality, a key inside is at least dist - mu away from the test point
+		//and a key outside at least mu - dist
+		bool go_inside = dist < current.mu;
+		KNN_search_op(go_inside ? current.inside : current.outside, distance, key, q, stats);
+		size_t far_child = go_inside ? current.outside : current.inside;
+		if (far_child != npos)
+		{
+			stats.plane_tested();
+			double bound = go_inside ? current.mu - dist : dist - current.mu;
+			if (!q.full() || bound <= q.top().first)
+				KNN_search_op(far_child, distance, key, q, stats);
+			else
+				stats.subtree_pruned();
+		}
+		stats.leave_node();
+	}
+
+//---------------------------------------------------------------------------------------------
+
+	template<size_t Dim, typename Mapped, typename PredWrapper, typename DimWrapper, bool Mfl, typename Metric>
+	template<typename Distance_op, typename Stats>
+	void
+	VP_tree<Dim, Mapped, PredWrapper, DimWrapper, Mfl, Metric>::radius_search_op(size_t index, Distance_op &distance, const key_type &key, double radius, KNN_container_type &result, Stats &stats) const
+	{
+		if (index == npos)
+			return;
+
+		stats.enter_node();
+		const node &current = m_nodes[index];
+		double dist = distance.get_cartesian_distance(tree_traits::val_to_key(current.value), key);
+		stats.distance_evaluated();
+		if (!(radius < dist))
+			result.push_back(KNN_type{ dist, &tree_traits::val_to_mapped(current.value) });
+
+		const size_t children[] = { current.inside, current.outside };
+		const double bounds[] = { dist - current.mu, current.mu - dist };
+		for (size_t i = 0; i < 2; ++i)
+		{
+			if (children[i] == npos)
+				continue;
+			stats.plane_tested();
+			if (!(radius < bounds[i]))
+				radius_search_op(children[i], distance, key, radius, result, stats);
+			else
+				stats.subtree_pruned();
+		}
+		stats.leave_node();
+	}
+}
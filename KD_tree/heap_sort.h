@@ -1,12 +1,25 @@
 #pragma once
 
 #include <utility>
+#include <vector>
+#include <cassert>
 #include <functional>
 #include <iterator>
 #include <cmath>
 
 namespace BK_sort
 {
+	template<typename ForwardIterator, typename Compare>
+	void _make_heap(ForwardIterator begin, ForwardIterator end, Compare &comp, const std::forward_iterator_tag &tag);
+	template<typename RandomAccessIterator, typename Compare>
+	void _make_heap(RandomAccessIterator begin, RandomAccessIterator end, Compare &comp, const std::random_access_iterator_tag &tag);
+	template<typename RandomAccessIterator, typename Compare>
+	void shift_down(RandomAccessIterator begin, RandomAccessIterator init_pos, RandomAccessIterator end, Compare &comp);
+	template<typename ForwardIterator, typename Compare>
+	void _heap_sort(ForwardIterator begin, ForwardIterator end, Compare &comp, const std::input_iterator_tag &tag);
+	template<typename RandomAccessIterator, typename Compare>
+	void _heap_sort(RandomAccessIterator begin, RandomAccessIterator end, Compare &comp, const std::random_access_iterator_tag &tag);
+
 	template<typename ForwardIterator, typename Compare>
 	void make_heap(ForwardIterator begin, ForwardIterator end, Compare comp)
 	{
@@ -39,6 +39,12 @@ namespace BK_Tuple
 	private:
 		T elem;
 		Tuple<Args...> next;
+
+		//Overload set that stops the recursion of get once index reaches 0
+		template<size_t index, typename... _Args>
+		static const typename Element_type<index, Tuple<_Args...>>::type& get_op(const Tuple<_Args...> &tup, std::true_type) { return tup.elem; }
+		template<size_t index, typename... _Args>
+		static const typename Element_type<index, Tuple<_Args...>>::type& get_op(const Tuple<_Args...> &tup, std::false_type);
 	};
 
 	template<typename T, typename ...Args>
@@ -155,12 +161,14 @@ namespace BK_Tuple
 	template<size_t index, typename... _Args>
 	const typename Element_type<index, Tuple<_Args...>>::type& Tuple<T, Args...>::get(const Tuple<_Args...> &tup)
 	{
-		using ret_type = const typename Element_type<index, Tuple<_Args...>>::type;
+		return get_op<index>(tup, std::integral_constant<bool, index == 0>());
+	}
 
-		if (index == 0)
-			return *(reinterpret_cast<ret_type*>(&tup.elem));
-		else
-			return *(reinterpret_cast<ret_type*>(&decltype(tup.next)::get<index - 1>(tup.next)));
+	template<typename T, typename... Args>
+	template<size_t index, typename... _Args>
+	const typename Element_type<index, Tuple<_Args...>>::type& Tuple<T, Args...>::get_op(const Tuple<_Args...> &tup, std::false_type)
+	{
+		return decltype(tup.next)::template get<index - 1>(tup.next);
 	}
 
 	template<typename T>
@@ -196,12 +204,13 @@ namespace BK_Tuple
 	struct Tuple_compare : Tuple<Preds...>
 	{
 		Tuple_compare() = default;
-		Tuple_compare(const Preds&... args) : Tuple(args...) {}
+		Tuple_compare(const Preds&... args) : Tuple<Preds...>(args...) {}
 		
+		//A single predicate is shared by all dimensions
 		template<size_t index>
 		bool compare(const Tuple_type &lhs, const Tuple_type &rhs) const
 		{
-			return Tuple::get<index>(*this)(Tuple_type::get<index>(lhs), Tuple_type::get<index>(rhs));
+			return Tuple<Preds...>::template get<sizeof...(Preds) == 1 ? 0 : index>(*this)(Tuple_type::template get<index>(lhs), Tuple_type::template get<index>(rhs));
 		}
 		
 		static constexpr size_t dimension() { return sizeof...(Preds); }